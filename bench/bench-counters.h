@@ -0,0 +1,16 @@
+#pragma once
+
+#include <stdint.h>
+
+/* File system calls and allocations made since the start, counted by the
+ * libobs stubs. On Linux the calls the index makes to libc directly are
+ * counted too. */
+struct bench_counters {
+	uint64_t allocs;
+	uint64_t opens;
+	uint64_t stats;
+	uint64_t dir_reads;
+	uint64_t closes;
+};
+
+void bench_counters_get(struct bench_counters *counters);
@@ -0,0 +1,497 @@
+/* Scan benchmark for the directory index.
+ *
+ * Fills a directory with synthetic files, then for every sort mode times
+ * scans and selections while a share of the files changes between scans.
+ * Two kinds of scans are measured: "scan" lists the directory like the
+ * interval poll does, "refresh" only updates the changed files like the
+ * watcher does on change notifications. */
+
+#include "dir-watch-index.h"
+#include "bench-counters.h"
+#include <util/platform.h>
+#include <util/dstr.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <stdio.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+struct options {
+	const char *directory;
+	DARRAY(long) counts;
+	DARRAY(double) churns;
+	int iterations;
+	int subdirectories;
+	const char *extensions;
+	const char *filter;
+	uint64_t seed;
+	bool keep;
+};
+
+struct tree {
+	char *directory;
+	bool created;
+	int subdirectories;
+	DARRAY(char *) files;
+	uint64_t next_id;
+	uint64_t random;
+};
+
+struct run {
+	DARRAY(double) times;
+	struct bench_counters total;
+	double first_ms;
+};
+
+static const char *sort_names[] = {
+	"created_newest",       "created_oldest",      "modified_newest",
+	"modified_oldest",      "alphabetically_first", "alphabetically_last",
+	"random",
+};
+
+static uint64_t next_random(struct tree *tree)
+{
+	uint64_t x = (tree->random += 0x9E3779B97F4A7C15ULL);
+	x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+	x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+	return x ^ (x >> 31);
+}
+
+/* ------------------------------------------------------------------------- */
+/* synthetic files */
+
+/* Names in the shapes seen in ingest folders, some without a matching or
+ * any extension */
+static void file_name(struct tree *tree, struct dstr *name)
+{
+	const uint64_t id = tree->next_id++;
+	const uint64_t r = next_random(tree);
+	dstr_init(name);
+	if (tree->subdirectories)
+		dstr_catf(name, "sub%03d/", (int)(r % tree->subdirectories));
+	switch ((r >> 16) % 8) {
+	case 0:
+	case 1:
+		dstr_catf(name, "clip_%07llu.mp4", (unsigned long long)id);
+		break;
+	case 2:
+		dstr_catf(name, "IMG %04d-%02d-%02d %06llu.MOV",
+			  2000 + (int)(r >> 24) % 25, 1 + (int)(r >> 32) % 12,
+			  1 + (int)(r >> 40) % 28, (unsigned long long)id);
+		break;
+	case 3:
+		dstr_catf(name, "render.v%llu.final.mkv",
+			  (unsigned long long)id);
+		break;
+	case 4:
+		dstr_catf(name, "frame%08llu.png", (unsigned long long)id);
+		break;
+	case 5:
+		dstr_catf(name, "notes %llu.txt", (unsigned long long)id);
+		break;
+	case 6:
+		dstr_catf(name, "Replay %llu.mp4", (unsigned long long)id);
+		break;
+	default:
+		dstr_catf(name, "README_%llu", (unsigned long long)id);
+		break;
+	}
+}
+
+static void file_path(const struct tree *tree, const char *name,
+		      struct dstr *path)
+{
+	dstr_copy(path, tree->directory);
+	dstr_cat_ch(path, '/');
+	dstr_cat(path, name);
+}
+
+/* Writes the file with a modification time age seconds ago */
+static bool file_write(const struct tree *tree, const char *name,
+		       long long age)
+{
+	struct dstr path;
+	dstr_init(&path);
+	file_path(tree, name, &path);
+	const int fd = open(path.array, O_CREAT | O_WRONLY | O_APPEND, 0644);
+	bool success = fd >= 0 && write(fd, "x", 1) == 1;
+	if (fd >= 0)
+		close(fd);
+	struct timespec times[2];
+	clock_gettime(CLOCK_REALTIME, &times[0]);
+	times[0].tv_sec -= age;
+	times[1] = times[0];
+	success = success && utimensat(AT_FDCWD, path.array, times, 0) == 0;
+	if (!success)
+		fprintf(stderr, "failed to write %s: %s\n", path.array,
+			strerror(errno));
+	dstr_free(&path);
+	return success;
+}
+
+static void file_remove(const struct tree *tree, const char *name)
+{
+	struct dstr path;
+	dstr_init(&path);
+	file_path(tree, name, &path);
+	unlink(path.array);
+	dstr_free(&path);
+}
+
+static bool file_add(struct tree *tree, long long age)
+{
+	struct dstr name;
+	file_name(tree, &name);
+	if (!file_write(tree, name.array, age)) {
+		dstr_free(&name);
+		return false;
+	}
+	da_push_back(tree->files, &name.array);
+	return true;
+}
+
+static bool tree_create(struct tree *tree, const struct options *options,
+			long count)
+{
+	memset(tree, 0, sizeof(*tree));
+	tree->random = options->seed;
+	tree->subdirectories = options->subdirectories;
+	if (options->directory) {
+		tree->directory = bstrdup(options->directory);
+		mkdir(tree->directory, 0755);
+	} else {
+		char temp[] = "/tmp/dir-watch-media-bench-XXXXXX";
+		if (!mkdtemp(temp)) {
+			fprintf(stderr, "failed to create a directory\n");
+			return false;
+		}
+		tree->directory = bstrdup(temp);
+		tree->created = true;
+	}
+	struct dstr path;
+	dstr_init(&path);
+	for (int i = 0; i < tree->subdirectories; i++) {
+		dstr_copy(&path, tree->directory);
+		dstr_catf(&path, "/sub%03d", i);
+		mkdir(path.array, 0755);
+	}
+	dstr_free(&path);
+
+	/* spread over the last 30 days so the time sorts have work to do */
+	for (long i = 0; i < count; i++) {
+		const long long age = (long long)(next_random(tree) % 2592000);
+		if (!file_add(tree, age))
+			return false;
+	}
+	return true;
+}
+
+static void tree_free(struct tree *tree, bool keep)
+{
+	for (size_t i = 0; i < tree->files.num; i++) {
+		if (!keep)
+			file_remove(tree, tree->files.array[i]);
+		bfree(tree->files.array[i]);
+	}
+	da_free(tree->files);
+	if (!keep) {
+		struct dstr path;
+		dstr_init(&path);
+		for (int i = 0; i < tree->subdirectories; i++) {
+			dstr_copy(&path, tree->directory);
+			dstr_catf(&path, "/sub%03d", i);
+			rmdir(path.array);
+		}
+		dstr_free(&path);
+		if (tree->created)
+			rmdir(tree->directory);
+	}
+	bfree(tree->directory);
+}
+
+/* Replaces half of the changed files with new ones and writes to the other
+ * half, the names involved are added to changed */
+static void tree_churn(struct tree *tree, double churn, void *changed_ptr)
+{
+	DARRAY(char *) *changed = changed_ptr;
+	size_t count = (size_t)((double)tree->files.num * churn / 100.0);
+	if (churn > 0.0 && !count)
+		count = 1;
+	for (size_t i = 0; i < count && tree->files.num; i++) {
+		const size_t index = next_random(tree) % tree->files.num;
+		char *name = tree->files.array[index];
+		if (i % 2) {
+			file_write(tree, name, 0);
+			char *copy = bstrdup(name);
+			da_push_back(*changed, &copy);
+			continue;
+		}
+		file_remove(tree, name);
+		da_push_back(*changed, &name);
+		tree->files.array[index] =
+			tree->files.array[tree->files.num - 1];
+		tree->files.num--;
+		if (file_add(tree, 0)) {
+			char *copy =
+				bstrdup(tree->files.array[tree->files.num - 1]);
+			da_push_back(*changed, &copy);
+		}
+	}
+}
+
+/* ------------------------------------------------------------------------- */
+/* measuring */
+
+static void counters_add(struct bench_counters *total,
+			 const struct bench_counters *before,
+			 const struct bench_counters *after)
+{
+	total->allocs += after->allocs - before->allocs;
+	total->opens += after->opens - before->opens;
+	total->stats += after->stats - before->stats;
+	total->dir_reads += after->dir_reads - before->dir_reads;
+	total->closes += after->closes - before->closes;
+}
+
+static double elapsed_ms(uint64_t start)
+{
+	return (double)(os_gettime_ns() - start) / 1000000.0;
+}
+
+static int compare_double(const void *a, const void *b)
+{
+	const double x = *(const double *)a;
+	const double y = *(const double *)b;
+	return x < y ? -1 : x > y;
+}
+
+/* nearest rank */
+static double percentile(const double *sorted, size_t count, double p)
+{
+	if (!count)
+		return 0.0;
+	size_t rank = (size_t)ceil(p / 100.0 * (double)count);
+	if (rank < 1)
+		rank = 1;
+	return sorted[rank - 1];
+}
+
+static void run_sort(struct tree *tree, const struct options *options,
+		     struct dir_watch_matcher *matcher, enum sort_by sort_by,
+		     double churn, bool refresh, struct run *run)
+{
+	memset(run, 0, sizeof(*run));
+	const int max_depth = tree->subdirectories ? 1 : 0;
+	struct dir_watch_index index;
+	struct dir_watch_view view;
+	dir_watch_index_init(&index);
+	dir_watch_index_set_directory(&index, tree->directory, max_depth);
+	dir_watch_view_init(&view);
+	view.random_state = options->seed;
+	dir_watch_view_update(&view, matcher, sort_by, max_depth);
+	dir_watch_index_add_view(&index, &view);
+
+	time_t time = 0;
+	uint64_t start = os_gettime_ns();
+	dir_watch_index_scan(&index, true);
+	dir_watch_view_select(&view, &time);
+	dir_watch_index_close(&index);
+	run->first_ms = elapsed_ms(start);
+
+	DARRAY(char *) changed;
+	da_init(changed);
+	for (int i = 0; i < options->iterations; i++) {
+		tree_churn(tree, churn, &changed);
+
+		struct bench_counters before, after;
+		bench_counters_get(&before);
+		start = os_gettime_ns();
+		if (refresh) {
+			for (size_t j = 0; j < changed.num; j++)
+				dir_watch_index_refresh(&index,
+							changed.array[j]);
+		} else {
+			dir_watch_index_scan(&index, false);
+		}
+		dir_watch_view_select(&view, &time);
+		dir_watch_index_close(&index);
+		const double ms = elapsed_ms(start);
+		bench_counters_get(&after);
+
+		da_push_back(run->times, &ms);
+		counters_add(&run->total, &before, &after);
+		for (size_t j = 0; j < changed.num; j++)
+			bfree(changed.array[j]);
+		changed.num = 0;
+	}
+	da_free(changed);
+
+	dir_watch_index_remove_view(&index, &view);
+	dir_watch_view_free(&view);
+	dir_watch_index_free(&index);
+}
+
+static void print_header(void)
+{
+	printf("%9s %6s %-8s %-20s %9s %9s %9s %9s %9s %8s %8s %8s %9s\n",
+	       "files", "churn%", "mode", "sort", "first ms", "p50 ms",
+	       "p90 ms", "p99 ms", "max ms", "stat/s", "open/s", "read/s",
+	       "alloc/s");
+}
+
+static void print_run(long count, double churn, bool refresh,
+		      enum sort_by sort_by, struct run *run)
+{
+	const size_t n = run->times.num;
+	qsort(run->times.array, n, sizeof(double), compare_double);
+	const double scans = n ? (double)n : 1.0;
+	printf("%9ld %6.2f %-8s %-20s %9.3f %9.3f %9.3f %9.3f %9.3f %8.1f %8.1f %8.1f %9.1f\n",
+	       count, churn, refresh ? "refresh" : "scan", sort_names[sort_by],
+	       run->first_ms, percentile(run->times.array, n, 50),
+	       percentile(run->times.array, n, 90),
+	       percentile(run->times.array, n, 99),
+	       n ? run->times.array[n - 1] : 0.0,
+	       (double)run->total.stats / scans,
+	       (double)(run->total.opens + run->total.closes) / scans,
+	       (double)run->total.dir_reads / scans,
+	       (double)run->total.allocs / scans);
+	fflush(stdout);
+}
+
+/* ------------------------------------------------------------------------- */
+/* options */
+
+static void usage(const char *name)
+{
+	fprintf(stderr,
+		"usage: %s [options]\n"
+		"  -d DIR      directory for the files, a new temporary one by default\n"
+		"  -n COUNTS   file counts, comma separated (1000,10000,100000)\n"
+		"  -c CHURN    percentages of the files changed before each scan (0,1,10)\n"
+		"  -i N        scans per run (20)\n"
+		"  -s N        spread the files over N subdirectories (0)\n"
+		"  -e EXT      extension setting (mp4,mov,mkv)\n"
+		"  -f FILTER   filter setting\n"
+		"  -r SEED     random seed (1)\n"
+		"  -k          keep the files\n"
+		"\n"
+		"stat/s, open/s and read/s are file system calls per scan, open\n"
+		"counts opening and closing, read counts directory entries read.\n"
+		"alloc/s are allocations per scan.\n",
+		name);
+}
+
+static bool parse_list(const char *arg, bool integers, void *list_ptr)
+{
+	DARRAY(double) *list = list_ptr;
+	char **values = strlist_split(arg, ',', false);
+	bool valid = values && *values;
+	for (char **value = values; valid && *value; value++) {
+		char *end;
+		errno = 0;
+		const double number = strtod(*value, &end);
+		valid = !errno && *end == 0 && number >= 0.0;
+		if (valid && integers) {
+			long count = (long)number;
+			darray_push_back(sizeof(long), &list->da, &count);
+		} else if (valid) {
+			da_push_back(*list, &number);
+		}
+	}
+	strlist_free(values);
+	return valid;
+}
+
+static bool parse_options(int argc, char **argv, struct options *options)
+{
+	memset(options, 0, sizeof(*options));
+	options->iterations = 20;
+	options->extensions = "mp4,mov,mkv";
+	options->seed = 1;
+	int opt;
+	while ((opt = getopt(argc, argv, "d:n:c:i:s:e:f:r:kh")) != -1) {
+		switch (opt) {
+		case 'd':
+			options->directory = optarg;
+			break;
+		case 'n':
+			if (!parse_list(optarg, true, &options->counts))
+				return false;
+			break;
+		case 'c':
+			if (!parse_list(optarg, false, &options->churns))
+				return false;
+			break;
+		case 'i':
+			options->iterations = atoi(optarg);
+			break;
+		case 's':
+			options->subdirectories = atoi(optarg);
+			break;
+		case 'e':
+			options->extensions = optarg;
+			break;
+		case 'f':
+			options->filter = optarg;
+			break;
+		case 'r':
+			options->seed = strtoull(optarg, NULL, 10);
+			break;
+		case 'k':
+			options->keep = true;
+			break;
+		default:
+			return false;
+		}
+	}
+	if (!options->counts.num)
+		parse_list("1000,10000,100000", true, &options->counts);
+	if (!options->churns.num)
+		parse_list("0,1,10", false, &options->churns);
+	return options->iterations > 0 && options->subdirectories >= 0 &&
+	       options->subdirectories <= 1000;
+}
+
+int main(int argc, char **argv)
+{
+	struct options options;
+	if (!parse_options(argc, argv, &options)) {
+		usage(argv[0]);
+		return 1;
+	}
+	struct dir_watch_matcher *matcher =
+		dir_watch_matcher_create(options.filter, options.extensions);
+
+	int result = 0;
+	print_header();
+	for (size_t i = 0; i < options.counts.num && !result; i++) {
+		const long count = options.counts.array[i];
+		struct tree tree;
+		if (!tree_create(&tree, &options, count)) {
+			tree_free(&tree, options.keep);
+			result = 1;
+			break;
+		}
+		for (size_t j = 0; j < options.churns.num; j++) {
+			const double churn = options.churns.array[j];
+			for (int refresh = 0; refresh < 2; refresh++) {
+				for (int sort = 0; sort <= sort_random; sort++) {
+					struct run run;
+					run_sort(&tree, &options, matcher,
+						 (enum sort_by)sort, churn,
+						 refresh, &run);
+					print_run(count, churn, refresh,
+						  (enum sort_by)sort, &run);
+					da_free(run.times);
+				}
+			}
+		}
+		tree_free(&tree, options.keep);
+	}
+
+	dir_watch_matcher_release(matcher);
+	da_free(options.counts);
+	da_free(options.churns);
+	return result;
+}
@@ -0,0 +1,430 @@
+#ifdef __linux__
+/* statx */
+#define _GNU_SOURCE
+#endif
+#include "bench-counters.h"
+#include <util/base.h>
+#include <util/bmem.h>
+#include <util/dstr.h>
+#include <util/platform.h>
+#include <util/threading.h>
+#include <stdio.h>
+#include <strings.h>
+#include <time.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+static volatile long allocs;
+static volatile uint64_t opens;
+static volatile uint64_t stats;
+static volatile uint64_t dir_reads;
+static volatile uint64_t closes;
+
+#define COUNT(counter) __atomic_add_fetch(&counter, 1, __ATOMIC_RELAXED)
+
+void bench_counters_get(struct bench_counters *counters)
+{
+	counters->allocs = (uint64_t)__atomic_load_n(&allocs, __ATOMIC_RELAXED);
+	counters->opens = __atomic_load_n(&opens, __ATOMIC_RELAXED);
+	counters->stats = __atomic_load_n(&stats, __ATOMIC_RELAXED);
+	counters->dir_reads = __atomic_load_n(&dir_reads, __ATOMIC_RELAXED);
+	counters->closes = __atomic_load_n(&closes, __ATOMIC_RELAXED);
+}
+
+/* ------------------------------------------------------------------------- */
+/* util/bmem.h, util/base.h */
+
+void *bmalloc(size_t size)
+{
+	COUNT(allocs);
+	void *ptr = malloc(size ? size : 1);
+	if (!ptr)
+		abort();
+	return ptr;
+}
+
+void *brealloc(void *ptr, size_t size)
+{
+	COUNT(allocs);
+	ptr = realloc(ptr, size ? size : 1);
+	if (!ptr)
+		abort();
+	return ptr;
+}
+
+void bfree(void *ptr)
+{
+	free(ptr);
+}
+
+long bnum_allocs(void)
+{
+	return __atomic_load_n(&allocs, __ATOMIC_RELAXED);
+}
+
+void blog(int log_level, const char *format, ...)
+{
+	if (log_level > LOG_WARNING)
+		return;
+	va_list args;
+	va_start(args, format);
+	vfprintf(stderr, format, args);
+	fputc('\n', stderr);
+	va_end(args);
+}
+
+/* ------------------------------------------------------------------------- */
+/* util/dstr.h */
+
+static void dstr_ensure_capacity(struct dstr *dst, size_t capacity)
+{
+	if (capacity <= dst->capacity)
+		return;
+	if (capacity < dst->capacity * 2)
+		capacity = dst->capacity * 2;
+	dst->array = brealloc(dst->array, capacity);
+	dst->capacity = capacity;
+}
+
+/* like libobs the old buffer is dropped, not reused */
+void dstr_ncopy(struct dstr *dst, const char *array, size_t len)
+{
+	dstr_free(dst);
+	if (!len)
+		return;
+	dstr_ensure_capacity(dst, len + 1);
+	memcpy(dst->array, array, len);
+	dst->array[len] = 0;
+	dst->len = len;
+}
+
+void dstr_ncat(struct dstr *dst, const char *array, size_t len)
+{
+	dstr_ensure_capacity(dst, dst->len + len + 1);
+	memcpy(dst->array + dst->len, array, len);
+	dst->len += len;
+	dst->array[dst->len] = 0;
+}
+
+void dstr_catf(struct dstr *dst, const char *format, ...)
+{
+	char buffer[4096];
+	va_list args;
+	va_start(args, format);
+	const int len = vsnprintf(buffer, sizeof(buffer), format, args);
+	va_end(args);
+	if (len > 0)
+		dstr_ncat(dst, buffer,
+			  (size_t)len < sizeof(buffer) ? (size_t)len
+						       : sizeof(buffer) - 1);
+}
+
+int astrcmpi(const char *str1, const char *str2)
+{
+	return strcasecmp(str1 ? str1 : "", str2 ? str2 : "");
+}
+
+char **strlist_split(const char *str, char split_ch, bool include_empty)
+{
+	size_t count = 1;
+	for (const char *c = str; *c; c++)
+		count += *c == split_ch;
+	char **list = bzalloc((count + 1) * sizeof(char *));
+	size_t num = 0;
+	const char *start = str;
+	for (const char *c = str;; c++) {
+		if (*c != split_ch && *c)
+			continue;
+		if (include_empty || c > start)
+			list[num++] = bstrdup_n(start, (size_t)(c - start));
+		if (!*c)
+			break;
+		start = c + 1;
+	}
+	return list;
+}
+
+void strlist_free(char **strlist)
+{
+	if (!strlist)
+		return;
+	for (char **str = strlist; *str; str++)
+		bfree(*str);
+	bfree(strlist);
+}
+
+/* ------------------------------------------------------------------------- */
+/* util/platform.h */
+
+struct os_dir {
+	char *path;
+	DIR *dir;
+	struct os_dirent out;
+};
+
+uint64_t os_gettime_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+os_dir_t *os_opendir(const char *path)
+{
+	COUNT(opens);
+	DIR *dir = opendir(path);
+	if (!dir)
+		return NULL;
+	struct os_dir *os_dir = bzalloc(sizeof(struct os_dir));
+	os_dir->path = bstrdup(path);
+	os_dir->dir = dir;
+	return os_dir;
+}
+
+/* readdir and closedir are counted by their wrappers when linked with
+ * --wrap */
+#ifdef BENCH_WRAP_LIBC
+#define COUNT_UNWRAPPED(counter)
+#else
+#define COUNT_UNWRAPPED(counter) COUNT(counter)
+#endif
+
+struct os_dirent *os_readdir(os_dir_t *dir)
+{
+	COUNT_UNWRAPPED(dir_reads);
+	struct dirent *ent = readdir(dir->dir);
+	if (!ent)
+		return NULL;
+	snprintf(dir->out.d_name, sizeof(dir->out.d_name), "%s",
+		 ent->d_name);
+
+	struct dstr path;
+	dstr_init_copy(&path, dir->path);
+	dstr_cat_ch(&path, '/');
+	dstr_cat(&path, ent->d_name);
+	struct stat st;
+	dir->out.directory = os_stat(path.array, &st) == 0 &&
+			     S_ISDIR(st.st_mode);
+	dstr_free(&path);
+	return &dir->out;
+}
+
+void os_closedir(os_dir_t *dir)
+{
+	if (!dir)
+		return;
+	COUNT_UNWRAPPED(closes);
+	closedir(dir->dir);
+	bfree(dir->path);
+	bfree(dir);
+}
+
+bool os_file_exists(const char *path)
+{
+	COUNT(stats);
+	return access(path, F_OK) == 0;
+}
+
+int os_stat(const char *file, struct stat *st)
+{
+	COUNT(stats);
+	return stat(file, st);
+}
+
+FILE *os_fopen(const char *path, const char *mode)
+{
+	return fopen(path, mode);
+}
+
+int64_t os_fgetsize(FILE *file)
+{
+	const long pos = ftell(file);
+	if (pos < 0 || fseek(file, 0, SEEK_END) != 0)
+		return -1;
+	const long size = ftell(file);
+	fseek(file, pos, SEEK_SET);
+	return size;
+}
+
+int os_unlink(const char *path)
+{
+	return unlink(path);
+}
+
+int os_safe_replace(const char *target_path, const char *from_path,
+		    const char *backup_path)
+{
+	if (backup_path)
+		rename(target_path, backup_path);
+	return rename(from_path, target_path);
+}
+
+/* ------------------------------------------------------------------------- */
+/* libc calls of the index, linked with -Wl,--wrap */
+
+#ifdef BENCH_WRAP_LIBC
+int __real_open(const char *path, int flags, ...);
+int __real_openat(int fd, const char *path, int flags, ...);
+int __real_close(int fd);
+struct dirent *__real_readdir(DIR *dir);
+int __real_closedir(DIR *dir);
+int __real_fstatat(int fd, const char *path, struct stat *st, int flags);
+int __real_statx(int fd, const char *path, int flags, unsigned int mask,
+		 struct statx *stx);
+
+static mode_t open_mode(int flags, va_list args)
+{
+	return (flags & O_CREAT) ? (mode_t)va_arg(args, int) : 0;
+}
+
+int __wrap_open(const char *path, int flags, ...)
+{
+	COUNT(opens);
+	va_list args;
+	va_start(args, flags);
+	const mode_t mode = open_mode(flags, args);
+	va_end(args);
+	return __real_open(path, flags, mode);
+}
+
+int __wrap_openat(int fd, const char *path, int flags, ...)
+{
+	COUNT(opens);
+	va_list args;
+	va_start(args, flags);
+	const mode_t mode = open_mode(flags, args);
+	va_end(args);
+	return __real_openat(fd, path, flags, mode);
+}
+
+int __wrap_close(int fd)
+{
+	COUNT(closes);
+	return __real_close(fd);
+}
+
+struct dirent *__wrap_readdir(DIR *dir)
+{
+	COUNT(dir_reads);
+	return __real_readdir(dir);
+}
+
+int __wrap_closedir(DIR *dir)
+{
+	COUNT(closes);
+	return __real_closedir(dir);
+}
+
+int __wrap_fstatat(int fd, const char *path, struct stat *st, int flags)
+{
+	COUNT(stats);
+	return __real_fstatat(fd, path, st, flags);
+}
+
+int __wrap_statx(int fd, const char *path, int flags, unsigned int mask,
+		 struct statx *stx)
+{
+	COUNT(stats);
+	return __real_statx(fd, path, flags, mask, stx);
+}
+#endif
+
+/* ------------------------------------------------------------------------- */
+/* util/threading.h */
+
+struct os_event_data {
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	bool signalled;
+	bool manual;
+};
+
+int os_event_init(os_event_t **event, enum os_event_type type)
+{
+	struct os_event_data *data = bzalloc(sizeof(struct os_event_data));
+	pthread_mutex_init(&data->mutex, NULL);
+	pthread_cond_init(&data->cond, NULL);
+	data->manual = type == OS_EVENT_TYPE_MANUAL;
+	*event = data;
+	return 0;
+}
+
+void os_event_destroy(os_event_t *event)
+{
+	if (!event)
+		return;
+	pthread_mutex_destroy(&event->mutex);
+	pthread_cond_destroy(&event->cond);
+	bfree(event);
+}
+
+int os_event_wait(os_event_t *event)
+{
+	pthread_mutex_lock(&event->mutex);
+	while (!event->signalled)
+		pthread_cond_wait(&event->cond, &event->mutex);
+	if (!event->manual)
+		event->signalled = false;
+	pthread_mutex_unlock(&event->mutex);
+	return 0;
+}
+
+int os_event_signal(os_event_t *event)
+{
+	pthread_mutex_lock(&event->mutex);
+	event->signalled = true;
+	pthread_cond_signal(&event->cond);
+	pthread_mutex_unlock(&event->mutex);
+	return 0;
+}
+
+/* a counter and a condition, macOS has no unnamed POSIX semaphores */
+struct os_sem_data {
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	int value;
+};
+
+int os_sem_init(os_sem_t **sem, int value)
+{
+	struct os_sem_data *data = bzalloc(sizeof(struct os_sem_data));
+	pthread_mutex_init(&data->mutex, NULL);
+	pthread_cond_init(&data->cond, NULL);
+	data->value = value;
+	*sem = data;
+	return 0;
+}
+
+void os_sem_destroy(os_sem_t *sem)
+{
+	if (!sem)
+		return;
+	pthread_mutex_destroy(&sem->mutex);
+	pthread_cond_destroy(&sem->cond);
+	bfree(sem);
+}
+
+int os_sem_post(os_sem_t *sem)
+{
+	pthread_mutex_lock(&sem->mutex);
+	sem->value++;
+	pthread_cond_signal(&sem->cond);
+	pthread_mutex_unlock(&sem->mutex);
+	return 0;
+}
+
+int os_sem_wait(os_sem_t *sem)
+{
+	pthread_mutex_lock(&sem->mutex);
+	while (sem->value <= 0)
+		pthread_cond_wait(&sem->cond, &sem->mutex);
+	sem->value--;
+	pthread_mutex_unlock(&sem->mutex);
+	return 0;
+}
+
+void os_set_thread_name(const char *name)
+{
+	(void)name;
+}
@@ -0,0 +1,5 @@
+#pragma once
+
+#include "util/c99defs.h"
+#include "util/bmem.h"
+#include "util/base.h"
@@ -0,0 +1,14 @@
+#pragma once
+
+/* Minimal stand-ins for the libobs headers used by the directory index,
+ * only for the scan benchmark */
+
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define UNUSED_PARAMETER(param) (void)param
+#define EXPORT
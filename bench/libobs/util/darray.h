@@ -0,0 +1,148 @@
+#pragma once
+
+#include "bmem.h"
+
+#define DARRAY_INVALID ((size_t)-1)
+
+struct darray {
+	void *array;
+	size_t num;
+	size_t capacity;
+};
+
+#define DARRAY(type)                     \
+	union {                          \
+		struct darray da;        \
+		struct {                 \
+			type *array;     \
+			size_t num;      \
+			size_t capacity; \
+		};                       \
+	}
+
+static inline void darray_init(struct darray *dst)
+{
+	dst->array = NULL;
+	dst->num = 0;
+	dst->capacity = 0;
+}
+
+static inline void darray_free(struct darray *dst)
+{
+	bfree(dst->array);
+	darray_init(dst);
+}
+
+static inline void darray_reserve(size_t element_size, struct darray *dst,
+				  size_t capacity)
+{
+	if (capacity <= dst->capacity)
+		return;
+	if (capacity < dst->capacity * 2)
+		capacity = dst->capacity * 2;
+	dst->array = brealloc(dst->array, element_size * capacity);
+	dst->capacity = capacity;
+}
+
+static inline void darray_resize(size_t element_size, struct darray *dst,
+				 size_t size)
+{
+	if (size > dst->num) {
+		darray_reserve(element_size, dst, size);
+		memset((uint8_t *)dst->array + element_size * dst->num, 0,
+		       element_size * (size - dst->num));
+	}
+	dst->num = size;
+}
+
+static inline void darray_move(struct darray *dst, struct darray *src)
+{
+	darray_free(dst);
+	*dst = *src;
+	darray_init(src);
+}
+
+static inline size_t darray_push_back(size_t element_size,
+				      struct darray *dst, const void *item)
+{
+	darray_reserve(element_size, dst, dst->num + 1);
+	memcpy((uint8_t *)dst->array + element_size * dst->num, item,
+	       element_size);
+	return dst->num++;
+}
+
+static inline void *darray_push_back_new(size_t element_size,
+					 struct darray *dst)
+{
+	darray_reserve(element_size, dst, dst->num + 1);
+	void *item = (uint8_t *)dst->array + element_size * dst->num++;
+	memset(item, 0, element_size);
+	return item;
+}
+
+static inline void darray_push_back_array(size_t element_size,
+					  struct darray *dst,
+					  const void *array, size_t num)
+{
+	darray_reserve(element_size, dst, dst->num + num);
+	memcpy((uint8_t *)dst->array + element_size * dst->num, array,
+	       element_size * num);
+	dst->num += num;
+}
+
+static inline void darray_insert(size_t element_size, struct darray *dst,
+				 size_t idx, const void *item)
+{
+	darray_reserve(element_size, dst, dst->num + 1);
+	uint8_t *at = (uint8_t *)dst->array + element_size * idx;
+	memmove(at + element_size, at, element_size * (dst->num - idx));
+	memcpy(at, item, element_size);
+	dst->num++;
+}
+
+static inline void darray_erase(size_t element_size, struct darray *dst,
+				size_t idx)
+{
+	uint8_t *at = (uint8_t *)dst->array + element_size * idx;
+	memmove(at, at + element_size, element_size * (dst->num - idx - 1));
+	dst->num--;
+}
+
+static inline size_t darray_find(size_t element_size,
+				 const struct darray *da, const void *item)
+{
+	for (size_t i = 0; i < da->num; i++) {
+		if (memcmp((uint8_t *)da->array + element_size * i, item,
+			   element_size) == 0)
+			return i;
+	}
+	return DARRAY_INVALID;
+}
+
+static inline void darray_erase_item(size_t element_size, struct darray *dst,
+				     const void *item)
+{
+	const size_t idx = darray_find(element_size, dst, item);
+	if (idx != DARRAY_INVALID)
+		darray_erase(element_size, dst, idx);
+}
+
+#define da_init(v) darray_init(&(v).da)
+#define da_free(v) darray_free(&(v).da)
+#define da_reserve(v, capacity) \
+	darray_reserve(sizeof(*(v).array), &(v).da, capacity)
+#define da_resize(v, size) darray_resize(sizeof(*(v).array), &(v).da, size)
+#define da_move(dst, src) darray_move(&(dst).da, &(src).da)
+#define da_push_back(v, item) \
+	darray_push_back(sizeof(*(v).array), &(v).da, item)
+#define da_push_back_new(v) \
+	darray_push_back_new(sizeof(*(v).array), &(v).da)
+#define da_push_back_array(v, src, n) \
+	darray_push_back_array(sizeof(*(v).array), &(v).da, src, n)
+#define da_insert(v, idx, item) \
+	darray_insert(sizeof(*(v).array), &(v).da, idx, item)
+#define da_erase(v, idx) darray_erase(sizeof(*(v).array), &(v).da, idx)
+#define da_erase_item(v, item) \
+	darray_erase_item(sizeof(*(v).array), &(v).da, item)
+#define da_find(v, item, idx) \
+	darray_find(sizeof(*(v).array), &(v).da, item)
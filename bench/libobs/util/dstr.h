@@ -0,0 +1,56 @@
+#pragma once
+
+#include "bmem.h"
+
+struct dstr {
+	char *array;
+	size_t len;
+	size_t capacity;
+};
+
+static inline void dstr_init(struct dstr *dst)
+{
+	dst->array = NULL;
+	dst->len = 0;
+	dst->capacity = 0;
+}
+
+static inline void dstr_free(struct dstr *dst)
+{
+	bfree(dst->array);
+	dstr_init(dst);
+}
+
+void dstr_ncopy(struct dstr *dst, const char *array, size_t len);
+void dstr_ncat(struct dstr *dst, const char *array, size_t len);
+void dstr_catf(struct dstr *dst, const char *format, ...);
+
+static inline void dstr_copy(struct dstr *dst, const char *array)
+{
+	if (!array || !*array)
+		dstr_free(dst);
+	else
+		dstr_ncopy(dst, array, strlen(array));
+}
+
+static inline void dstr_init_copy(struct dstr *dst, const char *array)
+{
+	dstr_init(dst);
+	dstr_copy(dst, array);
+}
+
+static inline void dstr_cat(struct dstr *dst, const char *array)
+{
+	if (array && *array)
+		dstr_ncat(dst, array, strlen(array));
+}
+
+static inline void dstr_cat_ch(struct dstr *dst, char ch)
+{
+	dstr_ncat(dst, &ch, 1);
+}
+
+int astrcmpi(const char *str1, const char *str2);
+
+char **strlist_split(const char *str, char split_ch, bool include_empty);
+void strlist_free(char **strlist);
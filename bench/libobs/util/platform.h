@@ -0,0 +1,28 @@
+#pragma once
+
+#include "c99defs.h"
+#include <stdio.h>
+#include <sys/stat.h>
+
+uint64_t os_gettime_ns(void);
+
+struct os_dirent {
+	char d_name[256];
+	bool directory;
+};
+
+struct os_dir;
+typedef struct os_dir os_dir_t;
+
+os_dir_t *os_opendir(const char *path);
+struct os_dirent *os_readdir(os_dir_t *dir);
+void os_closedir(os_dir_t *dir);
+
+bool os_file_exists(const char *path);
+int os_stat(const char *file, struct stat *st);
+
+FILE *os_fopen(const char *path, const char *mode);
+int64_t os_fgetsize(FILE *file);
+int os_unlink(const char *path);
+int os_safe_replace(const char *target_path, const char *from_path,
+		    const char *backup_path);
@@ -0,0 +1,310 @@
+#include "dir-watch-deleter.h"
+#include <obs-module.h>
+#include <util/platform.h>
+#include <util/threading.h>
+#include <util/darray.h>
+#include <util/dstr.h>
+
+/* the first retry comes after RETRY_MS, doubling up to RETRY_MAX_MS */
+#define RETRY_MS 250
+#define RETRY_MAX_MS 10000
+#define GIVE_UP_SECONDS 3600
+
+struct dir_watch_deleter {
+	volatile long refs;
+	/* guards done against destroy */
+	pthread_mutex_t mutex;
+	dir_watch_deleted_t done;
+	void *param;
+	/* protected by deleter_mutex */
+	char *trash;
+};
+
+struct deletion {
+	struct dir_watch_deleter *owner;
+	char *path;
+	char *trash;
+	/* a copy is in the trash, only the original is left to remove */
+	bool copied;
+	uint64_t queued_time;
+	uint64_t retry_time;
+	long long retry_ms;
+};
+
+static pthread_mutex_t deleter_mutex = PTHREAD_MUTEX_INITIALIZER;
+/* everything below is protected by deleter_mutex, the thread is started
+ * with the first filter and runs until the module is unloaded */
+static DARRAY(struct deletion) deletions;
+static os_event_t *deleter_wake;
+static pthread_t deleter_thread;
+static bool deleter_thread_created;
+static bool deleter_stopping;
+
+static void deleter_release(struct dir_watch_deleter *deleter)
+{
+	if (os_atomic_dec_long(&deleter->refs) != 0)
+		return;
+	pthread_mutex_destroy(&deleter->mutex);
+	bfree(deleter->trash);
+	bfree(deleter);
+}
+
+static void deletion_free(struct deletion *deletion)
+{
+	deleter_release(deletion->owner);
+	bfree(deletion->path);
+	bfree(deletion->trash);
+}
+
+static void deletion_report(struct deletion *deletion, bool success)
+{
+	struct dir_watch_deleter *owner = deletion->owner;
+	pthread_mutex_lock(&owner->mutex);
+	if (owner->done)
+		owner->done(owner->param, deletion->path, success);
+	pthread_mutex_unlock(&owner->mutex);
+}
+
+/* A free name in the trash, "name (2).ext" when name.ext is taken */
+static char *trash_path(const char *trash, const char *path)
+{
+	const char *file = path;
+	for (const char *c = path; *c; c++) {
+		if (*c == '/' || *c == '\\')
+			file = c + 1;
+	}
+	const char *ext = strrchr(file, '.');
+	if (!ext || ext == file)
+		ext = file + strlen(file);
+
+	struct dstr target;
+	dstr_init_copy(&target, trash);
+	dstr_cat_ch(&target, '/');
+	dstr_cat(&target, file);
+	for (int i = 2; os_file_exists(target.array); i++) {
+		dstr_copy(&target, trash);
+		dstr_cat_ch(&target, '/');
+		dstr_ncat(&target, file, (size_t)(ext - file));
+		dstr_catf(&target, " (%d)", i);
+		dstr_cat(&target, ext);
+	}
+	return target.array;
+}
+
+enum deletion_result {
+	/* deleted or moved into the trash */
+	deletion_done,
+	/* removed by someone else before it was deleted */
+	deletion_missing,
+	deletion_retry,
+};
+
+static enum deletion_result deletion_run(struct deletion *deletion)
+{
+	if (!os_file_exists(deletion->path))
+		return deletion->copied ? deletion_done : deletion_missing;
+	if (deletion->trash && !deletion->copied) {
+		os_mkdirs(deletion->trash);
+		char *target = trash_path(deletion->trash, deletion->path);
+		bool moved = os_rename(deletion->path, target) == 0;
+		/* another drive or still open, copy and remove the original */
+		if (!moved && os_copyfile(deletion->path, target) == 0)
+			deletion->copied = true;
+		bfree(target);
+		if (moved)
+			return deletion_done;
+		if (!deletion->copied)
+			return deletion_retry;
+	}
+	if (os_unlink(deletion->path) == 0)
+		return deletion_done;
+	/* removed in between, the trash holds the copy */
+	if (!os_file_exists(deletion->path))
+		return deletion->copied ? deletion_done : deletion_missing;
+	return deletion_retry;
+}
+
+/* Runs the first deletion that is due, otherwise returns false with the
+ * time the next one is due, 0 for none */
+static bool deleter_run_next(uint64_t now, uint64_t *wake_time)
+{
+	*wake_time = 0;
+	size_t i = 0;
+	for (; i < deletions.num; i++) {
+		const uint64_t retry_time = deletions.array[i].retry_time;
+		if (retry_time <= now)
+			break;
+		if (!*wake_time || retry_time < *wake_time)
+			*wake_time = retry_time;
+	}
+	if (i == deletions.num)
+		return false;
+
+	struct deletion deletion = deletions.array[i];
+	da_erase(deletions, i);
+	/* the file system is not touched while holding the mutex, so
+	 * queueing never waits on it */
+	pthread_mutex_unlock(&deleter_mutex);
+	const enum deletion_result result = deletion_run(&deletion);
+	const bool gone = result != deletion_retry;
+	const uint64_t waited = now - deletion.queued_time;
+	const bool give_up = !gone &&
+			     waited / 1000000000ULL >= GIVE_UP_SECONDS;
+	if (give_up)
+		blog(LOG_WARNING,
+		     "[Directory watch media] gave up deleting '%s'",
+		     deletion.path);
+	if (result == deletion_missing)
+		blog(LOG_INFO,
+		     "[Directory watch media] '%s' was removed before it "
+		     "could be deleted",
+		     deletion.path);
+	if (gone || give_up) {
+		deletion_report(&deletion, result == deletion_done);
+		deletion_free(&deletion);
+	}
+	pthread_mutex_lock(&deleter_mutex);
+
+	if (!gone && !give_up) {
+		deletion.retry_time = now + deletion.retry_ms * 1000000ULL;
+		deletion.retry_ms *= 2;
+		if (deletion.retry_ms > RETRY_MAX_MS)
+			deletion.retry_ms = RETRY_MAX_MS;
+		da_push_back(deletions, &deletion);
+	}
+	return true;
+}
+
+static void *deleter_thread_run(void *data)
+{
+	UNUSED_PARAMETER(data);
+	os_set_thread_name("dir-watch-media: deleter");
+
+	pthread_mutex_lock(&deleter_mutex);
+	while (!deleter_stopping) {
+		const uint64_t now = os_gettime_ns();
+		uint64_t wake_time;
+		if (deleter_run_next(now, &wake_time))
+			continue;
+		pthread_mutex_unlock(&deleter_mutex);
+		if (wake_time)
+			os_event_timedwait(
+				deleter_wake,
+				(unsigned long)((wake_time - now) / 1000000) +
+					1);
+		else
+			os_event_wait(deleter_wake);
+		pthread_mutex_lock(&deleter_mutex);
+	}
+	pthread_mutex_unlock(&deleter_mutex);
+	return NULL;
+}
+
+struct dir_watch_deleter *dir_watch_deleter_create(dir_watch_deleted_t done,
+						   void *param)
+{
+	struct dir_watch_deleter *deleter =
+		bzalloc(sizeof(struct dir_watch_deleter));
+	deleter->refs = 1;
+	deleter->done = done;
+	deleter->param = param;
+	pthread_mutex_init_value(&deleter->mutex);
+	if (pthread_mutex_init(&deleter->mutex, NULL) != 0) {
+		bfree(deleter);
+		return NULL;
+	}
+
+	pthread_mutex_lock(&deleter_mutex);
+	if (!deleter_thread_created) {
+		deleter_stopping = false;
+		if (!deleter_wake &&
+		    os_event_init(&deleter_wake, OS_EVENT_TYPE_AUTO) != 0)
+			deleter_wake = NULL;
+		if (deleter_wake &&
+		    pthread_create(&deleter_thread, NULL, deleter_thread_run,
+				   NULL) == 0)
+			deleter_thread_created = true;
+		else
+			blog(LOG_WARNING,
+			     "[Directory watch media] failed to create deleter thread");
+	}
+	pthread_mutex_unlock(&deleter_mutex);
+	return deleter;
+}
+
+/* Last chance for files still queued when the thread stops */
+static void deleter_flush(void)
+{
+	for (size_t i = 0; i < deletions.num; i++) {
+		struct deletion *deletion = &deletions.array[i];
+		if (deletion_run(deletion) == deletion_retry)
+			blog(LOG_WARNING,
+			     "[Directory watch media] could not delete '%s'",
+			     deletion->path);
+		deletion_free(deletion);
+	}
+	da_free(deletions);
+}
+
+void dir_watch_deleter_destroy(struct dir_watch_deleter *deleter)
+{
+	if (!deleter)
+		return;
+	pthread_mutex_lock(&deleter->mutex);
+	deleter->done = NULL;
+	pthread_mutex_unlock(&deleter->mutex);
+	deleter_release(deleter);
+}
+
+void dir_watch_deleter_shutdown(void)
+{
+	pthread_mutex_lock(&deleter_mutex);
+	const bool created = deleter_thread_created;
+	deleter_stopping = true;
+	if (deleter_wake)
+		os_event_signal(deleter_wake);
+	pthread_mutex_unlock(&deleter_mutex);
+	/* only called once no filter is left to start it again */
+	if (created)
+		pthread_join(deleter_thread, NULL);
+
+	pthread_mutex_lock(&deleter_mutex);
+	deleter_thread_created = false;
+	os_event_destroy(deleter_wake);
+	deleter_wake = NULL;
+	deleter_flush();
+	pthread_mutex_unlock(&deleter_mutex);
+}
+
+void dir_watch_deleter_set_trash(struct dir_watch_deleter *deleter,
+				 const char *trash_directory)
+{
+	if (!deleter)
+		return;
+	pthread_mutex_lock(&deleter_mutex);
+	bfree(deleter->trash);
+	deleter->trash = trash_directory && *trash_directory
+				 ? bstrdup(trash_directory)
+				 : NULL;
+	pthread_mutex_unlock(&deleter_mutex);
+}
+
+void dir_watch_deleter_queue(struct dir_watch_deleter *deleter,
+			     const char *path)
+{
+	if (!deleter || !path || !*path)
+		return;
+	struct deletion deletion = {0};
+	deletion.owner = deleter;
+	deletion.path = bstrdup(path);
+	deletion.queued_time = os_gettime_ns();
+	deletion.retry_ms = RETRY_MS;
+	os_atomic_inc_long(&deleter->refs);
+
+	pthread_mutex_lock(&deleter_mutex);
+	deletion.trash = bstrdup(deleter->trash);
+	da_push_back(deletions, &deletion);
+	if (deleter_wake)
+		os_event_signal(deleter_wake);
+	pthread_mutex_unlock(&deleter_mutex);
+}
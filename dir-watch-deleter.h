@@ -0,0 +1,29 @@
+#pragma once
+
+#include <stdbool.h>
+
+/* Deletes files on a background thread shared by all filters. A file that
+ * is still in use is retried with a growing delay, which is needed on
+ * Windows while a media source has it open. */
+struct dir_watch_deleter;
+
+typedef void (*dir_watch_deleted_t)(void *param, const char *path,
+				     bool success);
+
+/* done is called on the worker thread when a file is gone or given up on,
+ * success only when it was deleted or moved to the trash here */
+struct dir_watch_deleter *dir_watch_deleter_create(dir_watch_deleted_t done,
+						   void *param);
+/* Queued files are still deleted, done is not called anymore */
+void dir_watch_deleter_destroy(struct dir_watch_deleter *deleter);
+/* Stops the thread when the module is unloaded, files still queued get a
+ * last try */
+void dir_watch_deleter_shutdown(void);
+
+/* Files queued from now on are moved into this directory instead of being
+ * deleted, NULL or empty to delete */
+void dir_watch_deleter_set_trash(struct dir_watch_deleter *deleter,
+				 const char *trash_directory);
+
+void dir_watch_deleter_queue(struct dir_watch_deleter *deleter,
+			     const char *path);
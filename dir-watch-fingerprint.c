@@ -0,0 +1,307 @@
+#include "dir-watch-fingerprint.h"
+#include <obs-module.h>
+#include <util/threading.h>
+#include <util/platform.h>
+#include <util/darray.h>
+#include <sys/stat.h>
+
+/* bytes hashed at the start and at the end of a file */
+#define FINGERPRINT_SPAN 65536
+/* slots of the cache and of the played set, a power of two */
+#define FINGERPRINT_SLOTS 4096
+/* requests nobody asked for again are dropped beyond this */
+#define FINGERPRINT_MAX_REQUESTS 64
+
+struct fingerprint_request {
+	char *path;
+	enum dir_watch_fingerprint_state state;
+	uint64_t value;
+};
+
+/* a file as it was when it was hashed */
+struct fingerprint_key {
+	uint64_t device;
+	uint64_t inode;
+	int64_t size;
+	int64_t modified;
+};
+
+struct fingerprint_slot {
+	struct fingerprint_key key;
+	uint64_t value;
+};
+
+struct dir_watch_fingerprint {
+	pthread_t thread;
+	bool thread_created;
+	os_event_t *wake;
+	volatile bool stopping;
+
+	/* protected by mutex */
+	pthread_mutex_t mutex;
+	DARRAY(struct fingerprint_request) requests;
+	/* request being hashed, it is never dropped */
+	const char *hashing;
+	/* played values, 0 marks a free slot */
+	uint64_t *played;
+
+	/* only used by the worker thread, newer files replace older ones
+	 * in the same slot */
+	struct fingerprint_slot *cache;
+	uint8_t *buffer;
+};
+
+static inline uint64_t hash_bytes(uint64_t hash, const uint8_t *data,
+				  size_t size)
+{
+	for (size_t i = 0; i < size; i++) {
+		hash ^= data[i];
+		hash *= 1099511628211ULL;
+	}
+	return hash;
+}
+
+static uint64_t hash_key(const struct fingerprint_key *key)
+{
+	return hash_bytes(14695981039346656037ULL, (const uint8_t *)key,
+			  sizeof(*key));
+}
+
+static size_t fingerprint_find(struct dir_watch_fingerprint *fingerprint,
+			       const char *path)
+{
+	for (size_t i = 0; i < fingerprint->requests.num; i++) {
+		if (strcmp(fingerprint->requests.array[i].path, path) == 0)
+			return i;
+	}
+	return DARRAY_INVALID;
+}
+
+/* Drops the oldest requests beyond the limit */
+static void fingerprint_trim(struct dir_watch_fingerprint *fingerprint)
+{
+	size_t i = 0;
+	while (fingerprint->requests.num > FINGERPRINT_MAX_REQUESTS &&
+	       i < fingerprint->requests.num) {
+		struct fingerprint_request *request =
+			&fingerprint->requests.array[i];
+		if (request->path == fingerprint->hashing) {
+			i++;
+			continue;
+		}
+		bfree(request->path);
+		da_erase(fingerprint->requests, i);
+	}
+}
+
+static bool fingerprint_read(struct dir_watch_fingerprint *fingerprint,
+			     FILE *file, int64_t offset, size_t size,
+			     uint64_t *hash)
+{
+	if (os_fseeki64(file, offset, SEEK_SET) != 0 ||
+	    fread(fingerprint->buffer, 1, size, file) != size)
+		return false;
+	*hash = hash_bytes(*hash, fingerprint->buffer, size);
+	return true;
+}
+
+static bool fingerprint_compute(struct dir_watch_fingerprint *fingerprint,
+				const char *path, uint64_t *value)
+{
+	struct stat stats;
+	if (os_stat(path, &stats) != 0)
+		return false;
+	struct fingerprint_key key = {
+		.device = (uint64_t)stats.st_dev,
+		.inode = (uint64_t)stats.st_ino,
+		.size = (int64_t)stats.st_size,
+		.modified = (int64_t)stats.st_mtime,
+	};
+	/* no inode numbers on Windows */
+	if (!key.inode)
+		key.inode = hash_bytes(14695981039346656037ULL,
+				       (const uint8_t *)path, strlen(path));
+	struct fingerprint_slot *slot =
+		&fingerprint->cache[hash_key(&key) & (FINGERPRINT_SLOTS - 1)];
+	if (slot->value && memcmp(&slot->key, &key, sizeof(key)) == 0) {
+		*value = slot->value;
+		return true;
+	}
+
+	FILE *file = os_fopen(path, "rb");
+	if (!file)
+		return false;
+	uint64_t hash = hash_bytes(14695981039346656037ULL,
+				   (const uint8_t *)&key.size,
+				   sizeof(key.size));
+	const size_t head = key.size < FINGERPRINT_SPAN ? (size_t)key.size
+							: FINGERPRINT_SPAN;
+	bool read = fingerprint_read(fingerprint, file, 0, head, &hash);
+	if (read && key.size > FINGERPRINT_SPAN) {
+		/* the head was a full span, the tail must not overlap it */
+		const int64_t tail = key.size > 2 * FINGERPRINT_SPAN
+					     ? key.size - FINGERPRINT_SPAN
+					     : FINGERPRINT_SPAN;
+		read = fingerprint_read(fingerprint, file, tail,
+					(size_t)(key.size - tail), &hash);
+	}
+	fclose(file);
+	if (!read)
+		return false;
+
+	/* 0 marks free slots */
+	if (!hash)
+		hash = 1;
+	slot->key = key;
+	slot->value = hash;
+	*value = hash;
+	return true;
+}
+
+/* The most recent request is the one about to be shown */
+static char *fingerprint_next(struct dir_watch_fingerprint *fingerprint)
+{
+	for (size_t i = fingerprint->requests.num; i > 0; i--) {
+		struct fingerprint_request *request =
+			&fingerprint->requests.array[i - 1];
+		if (request->state == fingerprint_pending) {
+			fingerprint->hashing = request->path;
+			return request->path;
+		}
+	}
+	return NULL;
+}
+
+static void *fingerprint_thread(void *data)
+{
+	struct dir_watch_fingerprint *fingerprint = data;
+	os_set_thread_name("dir-watch-media: fingerprint");
+
+	while (!os_atomic_load_bool(&fingerprint->stopping)) {
+		pthread_mutex_lock(&fingerprint->mutex);
+		char *path = fingerprint_next(fingerprint);
+		pthread_mutex_unlock(&fingerprint->mutex);
+		if (!path) {
+			os_event_wait(fingerprint->wake);
+			continue;
+		}
+
+		/* the path stays valid while it is being hashed */
+		uint64_t value = 0;
+		const bool computed =
+			fingerprint_compute(fingerprint, path, &value);
+
+		pthread_mutex_lock(&fingerprint->mutex);
+		const size_t i = fingerprint_find(fingerprint, path);
+		fingerprint->hashing = NULL;
+		if (i != DARRAY_INVALID) {
+			struct fingerprint_request *request =
+				&fingerprint->requests.array[i];
+			request->state = computed ? fingerprint_ready
+						  : fingerprint_failed;
+			request->value = value;
+		}
+		pthread_mutex_unlock(&fingerprint->mutex);
+	}
+	return NULL;
+}
+
+struct dir_watch_fingerprint *dir_watch_fingerprint_create(void)
+{
+	struct dir_watch_fingerprint *fingerprint =
+		bzalloc(sizeof(struct dir_watch_fingerprint));
+	pthread_mutex_init_value(&fingerprint->mutex);
+	if (pthread_mutex_init(&fingerprint->mutex, NULL) != 0)
+		goto fail;
+	if (os_event_init(&fingerprint->wake, OS_EVENT_TYPE_AUTO) != 0)
+		goto fail;
+	fingerprint->played = bzalloc(FINGERPRINT_SLOTS * sizeof(uint64_t));
+	fingerprint->cache =
+		bzalloc(FINGERPRINT_SLOTS * sizeof(struct fingerprint_slot));
+	fingerprint->buffer = bmalloc(FINGERPRINT_SPAN);
+	return fingerprint;
+
+fail:
+	dir_watch_fingerprint_destroy(fingerprint);
+	return NULL;
+}
+
+void dir_watch_fingerprint_destroy(struct dir_watch_fingerprint *fingerprint)
+{
+	if (!fingerprint)
+		return;
+	if (fingerprint->thread_created) {
+		os_atomic_set_bool(&fingerprint->stopping, true);
+		os_event_signal(fingerprint->wake);
+		pthread_join(fingerprint->thread, NULL);
+	}
+	for (size_t i = 0; i < fingerprint->requests.num; i++)
+		bfree(fingerprint->requests.array[i].path);
+	da_free(fingerprint->requests);
+	os_event_destroy(fingerprint->wake);
+	pthread_mutex_destroy(&fingerprint->mutex);
+	bfree(fingerprint->played);
+	bfree(fingerprint->cache);
+	bfree(fingerprint->buffer);
+	bfree(fingerprint);
+}
+
+enum dir_watch_fingerprint_state
+dir_watch_fingerprint_request(struct dir_watch_fingerprint *fingerprint,
+			      const char *path, uint64_t *value)
+{
+	if (!fingerprint || !path || !*path)
+		return fingerprint_failed;
+	pthread_mutex_lock(&fingerprint->mutex);
+	struct fingerprint_request request;
+	const size_t i = fingerprint_find(fingerprint, path);
+	if (i != DARRAY_INVALID) {
+		request = fingerprint->requests.array[i];
+		if (request.state != fingerprint_pending) {
+			bfree(request.path);
+			da_erase(fingerprint->requests, i);
+		}
+	} else {
+		request.path = bstrdup(path);
+		request.state = fingerprint_pending;
+		request.value = 0;
+		da_push_back(fingerprint->requests, &request);
+		fingerprint_trim(fingerprint);
+	}
+
+	/* started with the first file */
+	if (!fingerprint->thread_created &&
+	    pthread_create(&fingerprint->thread, NULL, fingerprint_thread,
+			   fingerprint) == 0)
+		fingerprint->thread_created = true;
+	const bool running = fingerprint->thread_created;
+	pthread_mutex_unlock(&fingerprint->mutex);
+
+	if (request.state == fingerprint_pending)
+		os_event_signal(fingerprint->wake);
+	*value = request.value;
+	return running ? request.state : fingerprint_failed;
+}
+
+bool dir_watch_fingerprint_played(struct dir_watch_fingerprint *fingerprint,
+				  uint64_t value)
+{
+	if (!fingerprint || !value)
+		return false;
+	pthread_mutex_lock(&fingerprint->mutex);
+	/* an older value in the same slot is forgotten */
+	uint64_t *slot = &fingerprint->played[value & (FINGERPRINT_SLOTS - 1)];
+	const bool played = *slot == value;
+	*slot = value;
+	pthread_mutex_unlock(&fingerprint->mutex);
+	return played;
+}
+
+void dir_watch_fingerprint_reset(struct dir_watch_fingerprint *fingerprint)
+{
+	if (!fingerprint)
+		return;
+	pthread_mutex_lock(&fingerprint->mutex);
+	memset(fingerprint->played, 0, FINGERPRINT_SLOTS * sizeof(uint64_t));
+	pthread_mutex_unlock(&fingerprint->mutex);
+}
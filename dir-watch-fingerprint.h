@@ -0,0 +1,34 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* Identifies files by their content on a worker thread, so a clip that is
+ * delivered again under another name can be skipped. The fingerprint is a
+ * hash of the size and the first and last 64 KiB. Fingerprints are cached
+ * by device, inode, size and modification time so a file is read only once,
+ * the cache and the set of played fingerprints have a fixed size. */
+struct dir_watch_fingerprint;
+
+enum dir_watch_fingerprint_state {
+	fingerprint_pending,
+	fingerprint_ready,
+	/* the file could not be read, it is treated as new */
+	fingerprint_failed,
+};
+
+struct dir_watch_fingerprint *dir_watch_fingerprint_create(void);
+void dir_watch_fingerprint_destroy(struct dir_watch_fingerprint *fingerprint);
+
+/* Queues the file unless it already is, sets value once it is ready. A
+ * request that is not pending anymore is forgotten after it returned. */
+enum dir_watch_fingerprint_state
+dir_watch_fingerprint_request(struct dir_watch_fingerprint *fingerprint,
+			      const char *path, uint64_t *value);
+
+/* Remembers the value as played, returns true if it already was */
+bool dir_watch_fingerprint_played(struct dir_watch_fingerprint *fingerprint,
+				  uint64_t value);
+
+/* Forgets the played values */
+void dir_watch_fingerprint_reset(struct dir_watch_fingerprint *fingerprint);
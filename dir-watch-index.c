@@ -0,0 +1,1908 @@
+#ifdef __linux__
+/* statx */
+#define _GNU_SOURCE
+#endif
+#include "dir-watch-index.h"
+#include "dir-watch-stat-pool.h"
+#include <util/platform.h>
+#include <util/dstr.h>
+#include <sys/stat.h>
+
+#ifdef __linux__
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+/* entries and tree nodes are allocated this many at a time */
+#define ENTRY_BLOCK_COUNT 256
+#define NODE_BLOCK_COUNT 256
+/* names are packed into blocks of this size */
+#define NAME_BLOCK_SIZE 65536
+
+struct file_info {
+	int64_t size;
+	time_t created;
+	time_t modified;
+	bool directory;
+};
+
+/* A file queried during a listing, the queries of a folder run together on
+ * the stat pool and are applied afterwards */
+struct dir_watch_stat_request {
+	/* NULL for a file that is not in the index yet, its name is then at
+	 * name_offset in the request names of the index */
+	struct dir_watch_entry *entry;
+	const char *name;
+	size_t name_offset;
+	uint64_t hash;
+	struct file_info info;
+	bool found;
+	uint64_t calls;
+};
+
+struct dir_watch_node {
+	struct dir_watch_node *left;
+	struct dir_watch_node *right;
+	struct dir_watch_entry *entry;
+	uint32_t priority;
+	size_t count;
+	/* files of the subtree not drawn yet in this shuffle round */
+	size_t bag_count;
+	bool drawn;
+};
+
+static uint64_t hash_name(const char *name)
+{
+	uint64_t hash = 14695981039346656037ULL;
+	while (*name) {
+		hash ^= (uint8_t)*name++;
+		hash *= 1099511628211ULL;
+	}
+	return hash;
+}
+
+/* splitmix64, any seed gives a full period */
+static uint64_t random_next(uint64_t *state)
+{
+	uint64_t x = (*state += 0x9E3779B97F4A7C15ULL);
+	x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+	x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+	return x ^ (x >> 31);
+}
+
+/* Drops the top values that would favour the low numbers */
+size_t dir_watch_random_below(uint64_t *state, size_t n)
+{
+	const uint64_t limit = UINT64_MAX - UINT64_MAX % n;
+	uint64_t x;
+	do {
+		x = random_next(state);
+	} while (x >= limit);
+	return (size_t)(x % n);
+}
+
+static inline uint64_t view_random(struct dir_watch_view *view)
+{
+	return random_next(&view->random_state);
+}
+
+/* ------------------------------------------------------------------------- */
+/* view */
+
+int dir_watch_entry_compare(enum sort_by sort_by,
+			    const struct dir_watch_entry *a,
+			    const struct dir_watch_entry *b)
+{
+	switch (sort_by) {
+	case created_newest:
+	case created_oldest:
+		if (a->created != b->created)
+			return a->created < b->created ? -1 : 1;
+		break;
+	case modified_newest:
+	case modified_oldest:
+		if (a->modified != b->modified)
+			return a->modified < b->modified ? -1 : 1;
+		break;
+	default:
+		break;
+	}
+	const int cmp = astrcmpi(a->name, b->name);
+	return cmp ? cmp : strcmp(a->name, b->name);
+}
+
+static inline int view_compare(const struct dir_watch_view *view,
+			       const struct dir_watch_entry *a,
+			       const struct dir_watch_entry *b)
+{
+	return dir_watch_entry_compare(view->sort_by, a, b);
+}
+
+static inline size_t node_count(const struct dir_watch_node *node)
+{
+	return node ? node->count : 0;
+}
+
+static inline size_t node_bag_count(const struct dir_watch_node *node)
+{
+	return node ? node->bag_count : 0;
+}
+
+static inline void node_update(struct dir_watch_node *node)
+{
+	node->count = 1 + node_count(node->left) + node_count(node->right);
+	node->bag_count = (node->drawn ? 0 : 1) + node_bag_count(node->left) +
+			  node_bag_count(node->right);
+}
+
+/* Splits into the nodes before entry and the nodes from entry on, or after
+ * entry when inclusive */
+static void treap_split(const struct dir_watch_view *view,
+			struct dir_watch_node *node,
+			const struct dir_watch_entry *entry, bool inclusive,
+			struct dir_watch_node **left,
+			struct dir_watch_node **right)
+{
+	if (!node) {
+		*left = NULL;
+		*right = NULL;
+		return;
+	}
+	const int cmp = view_compare(view, node->entry, entry);
+	if (cmp < 0 || (inclusive && cmp == 0)) {
+		treap_split(view, node->right, entry, inclusive, &node->right,
+			    right);
+		*left = node;
+	} else {
+		treap_split(view, node->left, entry, inclusive, left,
+			    &node->left);
+		*right = node;
+	}
+	node_update(node);
+}
+
+static struct dir_watch_node *treap_merge(struct dir_watch_node *left,
+					  struct dir_watch_node *right)
+{
+	if (!left)
+		return right;
+	if (!right)
+		return left;
+	if (left->priority > right->priority) {
+		left->right = treap_merge(left->right, right);
+		node_update(left);
+		return left;
+	}
+	right->left = treap_merge(left, right->left);
+	node_update(right);
+	return right;
+}
+
+static struct dir_watch_node *node_alloc(struct dir_watch_view *view)
+{
+	if (!view->free_nodes) {
+		struct dir_watch_node *block = bmalloc(
+			NODE_BLOCK_COUNT * sizeof(struct dir_watch_node));
+		da_push_back(view->node_blocks, &block);
+		for (size_t i = 0; i < NODE_BLOCK_COUNT; i++) {
+			block[i].left = view->free_nodes;
+			view->free_nodes = &block[i];
+		}
+	}
+	struct dir_watch_node *node = view->free_nodes;
+	view->free_nodes = node->left;
+	memset(node, 0, sizeof(*node));
+	return node;
+}
+
+/* Returns the nodes of the tree to the free list */
+static void treap_free(struct dir_watch_view *view,
+		       struct dir_watch_node *node)
+{
+	if (!node)
+		return;
+	treap_free(view, node->left);
+	treap_free(view, node->right);
+	node->left = view->free_nodes;
+	view->free_nodes = node;
+}
+
+static void view_clear(struct dir_watch_view *view)
+{
+	if (view->root) {
+		dir_watch_view_changes_clear(&view->changes);
+		view->changes.reset = true;
+	}
+	treap_free(view, view->root);
+	view->root = NULL;
+	view->last_drawn = NULL;
+}
+
+/* Puts every file back in the bag except skip */
+static void treap_refill(struct dir_watch_node *node,
+			 const struct dir_watch_entry *skip)
+{
+	if (!node)
+		return;
+	treap_refill(node->left, skip);
+	treap_refill(node->right, skip);
+	node->drawn = node->entry == skip;
+	node_update(node);
+}
+
+/* Puts a drawn file back in the bag */
+static void treap_undraw(const struct dir_watch_view *view,
+			 struct dir_watch_node *node,
+			 const struct dir_watch_entry *entry)
+{
+	if (!node)
+		return;
+	const int cmp = view_compare(view, entry, node->entry);
+	if (cmp < 0)
+		treap_undraw(view, node->left, entry);
+	else if (cmp > 0)
+		treap_undraw(view, node->right, entry);
+	else
+		node->drawn = false;
+	node_update(node);
+}
+
+/* Takes the index-th file still in the bag out of it */
+static struct dir_watch_entry *treap_draw(struct dir_watch_node *node,
+					  size_t index)
+{
+	struct dir_watch_entry *entry;
+	const size_t left = node_bag_count(node->left);
+	if (index < left) {
+		entry = treap_draw(node->left, index);
+	} else if (index == left && !node->drawn) {
+		node->drawn = true;
+		entry = node->entry;
+	} else {
+		entry = treap_draw(node->right,
+				   index - left - (node->drawn ? 0 : 1));
+	}
+	node_update(node);
+	return entry;
+}
+
+bool dir_watch_view_needs_stat(const struct dir_watch_view *view)
+{
+	return view->sort_by == created_newest ||
+	       view->sort_by == created_oldest ||
+	       view->sort_by == modified_newest ||
+	       view->sort_by == modified_oldest;
+}
+
+/* The name never changes, so the matcher result is cached on the entry */
+static bool view_matches_name(const struct dir_watch_view *view,
+			      struct dir_watch_entry *entry)
+{
+	if (!view->matcher)
+		return true;
+	if (view->slot < 0)
+		return dir_watch_matcher_match(view->matcher, entry->file);
+	const uint32_t bit = 1u << view->slot;
+	if (!(entry->match_known & bit)) {
+		entry->match_known |= bit;
+		if (dir_watch_matcher_match(view->matcher, entry->file))
+			entry->match_bits |= bit;
+		else
+			entry->match_bits &= ~bit;
+	}
+	return (entry->match_bits & bit) != 0;
+}
+
+bool dir_watch_view_matches(const struct dir_watch_view *view,
+			    struct dir_watch_entry *entry)
+{
+	if (entry->folder && entry->folder->depth > view->max_depth)
+		return false;
+	/* sorting on time ignores empty files */
+	if (dir_watch_view_needs_stat(view) && entry->size <= 0)
+		return false;
+	return view_matches_name(view, entry);
+}
+
+static void view_add(struct dir_watch_view *view,
+		     struct dir_watch_entry *entry)
+{
+	if (!view || !dir_watch_view_matches(view, entry))
+		return;
+	struct dir_watch_node *node = node_alloc(view);
+	node->entry = entry;
+	node->priority = (uint32_t)view_random(view);
+	node->count = 1;
+	/* new files join the current shuffle round */
+	node->bag_count = 1;
+
+	struct dir_watch_node *left, *right;
+	treap_split(view, view->root, entry, false, &left, &right);
+	view->root = treap_merge(treap_merge(left, node), right);
+	dir_watch_view_changes_add(&view->changes, entry->name, true);
+}
+
+/* Has to be called before the entry changes so it can still be found */
+static void view_remove(struct dir_watch_view *view,
+			struct dir_watch_entry *entry)
+{
+	if (!view || !view->root || !dir_watch_view_matches(view, entry))
+		return;
+	struct dir_watch_node *left, *node, *right;
+	treap_split(view, view->root, entry, false, &left, &right);
+	treap_split(view, right, entry, true, &node, &right);
+	if (node)
+		dir_watch_view_changes_add(&view->changes, entry->name, false);
+	treap_free(view, node);
+	if (view->last_drawn == entry)
+		view->last_drawn = NULL;
+	view->root = treap_merge(left, right);
+}
+
+void dir_watch_view_init(struct dir_watch_view *view)
+{
+	memset(view, 0, sizeof(*view));
+	view->random_state = os_gettime_ns() ^ (uint64_t)(uintptr_t)view;
+	view->slot = -1;
+}
+
+void dir_watch_view_free(struct dir_watch_view *view)
+{
+	view_clear(view);
+	for (size_t i = 0; i < view->node_blocks.num; i++)
+		bfree(view->node_blocks.array[i]);
+	da_free(view->node_blocks);
+	view->free_nodes = NULL;
+	dir_watch_view_changes_free(&view->changes);
+	dir_watch_matcher_release(view->matcher);
+	view->matcher = NULL;
+}
+
+static bool update_string(char **dst, const char *src)
+{
+	if (src && !*src)
+		src = NULL;
+	if (!*dst && !src)
+		return false;
+	if (*dst && src && strcmp(*dst, src) == 0)
+		return false;
+	bfree(*dst);
+	*dst = bstrdup(src);
+	return true;
+}
+
+bool dir_watch_view_update(struct dir_watch_view *view,
+			   struct dir_watch_matcher *matcher,
+			   enum sort_by sort_by, int max_depth)
+{
+	bool changed = false;
+	if (!dir_watch_matcher_equal(view->matcher, matcher)) {
+		dir_watch_matcher_addref(matcher);
+		dir_watch_matcher_release(view->matcher);
+		view->matcher = matcher;
+		changed = true;
+	}
+	if (view->sort_by != sort_by) {
+		view->sort_by = sort_by;
+		changed = true;
+	}
+	if (view->max_depth != max_depth) {
+		view->max_depth = max_depth;
+		changed = true;
+	}
+	/* the nodes are placed for the old settings, empty until rebuilt */
+	if (changed)
+		view_clear(view);
+	return changed;
+}
+
+size_t dir_watch_view_count(const struct dir_watch_view *view)
+{
+	return node_count(view->root);
+}
+
+struct dir_watch_entry *dir_watch_view_first(const struct dir_watch_view *view)
+{
+	struct dir_watch_node *node = view->root;
+	if (!node)
+		return NULL;
+	while (node->left)
+		node = node->left;
+	return node->entry;
+}
+
+struct dir_watch_entry *dir_watch_view_last(const struct dir_watch_view *view)
+{
+	struct dir_watch_node *node = view->root;
+	if (!node)
+		return NULL;
+	while (node->right)
+		node = node->right;
+	return node->entry;
+}
+
+struct dir_watch_entry *dir_watch_view_at(const struct dir_watch_view *view,
+					  size_t index)
+{
+	struct dir_watch_node *node = view->root;
+	while (node) {
+		const size_t left = node_count(node->left);
+		if (index < left) {
+			node = node->left;
+		} else if (index == left) {
+			return node->entry;
+		} else {
+			index -= left + 1;
+			node = node->right;
+		}
+	}
+	return NULL;
+}
+
+size_t dir_watch_view_rank(const struct dir_watch_view *view,
+			   const struct dir_watch_entry *key, bool equal)
+{
+	size_t rank = 0;
+	struct dir_watch_node *node = view->root;
+	while (node) {
+		const int cmp = view_compare(view, node->entry, key);
+		if (cmp < 0 || (equal && cmp == 0)) {
+			rank += node_count(node->left) + 1;
+			node = node->right;
+		} else {
+			node = node->left;
+		}
+	}
+	return rank;
+}
+
+void dir_watch_view_changes_add(struct dir_watch_view_changes *changes,
+				const char *name, bool added)
+{
+	if (changes->reset)
+		return;
+	if (changes->items.num >= DIR_WATCH_VIEW_CHANGES_MAX) {
+		dir_watch_view_changes_clear(changes);
+		changes->reset = true;
+		return;
+	}
+	struct dir_watch_view_change *change =
+		da_push_back_new(changes->items);
+	change->name = changes->names.num;
+	change->added = added;
+	da_push_back_array(changes->names, name, strlen(name) + 1);
+}
+
+void dir_watch_view_changes_move(struct dir_watch_view_changes *dst,
+				 struct dir_watch_view_changes *src)
+{
+	if (src->reset) {
+		dir_watch_view_changes_clear(dst);
+		dst->reset = true;
+	}
+	for (size_t i = 0; i < src->items.num; i++) {
+		const struct dir_watch_view_change *change =
+			&src->items.array[i];
+		dir_watch_view_changes_add(dst,
+					   src->names.array + change->name,
+					   change->added);
+	}
+	dir_watch_view_changes_clear(src);
+}
+
+void dir_watch_view_changes_clear(struct dir_watch_view_changes *changes)
+{
+	da_resize(changes->items, 0);
+	da_resize(changes->names, 0);
+	changes->reset = false;
+}
+
+void dir_watch_view_changes_free(struct dir_watch_view_changes *changes)
+{
+	da_free(changes->items);
+	da_free(changes->names);
+	changes->reset = false;
+}
+
+struct dir_watch_entry *dir_watch_view_draw(struct dir_watch_view *view)
+{
+	if (!view->root)
+		return NULL;
+	const struct dir_watch_entry *skip = NULL;
+	if (!view->root->bag_count) {
+		/* a new round, the file drawn last sits out the first draw so
+		 * it does not come twice in a row */
+		skip = view->last_drawn;
+		treap_refill(view->root, skip);
+		if (!view->root->bag_count) {
+			skip = NULL;
+			treap_refill(view->root, NULL);
+		}
+	}
+	struct dir_watch_entry *entry = treap_draw(
+		view->root,
+		dir_watch_random_below(&view->random_state,
+				       view->root->bag_count));
+	if (skip)
+		treap_undraw(view, view->root, skip);
+	view->last_drawn = entry;
+	return entry;
+}
+
+struct dir_watch_entry *dir_watch_view_select(struct dir_watch_view *view,
+					      time_t *time)
+{
+	struct dir_watch_entry *entry = NULL;
+	switch (view->sort_by) {
+	case created_newest:
+		entry = dir_watch_view_last(view);
+		if (!entry || (*time != 0 && entry->created < *time))
+			return NULL;
+		*time = entry->created;
+		break;
+	case created_oldest:
+		entry = dir_watch_view_first(view);
+		if (!entry || (*time != 0 && entry->created > *time))
+			return NULL;
+		*time = entry->created;
+		break;
+	case modified_newest:
+		entry = dir_watch_view_last(view);
+		if (!entry || (*time != 0 && entry->modified < *time))
+			return NULL;
+		*time = entry->modified;
+		break;
+	case modified_oldest:
+		entry = dir_watch_view_first(view);
+		if (!entry || (*time != 0 && entry->modified > *time))
+			return NULL;
+		*time = entry->modified;
+		break;
+	case alphabetically_first:
+		entry = dir_watch_view_first(view);
+		break;
+	case alphabetically_last:
+		entry = dir_watch_view_last(view);
+		break;
+	case sort_random:
+		entry = dir_watch_view_draw(view);
+		break;
+	}
+	return entry;
+}
+
+/* ------------------------------------------------------------------------- */
+/* index */
+
+static void file_info_from_stat(const struct stat *stats,
+			       struct file_info *info)
+{
+	info->size = (int64_t)stats->st_size;
+	info->modified = stats->st_mtime;
+#ifdef __APPLE__
+	info->created = stats->st_birthtime;
+#else
+	/* creation time on Windows, change time elsewhere */
+	info->created = stats->st_ctime;
+#endif
+	info->directory = S_ISDIR(stats->st_mode);
+}
+
+/* dstr_copy drops the buffer, this keeps it for the next name */
+static void scratch_copy(struct dstr *dst, const char *array, size_t len)
+{
+	dst->len = 0;
+	if (dst->array)
+		*dst->array = 0;
+	dstr_ncat(dst, array, len);
+}
+
+/* name is relative to the index directory, "" for the directory itself.
+ * Only reads the index, so the stat pool threads can call it. */
+static bool file_get_info(const struct dir_watch_index *index,
+			  const char *name, struct dstr *path,
+			  struct file_info *info, uint64_t *calls)
+{
+	(*calls)++;
+#ifdef __linux__
+	if (index->dir_fd >= 0) {
+		if (!*name)
+			name = ".";
+#ifdef STATX_BTIME
+		/* relative to the open directory so the kernel does not
+		 * resolve the whole path again, and only what is needed */
+		struct statx stx;
+		if (statx(index->dir_fd, name, AT_STATX_SYNC_AS_STAT,
+			  STATX_TYPE | STATX_SIZE | STATX_MTIME | STATX_CTIME |
+				  STATX_BTIME,
+			  &stx) == 0) {
+			info->size = (int64_t)stx.stx_size;
+			info->modified = (time_t)stx.stx_mtime.tv_sec;
+			info->created = (stx.stx_mask & STATX_BTIME)
+						? (time_t)stx.stx_btime.tv_sec
+						: (time_t)stx.stx_ctime.tv_sec;
+			info->directory = S_ISDIR(stx.stx_mode);
+			return true;
+		}
+		if (errno != ENOSYS)
+			return false;
+		(*calls)++;
+#endif
+		struct stat stats;
+		if (fstatat(index->dir_fd, name, &stats, 0) != 0)
+			return false;
+		file_info_from_stat(&stats, info);
+		return true;
+	}
+#endif
+	struct stat stats;
+	scratch_copy(path, index->directory, strlen(index->directory));
+	if (*name) {
+		dstr_cat_ch(path, '/');
+		dstr_cat(path, name);
+	}
+	if (os_stat(path->array, &stats) != 0)
+		return false;
+	file_info_from_stat(&stats, info);
+	return true;
+}
+
+static inline bool index_get_info(struct dir_watch_index *index,
+				  const char *name, struct dstr *path,
+				  struct file_info *info)
+{
+	return file_get_info(index, name, path, info,
+			     &index->stats.stat_calls);
+}
+
+static void views_add(struct dir_watch_index *index,
+		      struct dir_watch_entry *entry)
+{
+	for (size_t i = 0; i < index->views.num; i++)
+		view_add(index->views.array[i], entry);
+}
+
+static void views_remove(struct dir_watch_index *index,
+			 struct dir_watch_entry *entry)
+{
+	for (size_t i = 0; i < index->views.num; i++)
+		view_remove(index->views.array[i], entry);
+}
+
+static bool views_need_stat(const struct dir_watch_index *index)
+{
+	for (size_t i = 0; i < index->views.num; i++) {
+		if (dir_watch_view_needs_stat(index->views.array[i]))
+			return true;
+	}
+	return false;
+}
+
+static bool views_sort_modified(const struct dir_watch_index *index)
+{
+	for (size_t i = 0; i < index->views.num; i++) {
+		const enum sort_by sort_by = index->views.array[i]->sort_by;
+		if (sort_by == modified_newest || sort_by == modified_oldest)
+			return true;
+	}
+	return false;
+}
+
+/* Whether a known file is queried again when its folder is scanned. Sorts
+ * on time leave out empty files, and a file is often created before it is
+ * written, so those are looked at until they have content */
+static bool entry_needs_restat(const struct dir_watch_entry *entry,
+			       bool needs_stat, bool restat)
+{
+	return restat || (needs_stat && (!entry->stated || entry->size <= 0));
+}
+
+/* Applies new file info, moving the entry inside the views when its sort key
+ * changed */
+static void index_apply_info(struct dir_watch_index *index,
+			     struct dir_watch_entry *entry,
+			     const struct file_info *info, bool in_view)
+{
+	if (entry->stated && entry->size == info->size &&
+	    entry->created == info->created &&
+	    entry->modified == info->modified)
+		return;
+	if (in_view) {
+		views_remove(index, entry);
+		index->changes++;
+	}
+	entry->size = info->size;
+	entry->created = info->created;
+	entry->modified = info->modified;
+	entry->stated = true;
+	if (in_view)
+		views_add(index, entry);
+}
+
+/* Returns false when the file is gone */
+static bool index_stat(struct dir_watch_index *index,
+		       struct dir_watch_entry *entry, struct dstr *path,
+		       bool in_view)
+{
+	struct file_info info;
+	if (!index_get_info(index, entry->name, path, &info) ||
+	    info.directory)
+		return false;
+	index_apply_info(index, entry, &info, in_view);
+	return true;
+}
+
+static void index_queue_stat(struct dir_watch_index *index,
+			     struct dir_watch_entry *entry, uint64_t hash)
+{
+	struct dir_watch_stat_request *request =
+		da_push_back_new(index->stat_requests);
+	request->entry = entry;
+	request->name = entry->name;
+	request->hash = hash;
+}
+
+/* Queues a file that is not in the index yet, its name is kept with the
+ * other new names of the listing instead of being copied on its own */
+static void index_queue_new(struct dir_watch_index *index, const char *name,
+			    uint64_t hash)
+{
+	struct dir_watch_stat_request *request =
+		da_push_back_new(index->stat_requests);
+	request->name_offset = index->request_names.num;
+	request->hash = hash;
+	da_push_back_array(index->request_names, name, strlen(name) + 1);
+}
+
+static inline bool index_stopping(const struct dir_watch_index *index)
+{
+	return index->stopping && os_atomic_load_bool(index->stopping);
+}
+
+static void stat_request_run(void *param, size_t i)
+{
+	struct dir_watch_index *index = param;
+	struct dir_watch_stat_request *request =
+		&index->stat_requests.array[i];
+	/* the results are thrown away, each query can take a round trip */
+	if (index_stopping(index)) {
+		request->found = false;
+		return;
+	}
+	struct dstr path;
+	dstr_init(&path);
+	request->found = file_get_info(index, request->name, &path,
+				       &request->info, &request->calls) &&
+			 (!request->entry || !request->info.directory);
+	dstr_free(&path);
+}
+
+/* Each query waits on the disk, on a network share for a round trip, so
+ * the queued ones run together */
+static void index_run_stats(struct dir_watch_index *index)
+{
+	/* the names only stay in place once all are added */
+	for (size_t i = 0; i < index->stat_requests.num; i++) {
+		struct dir_watch_stat_request *request =
+			&index->stat_requests.array[i];
+		if (!request->entry)
+			request->name = index->request_names.array +
+					request->name_offset;
+	}
+	dir_watch_stat_pool_run(index->stat_pool, index->stat_requests.num,
+				stat_request_run, index);
+	for (size_t i = 0; i < index->stat_requests.num; i++)
+		index->stats.stat_calls += index->stat_requests.array[i].calls;
+}
+
+static void index_clear_stats(struct dir_watch_index *index)
+{
+	da_resize(index->stat_requests, 0);
+	da_resize(index->request_names, 0);
+}
+
+enum file_type {
+	file_type_file,
+	file_type_directory,
+	file_type_unknown,
+};
+
+struct dir_iterator {
+#ifdef __linux__
+	DIR *dir;
+#else
+	os_dir_t *dir;
+#endif
+};
+
+static void index_close_dir(struct dir_watch_index *index)
+{
+#ifdef __linux__
+	if (index->dir_fd >= 0)
+		close(index->dir_fd);
+	index->dir_fd = -1;
+#else
+	UNUSED_PARAMETER(index);
+#endif
+}
+
+static bool index_open_root(struct dir_watch_index *index)
+{
+	if (!index->directory)
+		return false;
+#ifdef __linux__
+	/* reopen so a replaced directory is picked up */
+	index_close_dir(index);
+	index->stats.open_calls++;
+	index->dir_fd = open(index->directory,
+			     O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	return index->dir_fd >= 0;
+#else
+	return os_file_exists(index->directory);
+#endif
+}
+
+static bool index_open_folder(struct dir_watch_index *index,
+			      const struct dir_watch_folder *folder,
+			      struct dstr *path, struct dir_iterator *it)
+{
+	index->stats.open_calls++;
+#ifdef __linux__
+	UNUSED_PARAMETER(path);
+	if (index->dir_fd < 0)
+		return false;
+	const int fd = openat(index->dir_fd, *folder->path ? folder->path : ".",
+			      O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	it->dir = fd >= 0 ? fdopendir(fd) : NULL;
+	if (!it->dir && fd >= 0)
+		close(fd);
+#else
+	scratch_copy(path, index->directory, strlen(index->directory));
+	if (*folder->path) {
+		dstr_cat_ch(path, '/');
+		dstr_cat(path, folder->path);
+	}
+	it->dir = os_opendir(path->array);
+#endif
+	return it->dir != NULL;
+}
+
+static const char *index_read_dir(struct dir_iterator *it,
+				  enum file_type *type)
+{
+#ifdef __linux__
+	struct dirent *ent = readdir(it->dir);
+	if (!ent)
+		return NULL;
+	/* the type from the listing saves a stat for every file */
+	if (ent->d_type == DT_DIR)
+		*type = file_type_directory;
+	else if (ent->d_type == DT_UNKNOWN || ent->d_type == DT_LNK)
+		*type = file_type_unknown;
+	else
+		*type = file_type_file;
+	return ent->d_name;
+#else
+	struct os_dirent *ent = os_readdir(it->dir);
+	if (!ent)
+		return NULL;
+	*type = ent->directory ? file_type_directory : file_type_file;
+	return ent->d_name;
+#endif
+}
+
+static void index_close_iterator(struct dir_iterator *it)
+{
+#ifdef __linux__
+	closedir(it->dir);
+#else
+	os_closedir(it->dir);
+#endif
+}
+
+static void build_relative_path(struct dstr *dst,
+				const struct dir_watch_folder *folder,
+				const char *name)
+{
+	scratch_copy(dst, folder->path, strlen(folder->path));
+	if (*folder->path)
+		dstr_cat_ch(dst, '/');
+	dstr_cat(dst, name);
+}
+
+/* ------------------------------------------------------------------------- */
+/* entries */
+
+static void index_grow(struct dir_watch_index *index)
+{
+	const size_t bucket_count =
+		index->bucket_count ? index->bucket_count * 2 : 64;
+	struct dir_watch_entry **buckets =
+		bzalloc(bucket_count * sizeof(struct dir_watch_entry *));
+	for (size_t i = 0; i < index->bucket_count; i++) {
+		struct dir_watch_entry *entry = index->buckets[i];
+		while (entry) {
+			struct dir_watch_entry *next = entry->next;
+			const size_t bucket = entry->hash & (bucket_count - 1);
+			entry->next = buckets[bucket];
+			buckets[bucket] = entry;
+			entry = next;
+		}
+	}
+	bfree(index->buckets);
+	index->buckets = buckets;
+	index->bucket_count = bucket_count;
+}
+
+static struct dir_watch_entry *index_lookup(struct dir_watch_index *index,
+					    const char *name, uint64_t hash)
+{
+	if (!index->bucket_count)
+		return NULL;
+	struct dir_watch_entry *entry =
+		index->buckets[hash & (index->bucket_count - 1)];
+	while (entry) {
+		if (entry->hash == hash && strcmp(entry->name, name) == 0)
+			return entry;
+		entry = entry->next;
+	}
+	return NULL;
+}
+
+static struct dir_watch_entry *entry_alloc(struct dir_watch_index *index)
+{
+	if (!index->free_entries) {
+		struct dir_watch_entry *block = bmalloc(
+			ENTRY_BLOCK_COUNT * sizeof(struct dir_watch_entry));
+		da_push_back(index->entry_blocks, &block);
+		for (size_t i = 0; i < ENTRY_BLOCK_COUNT; i++) {
+			block[i].next = index->free_entries;
+			index->free_entries = &block[i];
+		}
+	}
+	struct dir_watch_entry *entry = index->free_entries;
+	index->free_entries = entry->next;
+	memset(entry, 0, sizeof(*entry));
+	return entry;
+}
+
+static char *name_alloc(struct dir_watch_index *index, const char *name)
+{
+	const size_t size = strlen(name) + 1;
+	if (!index->name_blocks.num ||
+	    index->name_block_used + size > NAME_BLOCK_SIZE) {
+		/* a name longer than a block gets one of its own */
+		const size_t block_size =
+			size > NAME_BLOCK_SIZE ? size : NAME_BLOCK_SIZE;
+		char *block = bmalloc(block_size);
+		da_push_back(index->name_blocks, &block);
+		index->name_block_used = 0;
+	}
+	char *copy = index->name_blocks.array[index->name_blocks.num - 1] +
+		     index->name_block_used;
+	memcpy(copy, name, size);
+	index->name_block_used += size;
+	index->names_live += size;
+	return copy;
+}
+
+/* Moves the names into fresh blocks when more than half of the space is
+ * taken by removed files. Only called between listings, the queued stat
+ * requests point to the names. */
+static void index_compact_names(struct dir_watch_index *index)
+{
+	if (index->names_dead <= index->names_live ||
+	    index->names_dead <= NAME_BLOCK_SIZE)
+		return;
+
+	DARRAY(char *) blocks;
+	da_init(blocks);
+	da_move(blocks, index->name_blocks);
+	index->names_live = 0;
+	index->names_dead = 0;
+	for (size_t i = 0; i < index->bucket_count; i++) {
+		struct dir_watch_entry *entry = index->buckets[i];
+		for (; entry; entry = entry->next) {
+			const size_t file = entry->file - entry->name;
+			entry->name = name_alloc(index, entry->name);
+			entry->file = entry->name + file;
+		}
+	}
+	for (size_t i = 0; i < blocks.num; i++)
+		bfree(blocks.array[i]);
+	da_free(blocks);
+}
+
+static struct dir_watch_entry *index_add(struct dir_watch_index *index,
+					 struct dir_watch_folder *folder,
+					 const char *name, uint64_t hash)
+{
+	if (index->count >= index->bucket_count)
+		index_grow(index);
+	struct dir_watch_entry *entry = entry_alloc(index);
+	entry->name = name_alloc(index, name);
+	entry->file = entry->name;
+	const char *slash = strrchr(entry->name, '/');
+	if (slash)
+		entry->file = slash + 1;
+	entry->hash = hash;
+	entry->size = -1;
+	entry->scan_id = index->scan_id;
+	const size_t bucket = hash & (index->bucket_count - 1);
+	entry->next = index->buckets[bucket];
+	index->buckets[bucket] = entry;
+	index->count++;
+	index->changes++;
+
+	entry->folder = folder;
+	entry->folder_next = folder->entries;
+	if (folder->entries)
+		folder->entries->folder_prev = entry;
+	folder->entries = entry;
+	return entry;
+}
+
+static void index_remove(struct dir_watch_index *index,
+			 struct dir_watch_entry *entry)
+{
+	views_remove(index, entry);
+	struct dir_watch_entry **prev =
+		&index->buckets[entry->hash & (index->bucket_count - 1)];
+	while (*prev != entry)
+		prev = &(*prev)->next;
+	*prev = entry->next;
+	index->count--;
+	index->changes++;
+
+	if (entry->folder_prev)
+		entry->folder_prev->folder_next = entry->folder_next;
+	else
+		entry->folder->entries = entry->folder_next;
+	if (entry->folder_next)
+		entry->folder_next->folder_prev = entry->folder_prev;
+	index->names_live -= strlen(entry->name) + 1;
+	index->names_dead += strlen(entry->name) + 1;
+	entry->next = index->free_entries;
+	index->free_entries = entry;
+}
+
+/* ------------------------------------------------------------------------- */
+/* folders */
+
+static struct dir_watch_folder *folder_lookup(struct dir_watch_index *index,
+					      const char *path, uint64_t hash)
+{
+	if (!index->folder_bucket_count)
+		return NULL;
+	struct dir_watch_folder *folder =
+		index->folder_buckets[hash & (index->folder_bucket_count - 1)];
+	while (folder) {
+		if (folder->hash == hash && strcmp(folder->path, path) == 0)
+			return folder;
+		folder = folder->next;
+	}
+	return NULL;
+}
+
+static void folder_grow(struct dir_watch_index *index)
+{
+	const size_t bucket_count = index->folder_bucket_count
+					    ? index->folder_bucket_count * 2
+					    : 16;
+	struct dir_watch_folder **buckets =
+		bzalloc(bucket_count * sizeof(struct dir_watch_folder *));
+	for (size_t i = 0; i < index->folder_bucket_count; i++) {
+		struct dir_watch_folder *folder = index->folder_buckets[i];
+		while (folder) {
+			struct dir_watch_folder *next = folder->next;
+			const size_t bucket = folder->hash & (bucket_count - 1);
+			folder->next = buckets[bucket];
+			buckets[bucket] = folder;
+			folder = next;
+		}
+	}
+	bfree(index->folder_buckets);
+	index->folder_buckets = buckets;
+	index->folder_bucket_count = bucket_count;
+}
+
+static struct dir_watch_folder *folder_add(struct dir_watch_index *index,
+					   struct dir_watch_folder *parent,
+					   const char *path, uint64_t hash)
+{
+	if (index->folder_count >= index->folder_bucket_count)
+		folder_grow(index);
+	struct dir_watch_folder *folder =
+		bzalloc(sizeof(struct dir_watch_folder));
+	folder->path = bstrdup(path);
+	folder->hash = hash;
+	folder->scan_id = index->scan_id;
+	folder->watch = -1;
+	const size_t bucket = hash & (index->folder_bucket_count - 1);
+	folder->next = index->folder_buckets[bucket];
+	index->folder_buckets[bucket] = folder;
+	index->folder_count++;
+
+	if (parent) {
+		folder->depth = parent->depth + 1;
+		folder->parent = parent;
+		folder->next_sibling = parent->children;
+		if (parent->children)
+			parent->children->prev_sibling = folder;
+		parent->children = folder;
+	}
+	if (index->folder_added)
+		index->folder_added(index->param, folder);
+	return folder;
+}
+
+static void folder_remove(struct dir_watch_index *index,
+			  struct dir_watch_folder *folder)
+{
+	while (folder->children)
+		folder_remove(index, folder->children);
+	while (folder->entries)
+		index_remove(index, folder->entries);
+
+	if (index->folder_removed)
+		index->folder_removed(index->param, folder);
+
+	struct dir_watch_folder **prev =
+		&index->folder_buckets[folder->hash &
+				       (index->folder_bucket_count - 1)];
+	while (*prev != folder)
+		prev = &(*prev)->next;
+	*prev = folder->next;
+	index->folder_count--;
+
+	if (folder->prev_sibling)
+		folder->prev_sibling->next_sibling = folder->next_sibling;
+	else if (folder->parent)
+		folder->parent->children = folder->next_sibling;
+	if (folder->next_sibling)
+		folder->next_sibling->prev_sibling = folder->prev_sibling;
+	if (folder == index->root)
+		index->root = NULL;
+	bfree(folder->path);
+	bfree(folder);
+}
+
+static struct dir_watch_folder *folder_parent(struct dir_watch_index *index,
+					      const char *path)
+{
+	const char *slash = strrchr(path, '/');
+	if (!slash)
+		return index->root;
+	struct dstr *parent = &index->scratch_name;
+	scratch_copy(parent, path, slash - path);
+	struct dir_watch_folder *folder =
+		folder_lookup(index, parent->array, hash_name(parent->array));
+	return folder;
+}
+
+static inline void index_lock(struct dir_watch_index *index)
+{
+	if (index->mutex)
+		pthread_mutex_lock(index->mutex);
+}
+
+static inline void index_unlock(struct dir_watch_index *index)
+{
+	if (index->mutex)
+		pthread_mutex_unlock(index->mutex);
+}
+
+static void folder_listed(struct dir_watch_index *index,
+			  struct dir_watch_folder *parent, const char *path,
+			  uint64_t hash, uint32_t scan_id)
+{
+	struct dir_watch_folder *folder = folder_lookup(index, path, hash);
+	if (folder)
+		folder->scan_id = scan_id;
+	else
+		folder_add(index, parent, path, hash);
+}
+
+/* Lists a single folder, new subfolders are listed by the caller */
+static void folder_list(struct dir_watch_index *index,
+			struct dir_watch_folder *folder, struct dstr *path,
+			bool needs_stat, bool restat)
+{
+	struct dir_iterator it;
+	if (!index_open_folder(index, folder, path, &it))
+		return;
+
+	const bool recurse = folder->depth < index->max_depth;
+	struct dstr *name = &index->scratch_name;
+	const uint32_t scan_id = ++index->scan_id;
+
+	const char *file;
+	enum file_type type;
+	while ((file = index_read_dir(&it, &type)) != NULL) {
+		if (index_stopping(index))
+			break;
+		index->stats.entries++;
+		if (type == file_type_directory && !recurse)
+			continue;
+		if (strcmp(file, ".") == 0 || strcmp(file, "..") == 0)
+			continue;
+		build_relative_path(name, folder, file);
+		const uint64_t hash = hash_name(name->array);
+
+		if (type == file_type_directory) {
+			index_lock(index);
+			folder_listed(index, folder, name->array, hash,
+				      scan_id);
+			index_unlock(index);
+			continue;
+		}
+
+		struct dir_watch_entry *entry =
+			index_lookup(index, name->array, hash);
+		if (entry) {
+			entry->scan_id = scan_id;
+			if (entry_needs_restat(entry, needs_stat, restat))
+				index_queue_stat(index, entry, hash);
+			continue;
+		}
+		if (type == file_type_unknown || needs_stat) {
+			index_queue_new(index, name->array, hash);
+			continue;
+		}
+		index_lock(index);
+		entry = index_add(index, folder, name->array, hash);
+		views_add(index, entry);
+		index_unlock(index);
+	}
+	index_close_iterator(&it);
+	/* given up half way, nothing that was not seen is dropped */
+	if (index_stopping(index)) {
+		index_clear_stats(index);
+		return;
+	}
+
+	index_run_stats(index);
+	if (index_stopping(index)) {
+		index_clear_stats(index);
+		return;
+	}
+	index_lock(index);
+	for (size_t i = 0; i < index->stat_requests.num; i++) {
+		struct dir_watch_stat_request *request =
+			&index->stat_requests.array[i];
+		if (request->entry) {
+			if (request->found)
+				index_apply_info(index, request->entry,
+						 &request->info, true);
+			else
+				request->entry->scan_id = scan_id - 1;
+			continue;
+		}
+		if (request->found && request->info.directory) {
+			if (recurse)
+				folder_listed(index, folder, request->name,
+					      request->hash, scan_id);
+		} else if (request->found) {
+			struct dir_watch_entry *entry = index_add(
+				index, folder, request->name, request->hash);
+			index_apply_info(index, entry, &request->info, false);
+			views_add(index, entry);
+		}
+	}
+	index_clear_stats(index);
+
+	/* drop everything that was not listed anymore */
+	struct dir_watch_entry *entry = folder->entries;
+	while (entry) {
+		struct dir_watch_entry *next = entry->folder_next;
+		if (entry->scan_id != scan_id)
+			index_remove(index, entry);
+		entry = next;
+	}
+	struct dir_watch_folder *child = folder->children;
+	while (child) {
+		struct dir_watch_folder *next = child->next_sibling;
+		if (child->scan_id != scan_id)
+			folder_remove(index, child);
+		child = next;
+	}
+	index_unlock(index);
+	folder->listed = time(NULL);
+}
+
+/* Queries the files of a folder that is not listed again. Writing to a file
+ * leaves its folder as it was, so this is how content shows up */
+static void folder_restat(struct dir_watch_index *index,
+			  struct dir_watch_folder *folder, bool restat)
+{
+	for (struct dir_watch_entry *entry = folder->entries; entry;
+	     entry = entry->folder_next) {
+		if (entry_needs_restat(entry, true, restat))
+			index_queue_stat(index, entry, entry->hash);
+	}
+	if (!index->stat_requests.num)
+		return;
+	index_run_stats(index);
+	/* skipped queries would look like removed files */
+	const bool stopped = index_stopping(index);
+	index_lock(index);
+	for (size_t i = 0; i < index->stat_requests.num && !stopped; i++) {
+		struct dir_watch_stat_request *request =
+			&index->stat_requests.array[i];
+		if (request->found)
+			index_apply_info(index, request->entry,
+					 &request->info, true);
+		else
+			index_remove(index, request->entry);
+	}
+	index_unlock(index);
+	index_clear_stats(index);
+}
+
+/* Lists a folder and its subfolders, folders whose modification time and
+ * size did not change since they were listed are skipped unless forced */
+static void folder_scan(struct dir_watch_index *index,
+			struct dir_watch_folder *folder, struct dstr *path,
+			bool force, bool needs_stat, bool restat)
+{
+	if (index_stopping(index))
+		return;
+	bool list = force || !folder->listed;
+	struct file_info info;
+	if (!index_get_info(index, folder->path, path, &info) ||
+	    !info.directory) {
+		if (folder != index->root) {
+			index_lock(index);
+			folder_remove(index, folder);
+			index_unlock(index);
+			return;
+		}
+		list = true;
+	} else {
+		/* the listing has to be newer than the modification time,
+		 * changes in the same second would be missed otherwise */
+		if (info.modified != folder->modified ||
+		    info.size != folder->size ||
+		    folder->listed <= folder->modified + 1)
+			list = true;
+		folder->modified = info.modified;
+		folder->size = info.size;
+	}
+	if (list)
+		folder_list(index, folder, path, needs_stat, restat);
+	else if (needs_stat)
+		folder_restat(index, folder, restat);
+
+	struct dir_watch_folder *child = folder->children;
+	while (child) {
+		struct dir_watch_folder *next = child->next_sibling;
+		folder_scan(index, child, path, force, needs_stat, restat);
+		child = next;
+	}
+}
+
+/* ------------------------------------------------------------------------- */
+
+static void index_clear(struct dir_watch_index *index)
+{
+	if (index->root)
+		folder_remove(index, index->root);
+}
+
+void dir_watch_index_init(struct dir_watch_index *index)
+{
+	memset(index, 0, sizeof(*index));
+#ifdef __linux__
+	index->dir_fd = -1;
+#endif
+}
+
+void dir_watch_index_free(struct dir_watch_index *index)
+{
+	index_clear(index);
+	index_close_dir(index);
+	bfree(index->buckets);
+	bfree(index->folder_buckets);
+	bfree(index->directory);
+	da_free(index->views);
+	da_free(index->stat_requests);
+	dir_watch_stat_pool_destroy(index->stat_pool);
+	for (size_t i = 0; i < index->entry_blocks.num; i++)
+		bfree(index->entry_blocks.array[i]);
+	for (size_t i = 0; i < index->name_blocks.num; i++)
+		bfree(index->name_blocks.array[i]);
+	da_free(index->entry_blocks);
+	da_free(index->name_blocks);
+	dstr_free(&index->scratch_name);
+	dstr_free(&index->scratch_path);
+	da_free(index->request_names);
+	index->free_entries = NULL;
+	index->name_block_used = 0;
+	index->names_live = 0;
+	index->names_dead = 0;
+	index->stat_pool = NULL;
+	index->buckets = NULL;
+	index->bucket_count = 0;
+	index->folder_buckets = NULL;
+	index->folder_bucket_count = 0;
+	index->directory = NULL;
+}
+
+bool dir_watch_index_set_directory(struct dir_watch_index *index,
+				   const char *directory, int max_depth)
+{
+	if (max_depth < 0)
+		max_depth = 0;
+	const bool depth_changed = index->max_depth != max_depth;
+	index->max_depth = max_depth;
+	if (!update_string(&index->directory, directory) && !depth_changed)
+		return false;
+	index_clear(index);
+	index_close_dir(index);
+	index_compact_names(index);
+	return true;
+}
+
+void dir_watch_index_set_stat_threads(struct dir_watch_index *index,
+				      size_t threads)
+{
+	if (threads <= 1) {
+		dir_watch_stat_pool_destroy(index->stat_pool);
+		index->stat_pool = NULL;
+		return;
+	}
+	if (!index->stat_pool)
+		index->stat_pool = dir_watch_stat_pool_create();
+	dir_watch_stat_pool_set_threads(index->stat_pool, threads);
+}
+
+void dir_watch_index_close(struct dir_watch_index *index)
+{
+	index_close_dir(index);
+}
+
+struct dir_watch_entry *dir_watch_index_find(struct dir_watch_index *index,
+					     const char *name)
+{
+	return index_lookup(index, name, hash_name(name));
+}
+
+void dir_watch_index_enum_folders(struct dir_watch_index *index,
+				  void (*callback)(void *param,
+						   struct dir_watch_folder *),
+				  void *param)
+{
+	for (size_t i = 0; i < index->folder_bucket_count; i++) {
+		struct dir_watch_folder *folder = index->folder_buckets[i];
+		for (; folder; folder = folder->next)
+			callback(param, folder);
+	}
+}
+
+bool dir_watch_index_scan(struct dir_watch_index *index, bool force)
+{
+	if (!index_open_root(index))
+		return false;
+	if (!index->root) {
+		index_lock(index);
+		index->root = folder_add(index, NULL, "", hash_name(""));
+		index_unlock(index);
+	}
+
+	const bool needs_stat = views_need_stat(index);
+	const bool restat = views_sort_modified(index);
+	folder_scan(index, index->root, &index->scratch_path, force,
+		    needs_stat, restat);
+	index_lock(index);
+	index_compact_names(index);
+	index_unlock(index);
+	return true;
+}
+
+void dir_watch_index_refresh(struct dir_watch_index *index, const char *name)
+{
+	if (!index->directory || !index->root)
+		return;
+#ifdef __linux__
+	if (index->dir_fd < 0)
+		index_open_root(index);
+#endif
+	struct dir_watch_folder *parent = folder_parent(index, name);
+	if (!parent)
+		return;
+
+	struct dstr *path = &index->scratch_path;
+	struct file_info info;
+	const bool exists = index_get_info(index, name, path, &info);
+
+	const uint64_t hash = hash_name(name);
+	struct dir_watch_entry *entry = index_lookup(index, name, hash);
+	struct dir_watch_folder *folder = folder_lookup(index, name, hash);
+	index_lock(index);
+	if (!exists || info.directory) {
+		if (entry)
+			index_remove(index, entry);
+		if (!exists && folder)
+			folder_remove(index, folder);
+		const bool scan = exists && !folder &&
+				  parent->depth < index->max_depth;
+		if (scan)
+			folder = folder_add(index, parent, name, hash);
+		index_unlock(index);
+		if (scan)
+			folder_scan(index, folder, path, true,
+				    views_need_stat(index), false);
+		index_lock(index);
+		index_compact_names(index);
+		index_unlock(index);
+		return;
+	}
+	if (folder)
+		folder_remove(index, folder);
+	if (!entry) {
+		entry = index_add(index, parent, name, hash);
+		index_apply_info(index, entry, &info, false);
+		views_add(index, entry);
+	} else {
+		index_apply_info(index, entry, &info, true);
+		index_compact_names(index);
+	}
+	index_unlock(index);
+}
+
+void dir_watch_view_rebuild(struct dir_watch_view *view,
+			    struct dir_watch_index *index)
+{
+	view_clear(view);
+
+	const bool needs_stat = dir_watch_view_needs_stat(view);
+	const uint32_t bit = view->slot >= 0 ? 1u << view->slot : 0;
+	for (size_t i = 0; i < index->bucket_count; i++) {
+		struct dir_watch_entry *entry = index->buckets[i];
+		for (; entry; entry = entry->next) {
+			/* the matcher may have changed */
+			entry->match_known &= ~bit;
+			/* the next scan drops files that are gone */
+			if (needs_stat && !entry->stated &&
+			    !index_stat(index, entry, &index->scratch_path,
+					false))
+				continue;
+			view_add(view, entry);
+		}
+	}
+}
+
+void dir_watch_index_add_view(struct dir_watch_index *index,
+			      struct dir_watch_view *view)
+{
+	da_push_back(index->views, &view);
+	view->slot = -1;
+	for (int slot = 0; slot < 32; slot++) {
+		if (!(index->view_slots & (1u << slot))) {
+			index->view_slots |= 1u << slot;
+			view->slot = slot;
+			break;
+		}
+	}
+	dir_watch_view_rebuild(view, index);
+}
+
+void dir_watch_index_remove_view(struct dir_watch_index *index,
+				 struct dir_watch_view *view)
+{
+	da_erase_item(index->views, &view);
+	if (view->slot >= 0)
+		index->view_slots &= ~(1u << view->slot);
+	view->slot = -1;
+	view_clear(view);
+}
+
+/* ------------------------------------------------------------------------- */
+/* snapshot */
+
+/* A snapshot can be used in place: the header, the folders with parents
+ * before their subfolders, the files and the strings both point into, the
+ * directory first. Numbers are in the byte order of the writer, a reader
+ * with another one does not recognize the magic. */
+#define SNAPSHOT_MAGIC 0x4944574DU
+#define SNAPSHOT_VERSION 1
+#define SNAPSHOT_NONE UINT32_MAX
+#define SNAPSHOT_MAX_SIZE (1LL << 30)
+
+struct snapshot_header {
+	uint32_t magic;
+	uint32_t version;
+	/* identity of the directory, a replaced one does not match */
+	uint64_t device;
+	uint64_t inode;
+	int32_t max_depth;
+	uint32_t folder_count;
+	uint32_t entry_count;
+	uint32_t strings_size;
+};
+
+struct snapshot_folder {
+	uint32_t path;
+	uint32_t parent;
+	int64_t modified;
+	int64_t size;
+	int64_t listed;
+};
+
+struct snapshot_entry {
+	uint32_t name;
+	uint32_t folder;
+	int64_t size;
+	int64_t created;
+	int64_t modified;
+	uint32_t stated;
+	uint32_t reserved;
+};
+
+struct snapshot_writer {
+	DARRAY(struct snapshot_folder) folders;
+	DARRAY(struct snapshot_entry) entries;
+	DARRAY(char) strings;
+};
+
+static bool snapshot_identity(const struct dir_watch_index *index,
+			      struct snapshot_header *header)
+{
+	struct stat stats;
+	if (os_stat(index->directory, &stats) != 0)
+		return false;
+	header->device = (uint64_t)stats.st_dev;
+	header->inode = (uint64_t)stats.st_ino;
+	return true;
+}
+
+static uint32_t snapshot_add_string(struct snapshot_writer *writer,
+				    const char *string)
+{
+	const uint32_t offset = (uint32_t)writer->strings.num;
+	da_push_back_array(writer->strings, string, strlen(string) + 1);
+	return offset;
+}
+
+static void snapshot_add_folder(struct snapshot_writer *writer,
+				const struct dir_watch_folder *folder,
+				uint32_t parent)
+{
+	const uint32_t id = (uint32_t)writer->folders.num;
+	struct snapshot_folder *item = da_push_back_new(writer->folders);
+	item->path = snapshot_add_string(writer, folder->path);
+	item->parent = parent;
+	item->modified = (int64_t)folder->modified;
+	item->size = folder->size;
+	item->listed = (int64_t)folder->listed;
+
+	for (struct dir_watch_entry *entry = folder->entries; entry;
+	     entry = entry->folder_next) {
+		struct snapshot_entry *file =
+			da_push_back_new(writer->entries);
+		file->name = snapshot_add_string(writer, entry->name);
+		file->folder = id;
+		file->size = entry->size;
+		file->created = (int64_t)entry->created;
+		file->modified = (int64_t)entry->modified;
+		file->stated = entry->stated;
+	}
+	for (const struct dir_watch_folder *child = folder->children; child;
+	     child = child->next_sibling)
+		snapshot_add_folder(writer, child, id);
+}
+
+static bool snapshot_write(const char *file,
+			   const struct snapshot_header *header,
+			   const struct snapshot_writer *writer)
+{
+	struct dstr temp;
+	dstr_init_copy(&temp, file);
+	dstr_cat(&temp, ".tmp");
+	FILE *f = os_fopen(temp.array, "wb");
+	bool success = f != NULL;
+	if (f) {
+		success = fwrite(header, sizeof(*header), 1, f) == 1 &&
+			  fwrite(writer->folders.array,
+				 sizeof(struct snapshot_folder),
+				 writer->folders.num,
+				 f) == writer->folders.num &&
+			  fwrite(writer->entries.array,
+				 sizeof(struct snapshot_entry),
+				 writer->entries.num,
+				 f) == writer->entries.num &&
+			  fwrite(writer->strings.array, 1, writer->strings.num,
+				 f) == writer->strings.num;
+		success = fclose(f) == 0 && success;
+	}
+	/* the previous snapshot stays until the new one is complete */
+	if (success)
+		success = os_safe_replace(file, temp.array, NULL) == 0;
+	if (!success)
+		os_unlink(temp.array);
+	dstr_free(&temp);
+	return success;
+}
+
+bool dir_watch_index_save(struct dir_watch_index *index, const char *file)
+{
+	struct snapshot_header header = {0};
+	if (!index->directory || !index->root ||
+	    !snapshot_identity(index, &header))
+		return false;
+
+	struct snapshot_writer writer;
+	da_init(writer.folders);
+	da_init(writer.entries);
+	da_init(writer.strings);
+	da_reserve(writer.entries, index->count);
+	da_reserve(writer.folders, index->folder_count);
+	snapshot_add_string(&writer, index->directory);
+	snapshot_add_folder(&writer, index->root, SNAPSHOT_NONE);
+
+	header.magic = SNAPSHOT_MAGIC;
+	header.version = SNAPSHOT_VERSION;
+	header.max_depth = index->max_depth;
+	header.folder_count = (uint32_t)writer.folders.num;
+	header.entry_count = (uint32_t)writer.entries.num;
+	header.strings_size = (uint32_t)writer.strings.num;
+	const bool success = snapshot_write(file, &header, &writer);
+	da_free(writer.folders);
+	da_free(writer.entries);
+	da_free(writer.strings);
+	return success;
+}
+
+/* True when path is a direct child of the folder at parent */
+static bool snapshot_child(const char *parent, const char *path)
+{
+	const size_t len = strlen(parent);
+	if (len) {
+		if (strncmp(path, parent, len) != 0 || path[len] != '/')
+			return false;
+		path += len + 1;
+	}
+	return *path && !strchr(path, '/');
+}
+
+static int snapshot_compare_strings(const void *a, const void *b)
+{
+	return strcmp(*(const char *const *)a, *(const char *const *)b);
+}
+
+/* Checks everything the snapshot points to before anything is added */
+static bool snapshot_valid(const struct dir_watch_index *index,
+			   const uint8_t *data, int64_t size)
+{
+	const struct snapshot_header *header = (const void *)data;
+	if (header->magic != SNAPSHOT_MAGIC ||
+	    header->version != SNAPSHOT_VERSION ||
+	    header->max_depth != index->max_depth || !header->folder_count ||
+	    !header->strings_size)
+		return false;
+	const int64_t expected =
+		(int64_t)sizeof(struct snapshot_header) +
+		(int64_t)header->folder_count *
+			(int64_t)sizeof(struct snapshot_folder) +
+		(int64_t)header->entry_count *
+			(int64_t)sizeof(struct snapshot_entry) +
+		(int64_t)header->strings_size;
+	if (expected != size)
+		return false;
+
+	struct snapshot_header current;
+	if (!snapshot_identity(index, &current) ||
+	    current.device != header->device || current.inode != header->inode)
+		return false;
+
+	const struct snapshot_folder *folders = (const void *)(header + 1);
+	const struct snapshot_entry *entries =
+		(const void *)(folders + header->folder_count);
+	const char *strings = (const char *)(entries + header->entry_count);
+	if (strings[header->strings_size - 1] != 0 ||
+	    strcmp(strings, index->directory) != 0)
+		return false;
+	for (uint32_t i = 0; i < header->folder_count; i++) {
+		const uint32_t parent = folders[i].parent;
+		if (folders[i].path >= header->strings_size ||
+		    (i == 0) != (parent == SNAPSHOT_NONE) ||
+		    (i > 0 && parent >= i))
+			return false;
+		const char *path = strings + folders[i].path;
+		if (i == 0 ? *path != 0
+			   : !snapshot_child(strings + folders[parent].path,
+					     path))
+			return false;
+	}
+	for (uint32_t i = 0; i < header->entry_count; i++) {
+		if (entries[i].name >= header->strings_size ||
+		    entries[i].folder >= header->folder_count ||
+		    !snapshot_child(strings + folders[entries[i].folder].path,
+				    strings + entries[i].name))
+			return false;
+	}
+
+	/* a path is listed once, as a folder or as a file */
+	const size_t count =
+		(size_t)header->folder_count + header->entry_count;
+	const char **paths = bmalloc(count * sizeof(*paths));
+	for (uint32_t i = 0; i < header->folder_count; i++)
+		paths[i] = strings + folders[i].path;
+	for (uint32_t i = 0; i < header->entry_count; i++)
+		paths[header->folder_count + i] = strings + entries[i].name;
+	qsort(paths, count, sizeof(*paths), snapshot_compare_strings);
+	bool unique = true;
+	for (size_t i = 1; i < count && unique; i++)
+		unique = strcmp(paths[i - 1], paths[i]) != 0;
+	bfree(paths);
+	return unique;
+}
+
+static void snapshot_restore(struct dir_watch_index *index,
+			     const uint8_t *data)
+{
+	const struct snapshot_header *header = (const void *)data;
+	const struct snapshot_folder *folders = (const void *)(header + 1);
+	const struct snapshot_entry *entries =
+		(const void *)(folders + header->folder_count);
+	const char *strings = (const char *)(entries + header->entry_count);
+
+	struct dir_watch_folder **added =
+		bmalloc(header->folder_count * sizeof(*added));
+	for (uint32_t i = 0; i < header->folder_count; i++) {
+		const char *path = strings + folders[i].path;
+		struct dir_watch_folder *parent =
+			i ? added[folders[i].parent] : NULL;
+		added[i] = folder_add(index, parent, path, hash_name(path));
+		added[i]->modified = (time_t)folders[i].modified;
+		added[i]->size = folders[i].size;
+		added[i]->listed = (time_t)folders[i].listed;
+	}
+	index->root = added[0];
+
+	for (uint32_t i = 0; i < header->entry_count; i++) {
+		const char *name = strings + entries[i].name;
+		const uint64_t hash = hash_name(name);
+		struct dir_watch_entry *entry = index_add(
+			index, added[entries[i].folder], name, hash);
+		if (entries[i].stated) {
+			const struct file_info info = {
+				entries[i].size,
+				(time_t)entries[i].created,
+				(time_t)entries[i].modified,
+				false,
+			};
+			index_apply_info(index, entry, &info, false);
+		}
+		views_add(index, entry);
+	}
+	bfree(added);
+}
+
+bool dir_watch_index_load(struct dir_watch_index *index, const char *file)
+{
+	if (!index->directory || index->root)
+		return false;
+	FILE *f = os_fopen(file, "rb");
+	if (!f)
+		return false;
+	const int64_t size = os_fgetsize(f);
+	uint8_t *data = NULL;
+	if (size >= (int64_t)sizeof(struct snapshot_header) &&
+	    size <= SNAPSHOT_MAX_SIZE) {
+		data = bmalloc((size_t)size);
+		if (fread(data, 1, (size_t)size, f) != (size_t)size) {
+			bfree(data);
+			data = NULL;
+		}
+	}
+	fclose(f);
+
+	const bool valid = data && snapshot_valid(index, data, size);
+	if (valid)
+		snapshot_restore(index, data);
+	bfree(data);
+	return valid;
+}
@@ -0,0 +1,250 @@
+#pragma once
+
+#include "dir-watch-media.h"
+#include "dir-watch-matcher.h"
+#include <util/darray.h>
+#include <util/dstr.h>
+#include <util/threading.h>
+#include <time.h>
+
+struct dir_watch_folder;
+
+struct dir_watch_entry {
+	struct dir_watch_entry *next;
+	/* path relative to the index directory */
+	char *name;
+	/* file name part of name */
+	const char *file;
+	uint64_t hash;
+	int64_t size;
+	time_t created;
+	time_t modified;
+	uint32_t scan_id;
+	bool stated;
+	/* matcher results per view slot */
+	uint32_t match_known;
+	uint32_t match_bits;
+	struct dir_watch_folder *folder;
+	struct dir_watch_entry *folder_prev;
+	struct dir_watch_entry *folder_next;
+};
+
+/* A directory inside the watched tree, the watched directory itself is the
+ * root with an empty path */
+struct dir_watch_folder {
+	struct dir_watch_folder *next;
+	char *path;
+	uint64_t hash;
+	int depth;
+	time_t modified;
+	int64_t size;
+	time_t listed;
+	uint32_t scan_id;
+	struct dir_watch_folder *parent;
+	struct dir_watch_folder *children;
+	struct dir_watch_folder *prev_sibling;
+	struct dir_watch_folder *next_sibling;
+	struct dir_watch_entry *entries;
+	/* watch descriptor of the watcher, -1 when not watched */
+	int watch;
+};
+
+struct dir_watch_node;
+struct dir_watch_stat_request;
+struct dir_watch_stat_pool;
+
+/* changes kept for a view before they are reported as a reset */
+#define DIR_WATCH_VIEW_CHANGES_MAX 1024
+
+/* A file that joined or left a view */
+struct dir_watch_view_change {
+	/* offset of the name in the names of the log */
+	size_t name;
+	bool added;
+};
+
+/* Files that joined or left a view, oldest first. reset is set instead
+ * when the view was emptied or more changed than is kept, the view then
+ * has to be read again. */
+struct dir_watch_view_changes {
+	DARRAY(struct dir_watch_view_change) items;
+	DARRAY(char) names;
+	bool reset;
+};
+
+/* The files of an index that pass a filter, ordered by its sort mode */
+struct dir_watch_view {
+	struct dir_watch_matcher *matcher;
+	enum sort_by sort_by;
+	/* deepest subdirectory level included */
+	int max_depth;
+	struct dir_watch_node *root;
+	uint64_t random_state;
+	struct dir_watch_entry *last_drawn;
+	/* bit of the matcher result cache in the entries, -1 for none */
+	int slot;
+	/* nodes are carved from blocks, those of removed files are reused */
+	struct dir_watch_node *free_nodes;
+	DARRAY(struct dir_watch_node *) node_blocks;
+	struct dir_watch_view_changes changes;
+};
+
+/* File system work done by an index since it was created */
+struct dir_watch_index_stats {
+	/* directory entries read */
+	uint64_t entries;
+	uint64_t stat_calls;
+	uint64_t open_calls;
+};
+
+/* Cached directory listing, kept up to date from changes instead of being
+ * rebuilt on every scan. Changes are applied to all of its views. */
+struct dir_watch_index {
+	char *directory;
+	struct dir_watch_entry **buckets;
+	size_t bucket_count;
+	size_t count;
+	uint32_t scan_id;
+	/* bumped whenever a file is added, removed or changed */
+	uint64_t changes;
+	DARRAY(struct dir_watch_view *) views;
+	uint32_t view_slots;
+
+	struct dir_watch_folder *root;
+	struct dir_watch_folder **folder_buckets;
+	size_t folder_bucket_count;
+	size_t folder_count;
+	int max_depth;
+	void (*folder_added)(void *param, struct dir_watch_folder *folder);
+	void (*folder_removed)(void *param, struct dir_watch_folder *folder);
+	void *param;
+	/* held by scan and refresh only while they change the index and its
+	 * views, so readers on other threads do not wait on the file system.
+	 * NULL when no other thread reads the index. */
+	pthread_mutex_t *mutex;
+	/* a listing gives up once this is set, keeping what it did not get
+	 * to as it was. NULL to always finish. */
+	const volatile bool *stopping;
+	struct dir_watch_index_stats stats;
+	/* runs the file queries of a listing together, NULL to run them one
+	 * after another */
+	struct dir_watch_stat_pool *stat_pool;
+	DARRAY(struct dir_watch_stat_request) stat_requests;
+
+	/* entries and their names are carved from blocks that are reused, a
+	 * scan only allocates while the index grows. Names are packed into
+	 * fresh blocks once most of the name space belongs to removed
+	 * files. */
+	struct dir_watch_entry *free_entries;
+	DARRAY(struct dir_watch_entry *) entry_blocks;
+	DARRAY(char *) name_blocks;
+	size_t name_block_used;
+	size_t names_live;
+	size_t names_dead;
+	/* reused by every listing */
+	struct dstr scratch_name;
+	struct dstr scratch_path;
+	DARRAY(char) request_names;
+#ifdef __linux__
+	int dir_fd;
+#endif
+};
+
+/* Orders two files the way a view with the sort mode does, only their
+ * names and times are used */
+int dir_watch_entry_compare(enum sort_by sort_by,
+			    const struct dir_watch_entry *a,
+			    const struct dir_watch_entry *b);
+
+/* Uniform in [0, n) from the random state, n must not be 0 */
+size_t dir_watch_random_below(uint64_t *state, size_t n);
+
+void dir_watch_index_init(struct dir_watch_index *index);
+void dir_watch_index_free(struct dir_watch_index *index);
+
+/* Clears the index when the directory or the subdirectory depth changed,
+ * returns true if it did */
+bool dir_watch_index_set_directory(struct dir_watch_index *index,
+				   const char *directory, int max_depth);
+
+/* Lists the directory and its subdirectories up to the max depth. Only
+ * files that are new are stat'ed unless a view sorts on modification
+ * time, and on Linux only when a view sorts on time or the listing does
+ * not tell the file type. The directory and subdirectories whose
+ * modification time and size did not change since they were listed are
+ * not read again unless forced. */
+bool dir_watch_index_scan(struct dir_watch_index *index, bool force);
+
+/* How many file queries a scan runs at once, more than one only pays off
+ * where every query waits on the network */
+void dir_watch_index_set_stat_threads(struct dir_watch_index *index,
+				      size_t threads);
+
+/* Updates a single file or subdirectory after a change notification */
+void dir_watch_index_refresh(struct dir_watch_index *index, const char *name);
+
+/* Saves the listing to file, or restores it into an empty index when the
+ * file holds the same directory at the same subdirectory depth. Restored
+ * folders are only read again by a scan when they changed since. */
+bool dir_watch_index_save(struct dir_watch_index *index, const char *file);
+bool dir_watch_index_load(struct dir_watch_index *index, const char *file);
+
+/* Closes the directory kept open by scan and refresh, an open handle delays
+ * the removal of the directory */
+void dir_watch_index_close(struct dir_watch_index *index);
+
+void dir_watch_index_enum_folders(struct dir_watch_index *index,
+				  void (*callback)(void *param,
+						   struct dir_watch_folder *),
+				  void *param);
+
+struct dir_watch_entry *dir_watch_index_find(struct dir_watch_index *index,
+					     const char *name);
+
+/* Fills the view from the index and keeps it up to date until removed */
+void dir_watch_index_add_view(struct dir_watch_index *index,
+			      struct dir_watch_view *view);
+void dir_watch_index_remove_view(struct dir_watch_index *index,
+				 struct dir_watch_view *view);
+
+void dir_watch_view_init(struct dir_watch_view *view);
+void dir_watch_view_free(struct dir_watch_view *view);
+
+/* Returns true when the view has to be rebuilt, it is empty until then */
+bool dir_watch_view_update(struct dir_watch_view *view,
+			   struct dir_watch_matcher *matcher,
+			   enum sort_by sort_by, int max_depth);
+void dir_watch_view_rebuild(struct dir_watch_view *view,
+			    struct dir_watch_index *index);
+
+bool dir_watch_view_matches(const struct dir_watch_view *view,
+			    struct dir_watch_entry *entry);
+bool dir_watch_view_needs_stat(const struct dir_watch_view *view);
+
+size_t dir_watch_view_count(const struct dir_watch_view *view);
+struct dir_watch_entry *dir_watch_view_first(const struct dir_watch_view *view);
+struct dir_watch_entry *dir_watch_view_last(const struct dir_watch_view *view);
+struct dir_watch_entry *dir_watch_view_at(const struct dir_watch_view *view,
+					  size_t index);
+/* Number of files in the view that sort before key, with equal also those
+ * that compare equal to it. key does not have to be part of the view. */
+size_t dir_watch_view_rank(const struct dir_watch_view *view,
+			   const struct dir_watch_entry *key, bool equal);
+
+/* Records a change, name is relative to the index directory */
+void dir_watch_view_changes_add(struct dir_watch_view_changes *changes,
+				const char *name, bool added);
+/* Appends the changes of src to dst and clears src */
+void dir_watch_view_changes_move(struct dir_watch_view_changes *dst,
+				 struct dir_watch_view_changes *src);
+void dir_watch_view_changes_clear(struct dir_watch_view_changes *changes);
+void dir_watch_view_changes_free(struct dir_watch_view_changes *changes);
+
+/* Shuffle bag: draws every file once in random order before starting over,
+ * files added in between join the current round */
+struct dir_watch_entry *dir_watch_view_draw(struct dir_watch_view *view);
+
+/* Picks the file for the sort mode, time keeps the newest/oldest time seen
+ * so far so the selection never goes back to an older file */
+struct dir_watch_entry *dir_watch_view_select(struct dir_watch_view *view,
+					      time_t *time);
@@ -0,0 +1,481 @@
+#include "dir-watch-matcher.h"
+#include <obs-module.h>
+#include <util/platform.h>
+#include <util/threading.h>
+#include <util/darray.h>
+#include <util/dstr.h>
+
+#ifndef _WIN32
+#include <regex.h>
+#endif
+
+enum glob_op {
+	glob_literal,
+	glob_any,
+	glob_star,
+	glob_class,
+};
+
+struct glob_token {
+	enum glob_op op;
+	/* lowercase */
+	char *literal;
+	size_t len;
+	bool negate;
+	/* lowercase characters of the class */
+	uint8_t set[32];
+};
+
+enum pattern_type {
+	pattern_substring,
+	pattern_glob,
+	pattern_regex,
+};
+
+struct pattern {
+	enum pattern_type type;
+	bool exclude;
+	char *text;
+	DARRAY(struct glob_token) glob;
+#ifndef _WIN32
+	regex_t regex;
+#endif
+};
+
+struct dir_watch_matcher {
+	volatile long refs;
+	char *filter;
+	char *extensions;
+
+	DARRAY(struct pattern) patterns;
+	size_t include_count;
+
+	/* lowercase extensions without dot, open addressing on their hash */
+	char **extension_slots;
+	uint64_t *extension_hashes;
+	size_t extension_slot_count;
+	size_t extension_count;
+};
+
+static inline char lower(char c)
+{
+	return c >= 'A' && c <= 'Z' ? (char)(c - 'A' + 'a') : c;
+}
+
+static uint64_t hash_lower(const char *str)
+{
+	uint64_t hash = 14695981039346656037ULL;
+	while (*str) {
+		hash ^= (uint8_t)lower(*str++);
+		hash *= 1099511628211ULL;
+	}
+	return hash;
+}
+
+static bool equal_lower(const char *a, const char *b)
+{
+	while (*a && lower(*a) == lower(*b)) {
+		a++;
+		b++;
+	}
+	return !*a && !*b;
+}
+
+/* ------------------------------------------------------------------------- */
+/* extensions */
+
+static size_t extension_find(const struct dir_watch_matcher *matcher,
+			     const char *extension, uint64_t hash)
+{
+	const size_t mask = matcher->extension_slot_count - 1;
+	size_t slot = (size_t)hash & mask;
+	while (matcher->extension_slots[slot]) {
+		if (matcher->extension_hashes[slot] == hash &&
+		    equal_lower(matcher->extension_slots[slot], extension))
+			return slot;
+		slot = (slot + 1) & mask;
+	}
+	return slot;
+}
+
+static bool is_extension_separator(char c)
+{
+	return c == ',' || c == ';' || c == ' ' || c == '\t';
+}
+
+static void extensions_compile(struct dir_watch_matcher *matcher,
+			       const char *extensions)
+{
+	DARRAY(char *) list;
+	da_init(list);
+	const char *p = extensions;
+	while (*p) {
+		while (is_extension_separator(*p) || *p == '.' || *p == '*')
+			p++;
+		size_t len = 0;
+		while (p[len] && !is_extension_separator(p[len]))
+			len++;
+		if (!len)
+			continue;
+		char *ext = bstrdup_n(p, len);
+		for (size_t i = 0; i < len; i++)
+			ext[i] = lower(ext[i]);
+		da_push_back(list, &ext);
+		p += len;
+	}
+
+	/* keep the table at most half full */
+	size_t slots = 4;
+	while (slots < list.num * 2)
+		slots *= 2;
+	matcher->extension_slot_count = slots;
+	matcher->extension_slots =
+		bzalloc(slots * sizeof(*matcher->extension_slots));
+	matcher->extension_hashes =
+		bzalloc(slots * sizeof(*matcher->extension_hashes));
+
+	for (size_t i = 0; i < list.num; i++) {
+		char *ext = list.array[i];
+		const uint64_t hash = hash_lower(ext);
+		const size_t slot = extension_find(matcher, ext, hash);
+		if (matcher->extension_slots[slot]) {
+			bfree(ext);
+			continue;
+		}
+		matcher->extension_slots[slot] = ext;
+		matcher->extension_hashes[slot] = hash;
+		matcher->extension_count++;
+	}
+	da_free(list);
+}
+
+static bool extensions_match(const struct dir_watch_matcher *matcher,
+			     const char *file)
+{
+	/* every suffix after a dot, so tar.gz matches as well as gz */
+	for (const char *dot = strchr(file, '.'); dot;
+	     dot = strchr(dot + 1, '.')) {
+		const char *extension = dot + 1;
+		if (!*extension)
+			break;
+		const uint64_t hash = hash_lower(extension);
+		const size_t slot = extension_find(matcher, extension, hash);
+		if (matcher->extension_slots[slot])
+			return true;
+	}
+	return false;
+}
+
+/* ------------------------------------------------------------------------- */
+/* globs */
+
+static void class_set(struct glob_token *token, char c)
+{
+	const uint8_t l = (uint8_t)lower(c);
+	token->set[l >> 3] |= (uint8_t)(1 << (l & 7));
+}
+
+/* Parses [...] at pattern, returns the length or 0 when it is no class */
+static size_t glob_parse_class(const char *pattern, struct glob_token *token)
+{
+	const char *p = pattern + 1;
+	memset(token, 0, sizeof(*token));
+	token->op = glob_class;
+	if (*p == '!' || *p == '^') {
+		token->negate = true;
+		p++;
+	}
+	/* a leading ] is part of the class */
+	if (*p == ']')
+		class_set(token, *p++);
+	while (*p && *p != ']') {
+		if (p[1] == '-' && p[2] && p[2] != ']') {
+			for (int c = (uint8_t)p[0]; c <= (uint8_t)p[2]; c++)
+				class_set(token, (char)c);
+			p += 3;
+		} else {
+			class_set(token, *p++);
+		}
+	}
+	if (*p != ']')
+		return 0;
+	return (size_t)(p + 1 - pattern);
+}
+
+static void glob_compile(struct pattern *pattern)
+{
+	struct dstr literal;
+	dstr_init(&literal);
+	const char *p = pattern->text;
+	while (*p) {
+		struct glob_token token = {0};
+		size_t len = *p == '[' ? glob_parse_class(p, &token) : 1;
+		if (*p == '*') {
+			token.op = glob_star;
+			/* ** is the same as * */
+			while (p[len] == '*')
+				len++;
+		} else if (*p == '?') {
+			token.op = glob_any;
+		} else if (*p != '[' || !len) {
+			/* an unterminated [ is a literal */
+			memset(&token, 0, sizeof(token));
+			len = 0;
+			while (p[len] && p[len] != '*' && p[len] != '?' &&
+			       (p[len] != '[' || !len))
+				len++;
+			dstr_ncopy(&literal, p, len);
+			for (size_t i = 0; i < literal.len; i++)
+				literal.array[i] = lower(literal.array[i]);
+			token.op = glob_literal;
+			token.literal = bstrdup_n(literal.array, literal.len);
+			token.len = literal.len;
+		}
+		da_push_back(pattern->glob, &token);
+		p += len;
+	}
+	dstr_free(&literal);
+}
+
+/* Returns the number of characters the token matches at name, 0 for none */
+static size_t glob_token_match(const struct glob_token *token,
+			       const char *name, size_t left)
+{
+	switch (token->op) {
+	case glob_literal:
+		if (token->len > left)
+			return 0;
+		for (size_t i = 0; i < token->len; i++) {
+			if (lower(name[i]) != token->literal[i])
+				return 0;
+		}
+		return token->len;
+	case glob_any:
+		return left ? 1 : 0;
+	case glob_class: {
+		if (!left)
+			return 0;
+		const uint8_t l = (uint8_t)lower(*name);
+		const bool in_set = (token->set[l >> 3] & (1 << (l & 7))) != 0;
+		return in_set != token->negate ? 1 : 0;
+	}
+	case glob_star:
+		break;
+	}
+	return 0;
+}
+
+/* Backtracks to the last star only, the tokens in between have a fixed
+ * length so that is enough */
+static bool glob_match(const struct pattern *pattern, const char *name)
+{
+	const size_t count = pattern->glob.num;
+	const size_t len = strlen(name);
+	size_t t = 0;
+	size_t n = 0;
+	size_t star = DARRAY_INVALID;
+	size_t mark = 0;
+
+	while (n < len || t < count) {
+		if (t < count) {
+			const struct glob_token *token =
+				&pattern->glob.array[t];
+			if (token->op == glob_star) {
+				star = t++;
+				mark = n;
+				continue;
+			}
+			const size_t matched =
+				glob_token_match(token, name + n, len - n);
+			if (matched) {
+				t++;
+				n += matched;
+				continue;
+			}
+		}
+		if (star == DARRAY_INVALID || mark >= len)
+			return false;
+		t = star + 1;
+		n = ++mark;
+	}
+	return true;
+}
+
+/* ------------------------------------------------------------------------- */
+/* patterns */
+
+static void pattern_free(struct pattern *pattern)
+{
+	for (size_t i = 0; i < pattern->glob.num; i++)
+		bfree(pattern->glob.array[i].literal);
+	da_free(pattern->glob);
+#ifndef _WIN32
+	if (pattern->type == pattern_regex)
+		regfree(&pattern->regex);
+#endif
+	bfree(pattern->text);
+}
+
+static bool pattern_compile(struct pattern *pattern, const char *text)
+{
+	if (*text == '!') {
+		pattern->exclude = true;
+		text++;
+	}
+	if (strncmp(text, "re:", 3) == 0) {
+		pattern->type = pattern_regex;
+		pattern->text = bstrdup(text + 3);
+#ifdef _WIN32
+		blog(LOG_WARNING,
+		     "[Directory watch media] regular expressions are not supported, ignoring '%s'",
+		     pattern->text);
+		pattern->type = pattern_substring;
+		return false;
+#else
+		const int ret = regcomp(&pattern->regex, pattern->text,
+					REG_EXTENDED | REG_NOSUB);
+		if (ret != 0) {
+			char error[256];
+			regerror(ret, &pattern->regex, error, sizeof(error));
+			blog(LOG_WARNING,
+			     "[Directory watch media] invalid regular expression '%s': %s",
+			     pattern->text, error);
+			/* nothing to free */
+			pattern->type = pattern_substring;
+			return false;
+		}
+		return true;
+#endif
+	}
+	pattern->text = bstrdup(text);
+	if (strpbrk(text, "*?[")) {
+		pattern->type = pattern_glob;
+		glob_compile(pattern);
+	} else {
+		pattern->type = pattern_substring;
+	}
+	return true;
+}
+
+static bool pattern_match(const struct pattern *pattern, const char *file)
+{
+	switch (pattern->type) {
+	case pattern_substring:
+		return strstr(file, pattern->text) != NULL;
+	case pattern_glob:
+		return glob_match(pattern, file);
+	case pattern_regex:
+#ifndef _WIN32
+		return regexec(&pattern->regex, file, 0, NULL, 0) == 0;
+#else
+		break;
+#endif
+	}
+	return false;
+}
+
+static void patterns_compile(struct dir_watch_matcher *matcher,
+			     const char *filter)
+{
+	char **list = strlist_split(filter, ';', false);
+	for (char **item = list; item && *item; item++) {
+		char *text = *item;
+		while (*text == ' ' || *text == '\t')
+			text++;
+		size_t len = strlen(text);
+		while (len && (text[len - 1] == ' ' || text[len - 1] == '\t'))
+			text[--len] = 0;
+		if (!*text || strcmp(text, "!") == 0)
+			continue;
+
+		struct pattern pattern = {0};
+		if (!pattern_compile(&pattern, text)) {
+			pattern_free(&pattern);
+			continue;
+		}
+		if (!pattern.exclude)
+			matcher->include_count++;
+		da_push_back(matcher->patterns, &pattern);
+	}
+	strlist_free(list);
+}
+
+/* ------------------------------------------------------------------------- */
+
+struct dir_watch_matcher *dir_watch_matcher_create(const char *filter,
+						   const char *extensions)
+{
+	if ((!filter || !*filter) && (!extensions || !*extensions))
+		return NULL;
+
+	struct dir_watch_matcher *matcher =
+		bzalloc(sizeof(struct dir_watch_matcher));
+	matcher->refs = 1;
+	matcher->filter = filter && *filter ? bstrdup(filter) : NULL;
+	matcher->extensions = extensions && *extensions ? bstrdup(extensions)
+							 : NULL;
+	if (matcher->filter)
+		patterns_compile(matcher, matcher->filter);
+	if (matcher->extensions)
+		extensions_compile(matcher, matcher->extensions);
+	return matcher;
+}
+
+void dir_watch_matcher_addref(struct dir_watch_matcher *matcher)
+{
+	if (matcher)
+		os_atomic_inc_long(&matcher->refs);
+}
+
+void dir_watch_matcher_release(struct dir_watch_matcher *matcher)
+{
+	if (!matcher || os_atomic_dec_long(&matcher->refs) != 0)
+		return;
+	for (size_t i = 0; i < matcher->patterns.num; i++)
+		pattern_free(&matcher->patterns.array[i]);
+	da_free(matcher->patterns);
+	for (size_t i = 0; i < matcher->extension_slot_count; i++)
+		bfree(matcher->extension_slots[i]);
+	bfree(matcher->extension_slots);
+	bfree(matcher->extension_hashes);
+	bfree(matcher->filter);
+	bfree(matcher->extensions);
+	bfree(matcher);
+}
+
+static bool string_equal(const char *a, const char *b)
+{
+	if (!a || !b)
+		return a == b;
+	return strcmp(a, b) == 0;
+}
+
+bool dir_watch_matcher_equal(const struct dir_watch_matcher *a,
+			     const struct dir_watch_matcher *b)
+{
+	if (!a || !b)
+		return a == b;
+	return string_equal(a->filter, b->filter) &&
+	       string_equal(a->extensions, b->extensions);
+}
+
+bool dir_watch_matcher_match(const struct dir_watch_matcher *matcher,
+			     const char *file)
+{
+	if (!matcher)
+		return true;
+	if (matcher->extension_count && !extensions_match(matcher, file))
+		return false;
+
+	bool included = !matcher->include_count;
+	for (size_t i = 0; i < matcher->patterns.num; i++) {
+		const struct pattern *pattern = &matcher->patterns.array[i];
+		if (pattern->exclude) {
+			if (pattern_match(pattern, file))
+				return false;
+		} else if (!included && pattern_match(pattern, file)) {
+			included = true;
+		}
+	}
+	return included;
+}
@@ -0,0 +1,34 @@
+#pragma once
+
+#include <stdbool.h>
+
+/* Compiled filter and extension settings.
+ *
+ * The extension setting is a list of extensions separated by commas,
+ * semicolons or spaces, compared case insensitive with or without the dot
+ * against the end of the file name, so tar.gz matches x.tar.gz. Files
+ * without an extension never match.
+ *
+ * The filter setting is a list of patterns separated by semicolons, with
+ * the spaces and tabs around each pattern trimmed. A filter used to be a
+ * single substring, so one containing ; or surrounding spaces now means
+ * something else. A pattern starting with ! excludes the files it matches,
+ * the others include them. Patterns with *, ? or [...] are globs on the
+ * whole file name, case insensitive. Patterns starting with re: are
+ * extended regular expressions (not supported on Windows). Anything else
+ * is a case sensitive substring of the file name, as before. */
+struct dir_watch_matcher;
+
+/* Returns NULL when neither setting restricts anything */
+struct dir_watch_matcher *dir_watch_matcher_create(const char *filter,
+						   const char *extensions);
+void dir_watch_matcher_addref(struct dir_watch_matcher *matcher);
+void dir_watch_matcher_release(struct dir_watch_matcher *matcher);
+
+/* True when both were compiled from the same settings */
+bool dir_watch_matcher_equal(const struct dir_watch_matcher *a,
+			     const struct dir_watch_matcher *b);
+
+/* A NULL matcher matches every file */
+bool dir_watch_matcher_match(const struct dir_watch_matcher *matcher,
+			     const char *file);
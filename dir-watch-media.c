@@ -1,6 +1,13 @@
-#include <obs-module.h>
-#include <graphics/image-file.h>
+#include "dir-watch-media.h"
+#include "dir-watch-watcher.h"
+#include "dir-watch-playlist.h"
+#include "dir-watch-deleter.h"
+#include "dir-watch-prefetch.h"
+#include "dir-watch-readahead.h"
+#include "dir-watch-fingerprint.h"
 #include <util/platform.h>
+#include <util/threading.h>
+#include <util/darray.h>
 #include <util/dstr.h>
 #include <sys/stat.h>
 #include "version.h"
@@ -13,28 +20,39 @@
 #define info(format, ...) blog(LOG_INFO, format, ##__VA_ARGS__)
 #define warn(format, ...) blog(LOG_WARNING, format, ##__VA_ARGS__)
 
-#if __linux__ || __APPLE__
-/* stracsecmp is the POSIX version of strcmpi */
-#define strcmpi strcasecmp
-#endif
-
 /* Settings */
 #define S_DWM_ID "dir_watch_media"
 #define S_DIRECTORY "dir"
+#define S_DIRECTORIES "directories"
 #define S_SORT_BY "sort_by"
 #define S_FILTER "filter"
 #define S_EXTENSION "extension"
 #define S_FFMPEG_SOURCE "ffmpeg_source"
 #define S_LOCAL_FILE "local_file"
 #define S_IS_LOCAL_FILE "is_local_file"
+#define S_RESTART_ON_ACTIVATE "restart_on_activate"
+#define S_CLOSE_WHEN_INACTIVE "close_when_inactive"
 #define S_RESTART "restart"
 #define S_VLC_SOURCE "vlc_source"
 #define S_PLAYLIST "playlist"
-#define S_VALUE "value"
 #define S_IMAGE_SOURCE "image_source"
 #define S_FILE "file"
 #define S_SORT_BY "sort_by"
 #define S_SCAN_INTERVAL "scan_interval"
+#define S_SUBDIRECTORY_DEPTH "subdirectory_depth"
+#define S_TRASH_DIRECTORY "trash_directory"
+#define S_PREFETCH_DEPTH "prefetch_depth"
+#define S_READAHEAD_SIZE "readahead_size"
+#define S_READAHEAD_BUDGET "readahead_budget"
+#define S_STATS_LOG_INTERVAL "stats_log_interval"
+#define S_INDEX_SNAPSHOT "index_snapshot"
+#define S_BURST_DELAY "burst_delay"
+#define S_GAPLESS "gapless"
+#define S_STAT_THREADS "stat_threads"
+#define S_DEDUPE "dedupe"
+#define S_PLAYLIST_MAX_ITEMS "playlist_max_items"
+#define S_PLAYLIST_MAX_AGE "playlist_max_age"
+#define S_PLAYLIST_DELETE_EVICTED "playlist_delete_evicted"
 #define S_CLEAR_HOTKEY_ID "dwm_clear"
 #define S_REMOVE_LAST_HOTKEY_ID "dwm_remove_last"
 #define S_REMOVE_FIRST_HOTKEY_ID "dwm_remove_first"
@@ -47,6 +65,8 @@
 /* Translation */
 #define T_(s) obs_module_text(s)
 #define T_DIRECTORY T_("Directory")
+#define T_DIRECTORIES T_("DWM.Directories")
+#define T_DIRECTORIES_DESCRIPTION T_("DWM.Directories.Description")
 #define T_DWM_DESCRIPTION T_("DWM.Description")
 #define T_NAME T_("DWM.Name")
 #define T_CLEAR_HOTKEY_NAME T_("DWM.Clear")
@@ -66,31 +86,124 @@
 #define T_RANDOM T_("DWM.Random")
 #define T_EXTENSION T_("DWM.Extension")
 #define T_FILTER T_("DWM.Filter")
+#define T_EXTENSION_DESCRIPTION T_("DWM.Extension.Description")
+#define T_FILTER_DESCRIPTION T_("DWM.Filter.Description")
 #define T_SCAN_INTERVAL T_("DWM.Interval")
+#define T_SUBDIRECTORY_DEPTH T_("DWM.SubdirectoryDepth")
+#define T_TRASH_DIRECTORY T_("DWM.TrashDirectory")
+#define T_TRASH_DIRECTORY_DESCRIPTION T_("DWM.TrashDirectory.Description")
+#define T_PREFETCH_DEPTH T_("DWM.PrefetchDepth")
+#define T_PREFETCH_DEPTH_DESCRIPTION T_("DWM.PrefetchDepth.Description")
+#define T_READAHEAD_SIZE T_("DWM.ReadaheadSize")
+#define T_READAHEAD_SIZE_DESCRIPTION T_("DWM.ReadaheadSize.Description")
+#define T_READAHEAD_BUDGET T_("DWM.ReadaheadBudget")
+#define T_READAHEAD_BUDGET_DESCRIPTION T_("DWM.ReadaheadBudget.Description")
+#define T_BURST_DELAY T_("DWM.BurstDelay")
+#define T_BURST_DELAY_DESCRIPTION T_("DWM.BurstDelay.Description")
+#define T_PLAYLIST_MAX_ITEMS T_("DWM.PlaylistMaxItems")
+#define T_PLAYLIST_MAX_ITEMS_DESCRIPTION T_("DWM.PlaylistMaxItems.Description")
+#define T_PLAYLIST_MAX_AGE T_("DWM.PlaylistMaxAge")
+#define T_PLAYLIST_MAX_AGE_DESCRIPTION T_("DWM.PlaylistMaxAge.Description")
+#define T_PLAYLIST_DELETE_EVICTED T_("DWM.PlaylistDeleteEvicted")
+#define T_STAT_THREADS T_("DWM.StatThreads")
+#define T_STAT_THREADS_DESCRIPTION T_("DWM.StatThreads.Description")
+#define T_DEDUPE T_("DWM.Dedupe")
+#define T_DEDUPE_DESCRIPTION T_("DWM.Dedupe.Description")
+#define T_GAPLESS T_("DWM.Gapless")
+#define T_GAPLESS_DESCRIPTION T_("DWM.Gapless.Description")
+#define T_INDEX_SNAPSHOT T_("DWM.IndexSnapshot")
+#define T_INDEX_SNAPSHOT_DESCRIPTION T_("DWM.IndexSnapshot.Description")
+#define T_STATS_LOG_INTERVAL T_("DWM.StatsLogInterval")
+#define T_STATS_LOG_INTERVAL_DESCRIPTION \
+	T_("DWM.StatsLogInterval.Description")
+
+/* a burst that keeps going is handed over after this many delays */
+#define BURST_MAX_DELAYS 4
+
+/* a file the preroll source cannot show by then is switched to directly,
+ * the parent is shown again a little after it reopened */
+#define PREROLL_TIMEOUT_NS 3000000000ULL
+#define PREROLL_GRACE_NS 100000000ULL
 
-enum sort_by {
-	created_newest,
-	created_oldest,
-	modified_newest,
-	modified_oldest,
-	alphabetically_first,
-	alphabetically_last,
-	sort_random,
+/* files returned by list when no limit is given, and at most */
+#define LIST_LIMIT_DEFAULT 100
+#define LIST_LIMIT_MAX 1000
+
+/* Work done on the parent, times in nanoseconds */
+struct dir_watch_media_stats {
+	uint64_t updates;
+	uint64_t restarts;
+	/* new files shown and the time from detection until then */
+	uint64_t swaps;
+	uint64_t latency_last;
+	uint64_t latency_max;
+	uint64_t latency_total;
+};
+
+/* A new file waiting for its fingerprint */
+struct dir_watch_media_waiting {
+	char *path;
+	uint64_t detected;
 };
 
 struct dir_watch_media_source {
 	obs_source_t *source;
 	char *directory;
 	char *file;
-	char *filter;
-	char *extension;
-	char *delete_file;
+	struct dir_watch_matcher *matcher;
+	struct dir_watch_deleter *deleter;
+	struct dir_watch_prefetch *prefetch;
+	struct dir_watch_readahead *readahead;
+	struct dir_watch_fingerprint *fingerprint;
 	enum sort_by sort_by;
-	time_t time;
 	bool hotkeys_added;
 	long long scan_interval;
-	float duration;
 	bool enabled;
+	long long burst_delay;
+	struct dir_watch_subscription *subscription;
+	/* skip files whose content was played already, new files wait for
+	 * their fingerprint in selection order. Video thread only. */
+	bool dedupe;
+	DARRAY(struct dir_watch_media_waiting) waiting;
+
+	/* guards playlist and pending, hotkeys run on their own thread */
+	pthread_mutex_t playlist_mutex;
+	struct dir_watch_playlist playlist;
+	/* files to hand to the parent on the next tick */
+	DARRAY(char *) pending;
+	uint64_t pending_detected;
+	uint64_t pending_first;
+	uint64_t pending_last;
+	/* handed over without waiting for the burst to end */
+	bool pending_now;
+	/* the last queued file waited a tick for its read ahead */
+	bool readahead_waited;
+	/* retention of the vlc_source playlist, 0 keeps everything */
+	size_t playlist_max_items;
+	uint64_t playlist_max_age;
+	bool playlist_delete_evicted;
+
+	/* gapless switching of an ffmpeg_source, the next file is opened in a
+	 * hidden source that is rendered instead of the parent from its
+	 * first frame until the parent reopened. Video thread only. */
+	bool gapless;
+	obs_source_t *preroll;
+	char *preroll_file;
+	uint64_t preroll_detected;
+	uint64_t preroll_time;
+	bool preroll_shown;
+	obs_source_t *preroll_parent;
+	/* set by media_started of the parent */
+	volatile bool preroll_started;
+	uint64_t preroll_started_time;
+
+	/* read by get_stats from any thread */
+	pthread_mutex_t stats_mutex;
+	struct dir_watch_media_stats stats;
+	/* the file shown last */
+	char *selected;
+	long long stats_log_interval;
+	float stats_log_elapsed;
 };
 
 static const char *dir_watch_media_source_get_name(void *unused)
@@ -110,37 +223,157 @@ static void dir_watch_media_source_update(void *data, obs_data_t *settings)
 		context->directory = bstrdup(dir);
 	}
 	const enum sort_by sort_by = obs_data_get_int(settings, S_SORT_BY);
-	if (sort_by != context->sort_by) {
-		context->sort_by = sort_by;
-		context->time = 0;
-	}
+	context->sort_by = sort_by;
 
+	/* compiled once here instead of parsed for every file */
 	const char *filter = obs_data_get_string(settings, S_FILTER);
-	if (!context->filter || strcmp(filter, context->filter) != 0) {
-		if (context->filter) {
-			bfree(context->filter);
-			context->filter = NULL;
-			context->time = 0;
-		}
-		if (strlen(filter) > 0) {
-			context->filter = bstrdup(filter);
-			context->time = 0;
-		}
-	}
-
 	const char *extension = obs_data_get_string(settings, S_EXTENSION);
-	if (!context->extension || strcmp(extension, context->extension) != 0) {
-		if (context->extension) {
-			bfree(context->extension);
-			context->extension = NULL;
-			context->time = 0;
-		}
-		if (strlen(extension) > 0) {
-			context->extension = bstrdup(extension);
-			context->time = 0;
-		}
+	struct dir_watch_matcher *matcher =
+		dir_watch_matcher_create(filter, extension);
+	if (dir_watch_matcher_equal(matcher, context->matcher)) {
+		dir_watch_matcher_release(matcher);
+	} else {
+		dir_watch_matcher_release(context->matcher);
+		context->matcher = matcher;
 	}
+
 	context->scan_interval = obs_data_get_int(settings, S_SCAN_INTERVAL);
+	context->burst_delay = obs_data_get_int(settings, S_BURST_DELAY);
+	context->gapless = obs_data_get_bool(settings, S_GAPLESS);
+	context->dedupe = obs_data_get_bool(settings, S_DEDUPE);
+	const int depth = (int)obs_data_get_int(settings, S_SUBDIRECTORY_DEPTH);
+
+	/* the directory on top and the extra ones are watched together */
+	DARRAY(const char *) directories;
+	da_init(directories);
+	if (*dir)
+		da_push_back(directories, &dir);
+	obs_data_array_t *extra = obs_data_get_array(settings, S_DIRECTORIES);
+	const size_t extra_count = obs_data_array_count(extra);
+	for (size_t i = 0; i < extra_count; i++) {
+		obs_data_t *item = obs_data_array_item(extra, i);
+		const char *path = bstrdup(obs_data_get_string(item, "value"));
+		obs_data_release(item);
+		da_push_back(directories, &path);
+	}
+	obs_data_array_release(extra);
+	dir_watch_subscription_update(
+		context->subscription, directories.array, directories.num,
+		context->matcher, sort_by, context->scan_interval, depth,
+		obs_data_get_bool(settings, S_INDEX_SNAPSHOT),
+		(int)obs_data_get_int(settings, S_STAT_THREADS));
+	for (size_t i = *dir ? 1 : 0; i < directories.num; i++)
+		bfree((char *)directories.array[i]);
+	da_free(directories);
+	dir_watch_deleter_set_trash(
+		context->deleter,
+		obs_data_get_string(settings, S_TRASH_DIRECTORY));
+	dir_watch_prefetch_set_depth(
+		context->prefetch,
+		(size_t)obs_data_get_int(settings, S_PREFETCH_DEPTH));
+	dir_watch_readahead_set_size(
+		context->readahead,
+		(uint64_t)obs_data_get_int(settings, S_READAHEAD_SIZE) << 20,
+		(uint64_t)obs_data_get_int(settings, S_READAHEAD_BUDGET) << 20);
+	context->stats_log_interval =
+		obs_data_get_int(settings, S_STATS_LOG_INTERVAL);
+
+	pthread_mutex_lock(&context->playlist_mutex);
+	context->playlist_max_items =
+		(size_t)obs_data_get_int(settings, S_PLAYLIST_MAX_ITEMS);
+	context->playlist_max_age =
+		(uint64_t)obs_data_get_int(settings, S_PLAYLIST_MAX_AGE) *
+		60000000000ULL;
+	context->playlist_delete_evicted =
+		obs_data_get_bool(settings, S_PLAYLIST_DELETE_EVICTED);
+	pthread_mutex_unlock(&context->playlist_mutex);
+}
+
+static void dir_watch_media_update_parent(
+	struct dir_watch_media_source *context, obs_source_t *parent,
+	obs_data_t *settings)
+{
+	obs_source_update(parent, settings);
+	pthread_mutex_lock(&context->stats_mutex);
+	context->stats.updates++;
+	pthread_mutex_unlock(&context->stats_mutex);
+}
+
+static void dir_watch_media_restart_parent(
+	struct dir_watch_media_source *context, obs_source_t *parent)
+{
+	proc_handler_t *ph = obs_source_get_proc_handler(parent);
+	if (!ph)
+		return;
+	calldata_t cd = {0};
+	proc_handler_call(ph, S_RESTART, &cd);
+	calldata_free(&cd);
+	pthread_mutex_lock(&context->stats_mutex);
+	context->stats.restarts++;
+	pthread_mutex_unlock(&context->stats_mutex);
+}
+
+/* Counts a new file shown by the parent and signals it, detected is when
+ * the change was first seen */
+static void dir_watch_media_selected(struct dir_watch_media_source *context,
+				     const char *path, uint64_t detected)
+{
+	const uint64_t now = os_gettime_ns();
+	const uint64_t latency = detected && now > detected ? now - detected
+							    : 0;
+	pthread_mutex_lock(&context->stats_mutex);
+	context->stats.swaps++;
+	context->stats.latency_last = latency;
+	context->stats.latency_total += latency;
+	if (latency > context->stats.latency_max)
+		context->stats.latency_max = latency;
+	bfree(context->selected);
+	context->selected = bstrdup(path);
+	pthread_mutex_unlock(&context->stats_mutex);
+
+	calldata_t cd = {0};
+	calldata_set_ptr(&cd, "source", context->source);
+	calldata_set_string(&cd, "path", path);
+	calldata_set_float(&cd, "latency_ms", (double)latency / 1000000.0);
+	signal_handler_signal(obs_source_get_signal_handler(context->source),
+			      "file_selected", &cd);
+	calldata_free(&cd);
+}
+
+/* Queues a file for the parent, call with the playlist mutex held */
+static void dir_watch_media_queue(struct dir_watch_media_source *context,
+				  char *file, uint64_t detected, bool now)
+{
+	const uint64_t time = os_gettime_ns();
+	if (!context->pending.num)
+		context->pending_first = time;
+	context->pending_last = time;
+	context->pending_detected = detected;
+	context->pending_now = context->pending_now || now;
+	da_push_back(context->pending, &file);
+}
+
+/* Returns true when the queued files can go to the parent, files arriving
+ * in a burst wait until it is over so the parent switches once. Call with
+ * the playlist mutex held. */
+static bool dir_watch_media_settled(struct dir_watch_media_source *context)
+{
+	if (context->burst_delay <= 0 || context->pending_now)
+		return true;
+	const uint64_t now = os_gettime_ns();
+	const uint64_t delay = (uint64_t)context->burst_delay * 1000000;
+	return now - context->pending_last >= delay ||
+	       now - context->pending_first >= delay * BURST_MAX_DELAYS;
+}
+
+static obs_data_array_t *dir_watch_media_get_playlist(obs_data_t *settings)
+{
+	obs_data_array_t *array = obs_data_get_array(settings, S_PLAYLIST);
+	if (!array) {
+		array = obs_data_array_create();
+		obs_data_set_array(settings, S_PLAYLIST, array);
+	}
+	return array;
 }
 
 static void dir_watch_media_clear(void *data, obs_hotkey_id hotkey_id,
@@ -156,35 +389,28 @@ static void dir_watch_media_clear(void *data, obs_hotkey_id hotkey_id,
 		return;
 	}
 
+	/* cleared files may be shown again */
+	dir_watch_fingerprint_reset(context->fingerprint);
 	obs_data_t *settings = obs_source_get_settings(parent);
 	const char *id = obs_source_get_unversioned_id(parent);
 	if (strcmp(id, S_FFMPEG_SOURCE) == 0) {
 		obs_data_set_string(settings, S_LOCAL_FILE, "");
 		obs_data_set_bool(settings, S_IS_LOCAL_FILE, true);
-		obs_source_update(parent, settings);
-		proc_handler_t *ph = obs_source_get_proc_handler(parent);
-		if (ph) {
-			calldata_t cd = {0};
-			proc_handler_call(ph, S_RESTART, &cd);
-			calldata_free(&cd);
-		}
+		dir_watch_media_update_parent(context, parent, settings);
+		dir_watch_media_restart_parent(context, parent);
 	} else if (strcmp(id, S_VLC_SOURCE) == 0) {
 		obs_data_array_t *array =
-			obs_data_get_array(settings, S_PLAYLIST);
-		if (!array) {
-			array = obs_data_array_create();
-			obs_data_set_array(settings, S_PLAYLIST, array);
-		}
-		size_t count = obs_data_array_count(array);
-		for (size_t i = 0; i < count; i++) {
-			obs_data_array_erase(array, 0);
-		}
-		obs_source_update(parent, settings);
+			dir_watch_media_get_playlist(settings);
+		pthread_mutex_lock(&context->playlist_mutex);
+		dir_watch_playlist_sync(&context->playlist, array);
+		dir_watch_playlist_clear(&context->playlist);
+		pthread_mutex_unlock(&context->playlist_mutex);
+		dir_watch_media_update_parent(context, parent, settings);
 		obs_data_array_release(array);
 	} else if (strcmp(id, S_IMAGE_SOURCE) == 0 ||
 		   strcmp(id, S_ASYNC_IMAGE_SOURCE) == 0) {
 		obs_data_set_string(settings, S_FILE, "");
-		obs_source_update(parent, settings);
+		dir_watch_media_update_parent(context, parent, settings);
 	}
 	obs_data_release(settings);
 	UNUSED_PARAMETER(hotkey);
@@ -206,94 +432,16 @@ static void dir_watch_media_random(void *data, obs_hotkey_id hotkey_id,
 		return;
 	}
 
-	if (!context->directory)
+	/* drawn from the watcher's listing, the disk is not touched here */
+	char *selected_path =
+		dir_watch_subscription_random(context->subscription);
+	if (!selected_path)
 		return;
 
-	os_dir_t *dir = os_opendir(context->directory);
-	if (!dir)
-		return;
-
-	struct dstr selected_path;
-	dstr_init(&selected_path);
-
-	long long count = 0;
-	struct os_dirent *ent = os_readdir(dir);
-	while (ent) {
-		if (ent->directory) {
-			ent = os_readdir(dir);
-			continue;
-		}
-		if (context->filter &&
-		    strstr(ent->d_name, context->filter) == NULL) {
-			ent = os_readdir(dir);
-			continue;
-		}
-		const char *extension = os_get_path_extension(ent->d_name);
-		if (context->extension && extension &&
-		    astrcmpi(context->extension, extension) != 0 &&
-		    astrcmpi(context->extension, extension + 1)) {
-			ent = os_readdir(dir);
-			continue;
-		}
-		count++;
-		const int r = rand();
-		if (count <= 1 || r % count == 0) {
-			dstr_copy(&selected_path, context->directory);
-			dstr_cat_ch(&selected_path, '/');
-			dstr_cat(&selected_path, ent->d_name);
-		}
-		ent = os_readdir(dir);
-	}
-	if (!count) {
-		dstr_free(&selected_path);
-		return;
-	}
-
-	obs_data_t *settings = obs_source_get_settings(parent);
-	const char *id = obs_source_get_unversioned_id(parent);
-	if (strcmp(id, S_FFMPEG_SOURCE) == 0) {
-		obs_data_set_string(settings, S_LOCAL_FILE,
-				    selected_path.array);
-		obs_data_set_bool(settings, S_IS_LOCAL_FILE, true);
-		obs_source_update(parent, settings);
-		proc_handler_t *ph = obs_source_get_proc_handler(parent);
-		if (ph) {
-			calldata_t cd = {0};
-			proc_handler_call(ph, S_RESTART, &cd);
-			calldata_free(&cd);
-		}
-	} else if (strcmp(id, S_VLC_SOURCE) == 0) {
-		obs_data_array_t *array =
-			obs_data_get_array(settings, S_PLAYLIST);
-		if (!array) {
-			array = obs_data_array_create();
-			obs_data_set_array(settings, S_PLAYLIST, array);
-		}
-		bool twice = false;
-		const size_t count = obs_data_array_count(array);
-		for (size_t i = 0; i < count; i++) {
-			obs_data_t *item = obs_data_array_item(array, i);
-			if (strcmpi(obs_data_get_string(item, S_VALUE),
-				    selected_path.array) == 0) {
-				twice = true;
-			}
-			obs_data_release(item);
-		}
-		if (!twice) {
-			obs_data_t *item = obs_data_create();
-			obs_data_set_string(item, S_VALUE, selected_path.array);
-			obs_data_array_push_back(array, item);
-			obs_data_release(item);
-			obs_source_update(parent, settings);
-		}
-		obs_data_array_release(array);
-	} else if (strcmp(id, S_IMAGE_SOURCE) == 0 ||
-		   strcmp(id, S_ASYNC_IMAGE_SOURCE) == 0) {
-		obs_data_set_string(settings, S_FILE, selected_path.array);
-		obs_source_update(parent, settings);
-	}
-	obs_data_release(settings);
-	dstr_free(&selected_path);
+	/* handed to the parent on the next tick */
+	pthread_mutex_lock(&context->playlist_mutex);
+	dir_watch_media_queue(context, selected_path, os_gettime_ns(), true);
+	pthread_mutex_unlock(&context->playlist_mutex);
 }
 
 static void dir_watch_media_refresh(void *data, obs_hotkey_id hotkey_id,
@@ -309,7 +457,7 @@ static void dir_watch_media_refresh(void *data, obs_hotkey_id hotkey_id,
 		return;
 	}
 
-	obs_source_update(parent, NULL);
+	dir_watch_media_update_parent(context, parent, NULL);
 	UNUSED_PARAMETER(hotkey);
 	UNUSED_PARAMETER(hotkey_id);
 }
@@ -328,27 +476,22 @@ static void dir_watch_media_remove(void *data, bool first, bool delete)
 		return;
 	}
 	obs_data_t *settings = obs_source_get_settings(parent);
-	obs_data_array_t *array = obs_data_get_array(settings, S_PLAYLIST);
-	if (!array) {
-		array = obs_data_array_create();
-		obs_data_set_array(settings, S_PLAYLIST, array);
-	}
-	const size_t count = obs_data_array_count(array);
+	obs_data_array_t *array = dir_watch_media_get_playlist(settings);
+	pthread_mutex_lock(&context->playlist_mutex);
+	dir_watch_playlist_sync(&context->playlist, array);
+	const size_t count = context->playlist.count;
 	if (count > 0) {
 		size_t index = first ? 0 : count - 1;
-		if (delete) {
-			obs_data_t *item = obs_data_array_item(array, index);
-			const char *filepath =
-				obs_data_get_string(item, S_VALUE);
-			if (filepath && os_file_exists(filepath)) {
-				if (context->delete_file)
-					bfree(context->delete_file);
-				context->delete_file = bstrdup(filepath);
-			}
-		}
-		obs_data_array_erase(array, index);
+		char *filepath =
+			dir_watch_playlist_erase(&context->playlist, index);
+		/* retried in the background while the parent still has
+		 * the file open */
+		if (delete && filepath && os_file_exists(filepath))
+			dir_watch_deleter_queue(context->deleter, filepath);
+		bfree(filepath);
 	}
-	obs_source_update(parent, settings);
+	pthread_mutex_unlock(&context->playlist_mutex);
+	dir_watch_media_update_parent(context, parent, settings);
 	obs_data_array_release(array);
 	obs_data_release(settings);
 }
@@ -397,6 +540,263 @@ static void dir_watch_media_source_defaults(obs_data_t *settings)
 {
 	obs_data_set_default_int(settings, S_SORT_BY, modified_newest);
 	obs_data_set_default_int(settings, S_SCAN_INTERVAL, 1000);
+	obs_data_set_default_int(settings, S_PREFETCH_DEPTH, 2);
+	obs_data_set_default_int(settings, S_READAHEAD_SIZE, 8);
+	obs_data_set_default_int(settings, S_READAHEAD_BUDGET, 64);
+	obs_data_set_default_int(settings, S_STATS_LOG_INTERVAL, 0);
+	obs_data_set_default_int(settings, S_BURST_DELAY, 0);
+	obs_data_set_default_int(settings, S_STAT_THREADS, 1);
+	obs_data_set_default_int(settings, S_PLAYLIST_MAX_ITEMS, 0);
+	obs_data_set_default_int(settings, S_PLAYLIST_MAX_AGE, 0);
+}
+
+static void dir_watch_media_get_stats(void *data, calldata_t *cd)
+{
+	struct dir_watch_media_source *context = data;
+	struct dir_watch_scan_stats scan;
+	dir_watch_subscription_get_stats(context->subscription, &scan);
+	pthread_mutex_lock(&context->stats_mutex);
+	const struct dir_watch_media_stats stats = context->stats;
+	pthread_mutex_unlock(&context->stats_mutex);
+
+	const double scan_avg =
+		scan.scans ? (double)scan.scan_time_total / (double)scan.scans
+			   : 0.0;
+	const double latency_avg =
+		stats.swaps ? (double)stats.latency_total / (double)stats.swaps
+			    : 0.0;
+	obs_data_t *json = obs_data_create();
+	obs_data_set_int(json, "scans", (long long)scan.scans);
+	obs_data_set_double(json, "scan_ms_avg", scan_avg / 1000000.0);
+	obs_data_set_double(json, "scan_ms_max",
+			    (double)scan.scan_time_max / 1000000.0);
+	obs_data_array_t *histogram = obs_data_array_create();
+	for (size_t i = 0; i < DIR_WATCH_SCAN_BUCKETS; i++) {
+		obs_data_t *bucket = obs_data_create();
+		/* the last bucket has no upper bound */
+		if (i < DIR_WATCH_SCAN_BUCKETS - 1)
+			obs_data_set_int(bucket, "below_ms", 1LL << i);
+		obs_data_set_int(bucket, "count",
+				 (long long)scan.histogram[i]);
+		obs_data_array_push_back(histogram, bucket);
+		obs_data_release(bucket);
+	}
+	obs_data_set_array(json, "scan_histogram", histogram);
+	obs_data_array_release(histogram);
+	obs_data_set_int(json, "entries", (long long)scan.entries);
+	obs_data_set_int(json, "stat_calls", (long long)scan.stat_calls);
+	obs_data_set_int(json, "open_calls", (long long)scan.open_calls);
+	obs_data_set_int(json, "swaps", (long long)stats.swaps);
+	obs_data_set_double(json, "swap_latency_ms",
+			    (double)stats.latency_last / 1000000.0);
+	obs_data_set_double(json, "swap_latency_ms_avg",
+			    latency_avg / 1000000.0);
+	obs_data_set_double(json, "swap_latency_ms_max",
+			    (double)stats.latency_max / 1000000.0);
+	obs_data_set_int(json, "parent_updates", (long long)stats.updates);
+	obs_data_set_int(json, "parent_restarts", (long long)stats.restarts);
+
+	calldata_set_int(cd, "scans", (long long)scan.scans);
+	calldata_set_float(cd, "scan_ms_avg", scan_avg / 1000000.0);
+	calldata_set_float(cd, "scan_ms_max",
+			   (double)scan.scan_time_max / 1000000.0);
+	calldata_set_int(cd, "entries", (long long)scan.entries);
+	calldata_set_int(cd, "stat_calls", (long long)scan.stat_calls);
+	calldata_set_int(cd, "open_calls", (long long)scan.open_calls);
+	calldata_set_int(cd, "swaps", (long long)stats.swaps);
+	calldata_set_float(cd, "swap_latency_ms",
+			   (double)stats.latency_last / 1000000.0);
+	calldata_set_int(cd, "parent_updates", (long long)stats.updates);
+	calldata_set_int(cd, "parent_restarts", (long long)stats.restarts);
+	calldata_set_string(cd, "json", obs_data_get_json(json));
+	obs_data_release(json);
+}
+
+static void dir_watch_media_log_stats(struct dir_watch_media_source *ss)
+{
+	struct dir_watch_scan_stats scan;
+	dir_watch_subscription_get_stats(ss->subscription, &scan);
+	pthread_mutex_lock(&ss->stats_mutex);
+	const struct dir_watch_media_stats stats = ss->stats;
+	pthread_mutex_unlock(&ss->stats_mutex);
+
+	const double scan_avg =
+		scan.scans ? (double)scan.scan_time_total / (double)scan.scans
+			   : 0.0;
+	do_log(LOG_INFO,
+	       "%llu scans (avg %.2f ms, max %.2f ms), %llu entries read, "
+	       "%llu stat and %llu open calls, %llu files shown (last %.1f ms "
+	       "after the change, max %.1f ms), %llu parent updates and "
+	       "%llu restarts",
+	       (unsigned long long)scan.scans, scan_avg / 1000000.0,
+	       (double)scan.scan_time_max / 1000000.0,
+	       (unsigned long long)scan.entries,
+	       (unsigned long long)scan.stat_calls,
+	       (unsigned long long)scan.open_calls,
+	       (unsigned long long)stats.swaps,
+	       (double)stats.latency_last / 1000000.0,
+	       (double)stats.latency_max / 1000000.0,
+	       (unsigned long long)stats.updates,
+	       (unsigned long long)stats.restarts);
+}
+
+static void dir_watch_media_list(void *data, calldata_t *cd)
+{
+	struct dir_watch_media_source *context = data;
+	const long long offset = calldata_int(cd, "offset");
+	long long limit = calldata_int(cd, "limit");
+	if (limit <= 0)
+		limit = LIST_LIMIT_DEFAULT;
+	else if (limit > LIST_LIMIT_MAX)
+		limit = LIST_LIMIT_MAX;
+
+	struct dir_watch_file *files;
+	size_t total;
+	const size_t count = dir_watch_subscription_list(
+		context->subscription, offset > 0 ? (size_t)offset : 0,
+		(size_t)limit, &files, &total);
+	obs_data_t *json = obs_data_create();
+	obs_data_set_int(json, "count", (long long)total);
+	obs_data_set_int(json, "offset", offset > 0 ? offset : 0);
+	obs_data_array_t *array = obs_data_array_create();
+	for (size_t i = 0; i < count; i++) {
+		obs_data_t *file = obs_data_create();
+		obs_data_set_string(file, "path", files[i].path);
+		if (files[i].size >= 0) {
+			obs_data_set_int(file, "size", files[i].size);
+			obs_data_set_int(file, "created",
+					 (long long)files[i].created);
+			obs_data_set_int(file, "modified",
+					 (long long)files[i].modified);
+		}
+		obs_data_array_push_back(array, file);
+		obs_data_release(file);
+	}
+	obs_data_set_array(json, "files", array);
+	obs_data_array_release(array);
+	dir_watch_files_free(files, count);
+
+	calldata_set_int(cd, "count", (long long)total);
+	calldata_set_string(cd, "json", obs_data_get_json(json));
+	obs_data_release(json);
+}
+
+static void dir_watch_media_count(void *data, calldata_t *cd)
+{
+	struct dir_watch_media_source *context = data;
+	calldata_set_int(
+		cd, "count",
+		(long long)dir_watch_subscription_count(context->subscription));
+}
+
+static void dir_watch_media_get_selected(void *data, calldata_t *cd)
+{
+	struct dir_watch_media_source *context = data;
+	pthread_mutex_lock(&context->stats_mutex);
+	char *path = bstrdup(context->selected);
+	pthread_mutex_unlock(&context->stats_mutex);
+	size_t position;
+	const bool found = dir_watch_subscription_find(context->subscription,
+						       path, &position);
+	calldata_set_string(cd, "path", path ? path : "");
+	calldata_set_int(cd, "index", found ? (long long)position : -1);
+	bfree(path);
+}
+
+/* Hands a file of the listing to the parent on the next tick */
+static void dir_watch_media_select(struct dir_watch_media_source *context,
+				   char *path)
+{
+	pthread_mutex_lock(&context->playlist_mutex);
+	dir_watch_media_queue(context, path, os_gettime_ns(), true);
+	pthread_mutex_unlock(&context->playlist_mutex);
+}
+
+static void dir_watch_media_select_index(void *data, calldata_t *cd)
+{
+	struct dir_watch_media_source *context = data;
+	const long long index = calldata_int(cd, "index");
+	struct dir_watch_file *files = NULL;
+	size_t total;
+	const size_t count =
+		index >= 0 ? dir_watch_subscription_list(context->subscription,
+							 (size_t)index, 1,
+							 &files, &total)
+			   : 0;
+	calldata_set_bool(cd, "success", count > 0);
+	calldata_set_string(cd, "path", count ? files[0].path : "");
+	if (count) {
+		dir_watch_media_select(context, files[0].path);
+		files[0].path = NULL;
+	}
+	dir_watch_files_free(files, count);
+}
+
+static void dir_watch_media_select_path(void *data, calldata_t *cd)
+{
+	struct dir_watch_media_source *context = data;
+	const char *path = calldata_string(cd, "path");
+	size_t position;
+	const bool found = dir_watch_subscription_find(context->subscription,
+						       path, &position);
+	calldata_set_bool(cd, "success", found);
+	calldata_set_int(cd, "index", found ? (long long)position : -1);
+	if (found)
+		dir_watch_media_select(context, bstrdup(path));
+}
+
+/* Signals the files that joined or left the listing since the last tick */
+static void
+dir_watch_media_signal_changes(struct dir_watch_media_source *context)
+{
+	bool reset;
+	struct dir_watch_change *changes;
+	const size_t count = dir_watch_subscription_take_changes(
+		context->subscription, &changes, &reset);
+	if (!count && !reset)
+		return;
+
+	obs_data_t *json = obs_data_create();
+	obs_data_set_bool(json, "reset", reset);
+	obs_data_array_t *array = obs_data_array_create();
+	for (size_t i = 0; i < count; i++) {
+		obs_data_t *change = obs_data_create();
+		obs_data_set_string(change, "path", changes[i].path);
+		obs_data_set_bool(change, "added", changes[i].added);
+		obs_data_array_push_back(array, change);
+		obs_data_release(change);
+	}
+	obs_data_set_array(json, "changes", array);
+	obs_data_array_release(array);
+	dir_watch_changes_free(changes, count);
+
+	calldata_t cd = {0};
+	calldata_set_ptr(&cd, "source", context->source);
+	calldata_set_bool(&cd, "reset", reset);
+	calldata_set_string(&cd, "json", obs_data_get_json(json));
+	signal_handler_signal(obs_source_get_signal_handler(context->source),
+			      "index_changed", &cd);
+	calldata_free(&cd);
+	obs_data_release(json);
+}
+
+/* Called on the deleter thread */
+static void dir_watch_media_deleted(void *data, const char *path,
+				    bool success)
+{
+	struct dir_watch_media_source *ss = data;
+	if (success)
+		do_log(LOG_INFO, "deleted '%s'", path);
+	else
+		do_log(LOG_WARNING, "failed to delete '%s'", path);
+
+	calldata_t cd = {0};
+	calldata_set_ptr(&cd, "source", ss->source);
+	calldata_set_string(&cd, "path", path);
+	calldata_set_bool(&cd, "success", success);
+	signal_handler_signal(obs_source_get_signal_handler(ss->source),
+			      "file_deleted", &cd);
+	calldata_free(&cd);
 }
 
 static void *dir_watch_media_source_create(obs_data_t *settings,
@@ -405,31 +805,383 @@ static void *dir_watch_media_source_create(obs_data_t *settings,
 	struct dir_watch_media_source *context =
 		bzalloc(sizeof(struct dir_watch_media_source));
 	context->source = source;
+	context->subscription = dir_watch_subscription_create();
+	context->deleter =
+		dir_watch_deleter_create(dir_watch_media_deleted, context);
+	context->prefetch = dir_watch_prefetch_create();
+	context->readahead = dir_watch_readahead_create();
+	context->fingerprint = dir_watch_fingerprint_create();
+	signal_handler_t *sh = obs_source_get_signal_handler(source);
+	signal_handler_add(
+		sh, "void file_deleted(ptr source, string path, bool success)");
+	signal_handler_add(
+		sh,
+		"void file_selected(ptr source, string path, float latency_ms)");
+	signal_handler_add(
+		sh, "void index_changed(ptr source, bool reset, string json)");
+	proc_handler_t *ph = obs_source_get_proc_handler(source);
+	proc_handler_add(
+		ph,
+		"void get_stats(out int scans, out float scan_ms_avg, "
+		"out float scan_ms_max, out int entries, out int stat_calls, "
+		"out int open_calls, out int swaps, out float swap_latency_ms, "
+		"out int parent_updates, out int parent_restarts, "
+		"out string json)",
+		dir_watch_media_get_stats, context);
+	/* answered from the listing of the watcher, the disk is not read */
+	proc_handler_add(ph,
+			 "void list(in int offset, in int limit, "
+			 "out int count, out string json)",
+			 dir_watch_media_list, context);
+	proc_handler_add(ph, "void count(out int count)",
+			 dir_watch_media_count, context);
+	proc_handler_add(ph, "void get_selected(out string path, out int index)",
+			 dir_watch_media_get_selected, context);
+	proc_handler_add(ph,
+			 "void select_index(in int index, out bool success, "
+			 "out string path)",
+			 dir_watch_media_select_index, context);
+	proc_handler_add(ph,
+			 "void select_path(in string path, out bool success, "
+			 "out int index)",
+			 dir_watch_media_select_path, context);
+	pthread_mutex_init_value(&context->playlist_mutex);
+	pthread_mutex_init(&context->playlist_mutex, NULL);
+	pthread_mutex_init_value(&context->stats_mutex);
+	pthread_mutex_init(&context->stats_mutex, NULL);
+	dir_watch_playlist_init(&context->playlist);
 
 	dir_watch_media_source_update(context, settings);
 	return context;
 }
 
+static void dir_watch_media_parent_started(void *data, calldata_t *cd)
+{
+	struct dir_watch_media_source *context = data;
+	os_atomic_set_bool(&context->preroll_started, true);
+	UNUSED_PARAMETER(cd);
+}
+
+static void
+dir_watch_media_preroll_stop(struct dir_watch_media_source *context)
+{
+	if (context->preroll_parent) {
+		signal_handler_disconnect(
+			obs_source_get_signal_handler(context->preroll_parent),
+			"media_started", dir_watch_media_parent_started,
+			context);
+		context->preroll_parent = NULL;
+	}
+	if (context->preroll) {
+		obs_source_dec_showing(context->preroll);
+		obs_source_release(context->preroll);
+		context->preroll = NULL;
+	}
+	bfree(context->preroll_file);
+	context->preroll_file = NULL;
+	context->preroll_shown = false;
+	context->preroll_started_time = 0;
+}
+
 static void dir_watch_media_source_destroy(void *data)
 {
 	struct dir_watch_media_source *context = data;
-	bfree(context->delete_file);
+	dir_watch_media_preroll_stop(context);
+	dir_watch_subscription_destroy(context->subscription);
+	for (size_t i = 0; i < context->pending.num; i++)
+		bfree(context->pending.array[i]);
+	da_free(context->pending);
+	dir_watch_playlist_free(&context->playlist);
+	pthread_mutex_destroy(&context->playlist_mutex);
+	pthread_mutex_destroy(&context->stats_mutex);
+	dir_watch_deleter_destroy(context->deleter);
+	dir_watch_prefetch_destroy(context->prefetch);
+	dir_watch_readahead_destroy(context->readahead);
+	dir_watch_fingerprint_destroy(context->fingerprint);
+	for (size_t i = 0; i < context->waiting.num; i++)
+		bfree(context->waiting.array[i].path);
+	da_free(context->waiting);
 	bfree(context->directory);
-	bfree(context->extension);
-	bfree(context->filter);
+	dir_watch_matcher_release(context->matcher);
 	bfree(context->file);
+	bfree(context->selected);
 	bfree(context);
 }
 
+/* Queues the watcher's new selection */
+static void dir_watch_media_take(struct dir_watch_media_source *context)
+{
+	if (context->enabled != obs_source_enabled(context->source)) {
+		context->enabled = !context->enabled;
+		if (!context->enabled && context->scan_interval == 0) {
+			bfree(context->file);
+			context->file = NULL;
+			return;
+		}
+		if (context->enabled && context->scan_interval == 0)
+			dir_watch_subscription_scan(context->subscription);
+	}
+
+	uint64_t detected = 0;
+	char *next = NULL;
+	char *selected = dir_watch_subscription_take(context->subscription,
+						     &detected, &next);
+	if (!selected)
+		return;
+	/* the start of the file is read while it waits to be shown, the next
+	 * file is read behind it */
+	dir_watch_readahead_request(context->readahead, selected);
+	dir_watch_readahead_request(context->readahead, next);
+	bfree(next);
+	if (context->file && strcmp(context->file, selected) == 0) {
+		bfree(selected);
+		return;
+	}
+	bfree(context->file);
+	context->file = bstrdup(selected);
+	if (context->dedupe && *selected) {
+		struct dir_watch_media_waiting waiting = {selected, detected};
+		da_push_back(context->waiting, &waiting);
+		return;
+	}
+	pthread_mutex_lock(&context->playlist_mutex);
+	dir_watch_media_queue(context, selected, detected, false);
+	pthread_mutex_unlock(&context->playlist_mutex);
+}
+
+/* Queues the new files once their fingerprint is known, files whose
+ * content was played already are dropped */
+static void dir_watch_media_dedupe(struct dir_watch_media_source *context)
+{
+	while (context->waiting.num) {
+		struct dir_watch_media_waiting waiting =
+			context->waiting.array[0];
+		uint64_t value = 0;
+		const enum dir_watch_fingerprint_state state =
+			context->dedupe ? dir_watch_fingerprint_request(
+						  context->fingerprint,
+						  waiting.path, &value)
+					: fingerprint_failed;
+		if (state == fingerprint_pending)
+			return;
+		da_erase(context->waiting, 0);
+		if (state == fingerprint_ready &&
+		    dir_watch_fingerprint_played(context->fingerprint, value)) {
+			blog(LOG_INFO,
+			     "[Directory watch media] skipped '%s', it was "
+			     "played already",
+			     waiting.path);
+			bfree(waiting.path);
+			continue;
+		}
+		pthread_mutex_lock(&context->playlist_mutex);
+		dir_watch_media_queue(context, waiting.path, waiting.detected,
+				      false);
+		pthread_mutex_unlock(&context->playlist_mutex);
+	}
+}
+
+static void dir_watch_media_switch_ffmpeg(
+	struct dir_watch_media_source *context, obs_source_t *parent,
+	obs_data_t *settings, const char *file, uint64_t detected)
+{
+	obs_data_set_string(settings, S_LOCAL_FILE, file);
+	obs_data_set_bool(settings, S_IS_LOCAL_FILE, true);
+	dir_watch_media_update_parent(context, parent, settings);
+	dir_watch_media_restart_parent(context, parent);
+	if (*file)
+		dir_watch_media_selected(context, file, detected);
+}
+
+/* Opens the file in a hidden copy of the parent, the parent is switched
+ * once it decoded the first frame */
+static void dir_watch_media_preroll_start(
+	struct dir_watch_media_source *context, obs_source_t *parent,
+	obs_data_t *settings, const char *file, uint64_t detected)
+{
+	dir_watch_media_preroll_stop(context);
+	obs_data_t *preroll_settings = obs_data_create();
+	obs_data_apply(preroll_settings, settings);
+	obs_data_set_string(preroll_settings, S_LOCAL_FILE, file);
+	obs_data_set_bool(preroll_settings, S_IS_LOCAL_FILE, true);
+	/* plays without ever being active */
+	obs_data_set_bool(preroll_settings, S_RESTART_ON_ACTIVATE, false);
+	obs_data_set_bool(preroll_settings, S_CLOSE_WHEN_INACTIVE, false);
+	context->preroll = obs_source_create_private(
+		S_FFMPEG_SOURCE, "dir-watch-media preroll", preroll_settings);
+	obs_data_release(preroll_settings);
+	if (!context->preroll) {
+		dir_watch_media_switch_ffmpeg(context, parent, settings, file,
+					      detected);
+		return;
+	}
+	obs_source_inc_showing(context->preroll);
+	context->preroll_file = bstrdup(file);
+	context->preroll_detected = detected;
+	context->preroll_time = os_gettime_ns();
+}
+
+static void dir_watch_media_preroll_tick(struct dir_watch_media_source *context,
+					 obs_source_t *parent)
+{
+	if (!context->preroll)
+		return;
+	const uint64_t now = os_gettime_ns();
+	const uint64_t elapsed = now - context->preroll_time;
+	if (!context->preroll_shown) {
+		/* an async source has a size once a frame arrived */
+		const bool ready = obs_source_get_width(context->preroll) > 0;
+		if (!ready && elapsed < PREROLL_TIMEOUT_NS)
+			return;
+		char *file = context->preroll_file;
+		context->preroll_file = NULL;
+		if (ready) {
+			/* holds the first frame while the parent reopens */
+			obs_source_media_play_pause(context->preroll, true);
+			context->preroll_shown = true;
+			context->preroll_time = now;
+			os_atomic_set_bool(&context->preroll_started, false);
+			context->preroll_parent = parent;
+			signal_handler_connect(
+				obs_source_get_signal_handler(parent),
+				"media_started", dir_watch_media_parent_started,
+				context);
+		} else {
+			dir_watch_media_preroll_stop(context);
+		}
+		obs_data_t *settings = obs_source_get_settings(parent);
+		dir_watch_media_switch_ffmpeg(context, parent, settings, file,
+					      context->preroll_detected);
+		obs_data_release(settings);
+		bfree(file);
+		return;
+	}
+	if (!context->preroll_started_time &&
+	    os_atomic_load_bool(&context->preroll_started))
+		context->preroll_started_time = now;
+	const bool reopened = context->preroll_started_time &&
+			      now - context->preroll_started_time >=
+				      PREROLL_GRACE_NS;
+	if (reopened || elapsed >= PREROLL_TIMEOUT_NS)
+		dir_watch_media_preroll_stop(context);
+}
+
+/* Hands the queued files to the parent once they settled, a playlist gets
+ * all new ones in a single update, the other sources only the last */
+static void dir_watch_media_apply(struct dir_watch_media_source *context,
+				  obs_source_t *parent)
+{
+	DARRAY(char *) files;
+	da_init(files);
+	pthread_mutex_lock(&context->playlist_mutex);
+	if (context->pending.num && dir_watch_media_settled(context)) {
+		/* the parent opens the file a tick later, after the start of
+		 * it was asked for */
+		const char *last =
+			context->pending.array[context->pending.num - 1];
+		bool wait = false;
+		if (!context->readahead_waited) {
+			dir_watch_readahead_request(context->readahead, last);
+			wait = dir_watch_readahead_pending(context->readahead,
+							   last);
+		}
+		context->readahead_waited = wait;
+		if (!wait)
+			da_move(files, context->pending);
+	}
+	const uint64_t detected = context->pending_detected;
+	if (files.num) {
+		context->pending_detected = 0;
+		context->pending_now = false;
+	}
+	pthread_mutex_unlock(&context->playlist_mutex);
+	if (!files.num)
+		return;
+
+	const char *file = files.array[files.num - 1];
+	const char *id = obs_source_get_unversioned_id(parent);
+	obs_data_t *settings = obs_source_get_settings(parent);
+	if (strcmp(id, S_FFMPEG_SOURCE) == 0) {
+		if (context->gapless && *file) {
+			dir_watch_media_preroll_start(context, parent, settings,
+						      file, detected);
+		} else {
+			dir_watch_media_preroll_stop(context);
+			dir_watch_media_switch_ffmpeg(context, parent,
+						      settings, file, detected);
+		}
+	} else if (strcmp(id, S_VLC_SOURCE) == 0) {
+		obs_data_array_t *array =
+			dir_watch_media_get_playlist(settings);
+		const char *added = NULL;
+		const uint64_t now = os_gettime_ns();
+		pthread_mutex_lock(&context->playlist_mutex);
+		dir_watch_playlist_sync(&context->playlist, array);
+		for (size_t i = 0; i < files.num; i++) {
+			if (*files.array[i] &&
+			    dir_watch_playlist_add(&context->playlist,
+						   files.array[i], now))
+				added = files.array[i];
+		}
+		/* the oldest make room, so the playlist and the cost of
+		 * updating the parent stay bounded */
+		char *evicted;
+		while (added && (evicted = dir_watch_playlist_evict(
+					 &context->playlist,
+					 context->playlist_max_items,
+					 context->playlist_max_age, now))) {
+			if (context->playlist_delete_evicted)
+				dir_watch_deleter_queue(context->deleter,
+							evicted);
+			bfree(evicted);
+		}
+		pthread_mutex_unlock(&context->playlist_mutex);
+		if (added) {
+			dir_watch_media_update_parent(context, parent,
+						      settings);
+			dir_watch_media_selected(context, added, detected);
+		}
+		obs_data_array_release(array);
+	} else if (strcmp(id, S_IMAGE_SOURCE) == 0 ||
+		   strcmp(id, S_ASYNC_IMAGE_SOURCE) == 0) {
+		if (dir_watch_prefetch_request(context->prefetch, file) ==
+		    prefetch_pending) {
+			/* swapped once read, unless a newer file is queued
+			 * by then */
+			char *waiting = bstrdup(file);
+			pthread_mutex_lock(&context->playlist_mutex);
+			if (!context->pending.num) {
+				/* the burst already ended */
+				dir_watch_media_queue(context, waiting,
+						      detected, true);
+			} else {
+				da_insert(context->pending, 0, &waiting);
+			}
+			pthread_mutex_unlock(&context->playlist_mutex);
+		} else {
+			obs_data_set_string(settings, S_FILE, file);
+			dir_watch_media_update_parent(context, parent,
+						      settings);
+			if (*file)
+				dir_watch_media_selected(context, file,
+							 detected);
+		}
+	}
+	obs_data_release(settings);
+	for (size_t i = 0; i < files.num; i++)
+		bfree(files.array[i]);
+	da_free(files);
+}
+
 static void dir_watch_media_source_tick(void *data, float seconds)
 {
 	struct dir_watch_media_source *context = data;
-	if (context->delete_file) {
-		if (os_file_exists(context->delete_file)) {
-			os_unlink(context->delete_file);
-		} else {
-			bfree(context->delete_file);
-			context->delete_file = NULL;
+	if (context->stats_log_interval > 0) {
+		context->stats_log_elapsed += seconds;
+		if (context->stats_log_elapsed >=
+		    (float)context->stats_log_interval) {
+			context->stats_log_elapsed = 0.0f;
+			dir_watch_media_log_stats(context);
 		}
 	}
 	obs_source_t *parent = obs_filter_get_parent(context->source);
@@ -471,194 +1223,12 @@ static void dir_watch_media_source_tick(void *data, float seconds)
 						   context);
 		}
 	}
-	if (!context->directory)
-		return;
-	if (context->enabled != obs_source_enabled(context->source)) {
-		context->enabled = !context->enabled;
-		if (!context->enabled && context->scan_interval == 0) {
-			bfree(context->file);
-			context->file = NULL;
-			return;
-		}
-	} else if (context->scan_interval == 0)
-		return;
-
-	context->duration += seconds;
-
-	if (context->scan_interval != 0 &&
-	    context->duration * 1000.0f < (float)context->scan_interval)
-		return;
-	context->duration = 0.0f;
-
-	os_dir_t *dir = os_opendir(context->directory);
-	if (!dir)
-		return;
-
-	struct dstr dir_path;
-	struct dstr selected_path;
-	dstr_init(&dir_path);
-	dstr_init(&selected_path);
-	time_t time = context->time;
-	char *file = NULL;
-
-	long long count = 0;
-	struct os_dirent *ent = os_readdir(dir);
-	while (ent) {
-		if (ent->directory) {
-			ent = os_readdir(dir);
-			continue;
-		}
-		if (context->filter &&
-		    strstr(ent->d_name, context->filter) == NULL) {
-			ent = os_readdir(dir);
-			continue;
-		}
-		const char *extension = os_get_path_extension(ent->d_name);
-		if (context->extension && strlen(context->extension) &&
-		    extension && astrcmpi(context->extension, extension) != 0 &&
-		    astrcmpi(context->extension, extension + 1)) {
-			ent = os_readdir(dir);
-			continue;
-		}
-		if (context->sort_by == sort_random) {
-			count++;
-			const int r = rand();
-			if (count <= 1 || r % count == 0) {
-				dstr_copy(&selected_path, context->directory);
-				dstr_cat_ch(&selected_path, '/');
-				dstr_cat(&selected_path, ent->d_name);
-			}
-			ent = os_readdir(dir);
-			continue;
-		}
-
-		dstr_copy(&dir_path, context->directory);
-		dstr_cat_ch(&dir_path, '/');
-		dstr_cat(&dir_path, ent->d_name);
-
-		if (context->sort_by == alphabetically_first) {
-			if (!file || astrcmpi(file, ent->d_name) >= 0) {
-				bfree(file);
-				file = bstrdup(ent->d_name);
-				dstr_copy_dstr(&selected_path, &dir_path);
-			}
-		} else if (context->sort_by == alphabetically_last) {
-			if (!file || astrcmpi(file, ent->d_name) <= 0) {
-				bfree(file);
-				file = bstrdup(ent->d_name);
-				dstr_copy_dstr(&selected_path, &dir_path);
-			}
-		} else {
-			struct stat stats;
-			if (os_stat(dir_path.array, &stats) == 0 &&
-			    stats.st_size > 0) {
-				if (context->sort_by == created_newest) {
-					if (time == 0 ||
-					    stats.st_ctime >= time) {
-						dstr_copy_dstr(&selected_path,
-							       &dir_path);
-						time = stats.st_ctime;
-					}
-				} else if (context->sort_by == created_oldest) {
-					if (time == 0 ||
-					    stats.st_ctime <= time) {
-						dstr_copy_dstr(&selected_path,
-							       &dir_path);
-						time = stats.st_ctime;
-					}
-				} else if (context->sort_by ==
-					   modified_newest) {
-					if (time == 0 ||
-					    stats.st_mtime >= time) {
-						dstr_copy_dstr(&selected_path,
-							       &dir_path);
-						time = stats.st_mtime;
-					}
-				} else if (context->sort_by ==
-					   modified_oldest) {
-					if (time == 0 ||
-					    stats.st_mtime <= time) {
-						dstr_copy_dstr(&selected_path,
-							       &dir_path);
-						time = stats.st_mtime;
-					}
-				}
-			}
-		}
-		ent = os_readdir(dir);
-	}
-
-	context->time = time;
-	bfree(file);
-	dstr_free(&dir_path);
-	os_closedir(dir);
-	if (!selected_path.array || !selected_path.len) {
-		if (context->file && strcmp(context->file, "") == 0) {
-			dstr_free(&selected_path);
-			return;
-		}
-		bfree(context->file);
-		context->file = bstrdup("");
-	} else {
-		if (context->file &&
-		    strcmp(context->file, selected_path.array) == 0) {
-			dstr_free(&selected_path);
-
-			return;
-		}
-		FILE *f = os_fopen(selected_path.array, "rb+");
-		if (!f) {
-			dstr_free(&selected_path);
-			return;
-		}
-		fclose(f);
-		bfree(context->file);
-		context->file = bstrdup(selected_path.array);
-	}
-	dstr_free(&selected_path);
-	const char *id = obs_source_get_unversioned_id(parent);
-	obs_data_t *settings = obs_source_get_settings(parent);
-	if (strcmp(id, S_FFMPEG_SOURCE) == 0) {
-		obs_data_set_string(settings, S_LOCAL_FILE, context->file);
-		obs_data_set_bool(settings, S_IS_LOCAL_FILE, true);
-		obs_source_update(parent, settings);
-		proc_handler_t *ph = obs_source_get_proc_handler(parent);
-		if (ph) {
-			calldata_t cd = {0};
-			proc_handler_call(ph, S_RESTART, &cd);
-			calldata_free(&cd);
-		}
-	} else if (strcmp(id, S_VLC_SOURCE) == 0 && strlen(context->file)) {
-		obs_data_array_t *array =
-			obs_data_get_array(settings, S_PLAYLIST);
-		if (!array) {
-			array = obs_data_array_create();
-			obs_data_set_array(settings, S_PLAYLIST, array);
-		}
-		bool twice = false;
-		size_t count = obs_data_array_count(array);
-		for (size_t i = 0; i < count; i++) {
-			obs_data_t *item = obs_data_array_item(array, i);
-			if (strcmpi(obs_data_get_string(item, S_VALUE),
-				    context->file) == 0) {
-				twice = true;
-			}
-			obs_data_release(item);
-		}
-		if (!twice) {
-			obs_data_t *item = obs_data_create();
-			obs_data_set_string(item, S_VALUE, context->file);
-			obs_data_array_push_back(array, item);
-			obs_data_release(item);
-			obs_source_update(parent, settings);
-		}
-		obs_data_array_release(array);
-	} else if (strcmp(id, S_IMAGE_SOURCE) == 0 ||
-		   strcmp(id, S_ASYNC_IMAGE_SOURCE) == 0) {
-		obs_data_set_string(settings, S_FILE, context->file);
-		obs_source_update(parent, settings);
-	}
-	obs_data_release(settings);
+	if (context->directory)
+		dir_watch_media_take(context);
+	dir_watch_media_signal_changes(context);
+	dir_watch_media_dedupe(context);
+	dir_watch_media_apply(context, parent);
+	dir_watch_media_preroll_tick(context, parent);
 }
 
 static obs_properties_t *dir_watch_media_source_properties(void *data)
@@ -669,10 +1239,13 @@ static obs_properties_t *dir_watch_media_source_properties(void *data)
 
 	obs_properties_add_path(props, S_DIRECTORY, T_DIRECTORY,
 				OBS_PATH_DIRECTORY, NULL, s->directory);
-	obs_property_t *prop = obs_properties_add_list(props, S_SORT_BY,
-						       T_SORT_BY,
-						       OBS_COMBO_TYPE_LIST,
-						       OBS_COMBO_FORMAT_INT);
+	obs_property_t *prop = obs_properties_add_editable_list(
+		props, S_DIRECTORIES, T_DIRECTORIES,
+		OBS_EDITABLE_LIST_TYPE_STRINGS, NULL, NULL);
+	obs_property_set_long_description(prop, T_DIRECTORIES_DESCRIPTION);
+	prop = obs_properties_add_list(props, S_SORT_BY, T_SORT_BY,
+				       OBS_COMBO_TYPE_LIST,
+				       OBS_COMBO_FORMAT_INT);
 	obs_property_list_add_int(prop, T_CREATED_NEWEST, created_newest);
 	obs_property_list_add_int(prop, T_CREATED_OLDEST, created_oldest);
 	obs_property_list_add_int(prop, T_MODIFIED_NEWEST, modified_newest);
@@ -681,12 +1254,63 @@ static obs_properties_t *dir_watch_media_source_properties(void *data)
 	obs_property_list_add_int(prop, T_ALPHA_LAST, alphabetically_last);
 	obs_property_list_add_int(prop, T_RANDOM, sort_random);
 
-	obs_properties_add_text(props, S_EXTENSION, T_EXTENSION,
-				OBS_TEXT_DEFAULT);
-	obs_properties_add_text(props, S_FILTER, T_FILTER, OBS_TEXT_DEFAULT);
+	prop = obs_properties_add_text(props, S_EXTENSION, T_EXTENSION,
+				       OBS_TEXT_DEFAULT);
+	obs_property_set_long_description(prop, T_EXTENSION_DESCRIPTION);
+	prop = obs_properties_add_text(props, S_FILTER, T_FILTER,
+				       OBS_TEXT_DEFAULT);
+	obs_property_set_long_description(prop, T_FILTER_DESCRIPTION);
 	prop = obs_properties_add_int(props, S_SCAN_INTERVAL, T_SCAN_INTERVAL,
 				      0, 1000000, 1000);
 	obs_property_int_set_suffix(prop, "ms");
+	obs_properties_add_int(props, S_SUBDIRECTORY_DEPTH,
+			       T_SUBDIRECTORY_DEPTH, 0, 32, 1);
+	prop = obs_properties_add_int(props, S_BURST_DELAY, T_BURST_DELAY, 0,
+				      60000, 100);
+	obs_property_int_set_suffix(prop, "ms");
+	obs_property_set_long_description(prop, T_BURST_DELAY_DESCRIPTION);
+	prop = obs_properties_add_int(props, S_PLAYLIST_MAX_ITEMS,
+				      T_PLAYLIST_MAX_ITEMS, 0, 100000, 10);
+	obs_property_set_long_description(prop,
+					  T_PLAYLIST_MAX_ITEMS_DESCRIPTION);
+	prop = obs_properties_add_int(props, S_PLAYLIST_MAX_AGE,
+				      T_PLAYLIST_MAX_AGE, 0, 525600, 60);
+	obs_property_int_set_suffix(prop, "min");
+	obs_property_set_long_description(prop,
+					  T_PLAYLIST_MAX_AGE_DESCRIPTION);
+	obs_properties_add_bool(props, S_PLAYLIST_DELETE_EVICTED,
+				T_PLAYLIST_DELETE_EVICTED);
+	prop = obs_properties_add_int(props, S_STAT_THREADS, T_STAT_THREADS, 1,
+				      64, 1);
+	obs_property_set_long_description(prop, T_STAT_THREADS_DESCRIPTION);
+	prop = obs_properties_add_bool(props, S_DEDUPE, T_DEDUPE);
+	obs_property_set_long_description(prop, T_DEDUPE_DESCRIPTION);
+	prop = obs_properties_add_bool(props, S_GAPLESS, T_GAPLESS);
+	obs_property_set_long_description(prop, T_GAPLESS_DESCRIPTION);
+	prop = obs_properties_add_bool(props, S_INDEX_SNAPSHOT,
+				       T_INDEX_SNAPSHOT);
+	obs_property_set_long_description(prop, T_INDEX_SNAPSHOT_DESCRIPTION);
+	prop = obs_properties_add_path(props, S_TRASH_DIRECTORY,
+				       T_TRASH_DIRECTORY, OBS_PATH_DIRECTORY,
+				       NULL, NULL);
+	obs_property_set_long_description(prop, T_TRASH_DIRECTORY_DESCRIPTION);
+	prop = obs_properties_add_int(props, S_PREFETCH_DEPTH, T_PREFETCH_DEPTH,
+				      0, 16, 1);
+	obs_property_set_long_description(prop, T_PREFETCH_DEPTH_DESCRIPTION);
+	prop = obs_properties_add_int(props, S_READAHEAD_SIZE, T_READAHEAD_SIZE,
+				      0, 1024, 1);
+	obs_property_int_set_suffix(prop, "MB");
+	obs_property_set_long_description(prop, T_READAHEAD_SIZE_DESCRIPTION);
+	prop = obs_properties_add_int(props, S_READAHEAD_BUDGET,
+				      T_READAHEAD_BUDGET, 1, 4096, 1);
+	obs_property_int_set_suffix(prop, "MB");
+	obs_property_set_long_description(prop,
+					  T_READAHEAD_BUDGET_DESCRIPTION);
+	prop = obs_properties_add_int(props, S_STATS_LOG_INTERVAL,
+				      T_STATS_LOG_INTERVAL, 0, 86400, 10);
+	obs_property_int_set_suffix(prop, "s");
+	obs_property_set_long_description(prop,
+					  T_STATS_LOG_INTERVAL_DESCRIPTION);
 	return props;
 }
 
@@ -694,6 +1318,11 @@ void dir_watch_media_source_render(void *data, gs_effect_t *effect)
 {
 	UNUSED_PARAMETER(effect);
 	struct dir_watch_media_source *context = data;
+	if (context->preroll_shown) {
+		/* covers the parent while it reopens */
+		obs_source_video_render(context->preroll);
+		return;
+	}
 	obs_source_skip_video_filter(context->source);
 }
 
@@ -726,3 +1355,8 @@ bool obs_module_load(void)
 	obs_register_source(&dir_watch_media_info);
 	return true;
 }
+
+void obs_module_unload(void)
+{
+	dir_watch_deleter_shutdown();
+}
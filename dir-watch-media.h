@@ -1 +1,13 @@
+#pragma once
+
 #include <obs-module.h>
+
+enum sort_by {
+	created_newest,
+	created_oldest,
+	modified_newest,
+	modified_oldest,
+	alphabetically_first,
+	alphabetically_last,
+	sort_random,
+};
@@ -0,0 +1,284 @@
+#include "dir-watch-playlist.h"
+#include <util/dstr.h>
+#include <util/platform.h>
+
+#define S_VALUE "value"
+
+/* a path in the playlist, refs counts how often */
+struct dir_watch_playlist_item {
+	struct dir_watch_playlist_item *next;
+	uint64_t hash;
+	size_t refs;
+	char path[];
+};
+
+static inline char lower(char c)
+{
+	return c >= 'A' && c <= 'Z' ? (char)(c - 'A' + 'a') : c;
+}
+
+static uint64_t hash_path(const char *path)
+{
+	uint64_t hash = 14695981039346656037ULL;
+	while (*path) {
+		hash ^= (uint8_t)lower(*path++);
+		hash *= 1099511628211ULL;
+	}
+	return hash;
+}
+
+static struct dir_watch_playlist_item **
+playlist_find(const struct dir_watch_playlist *playlist, const char *path,
+	      uint64_t hash)
+{
+	if (!playlist->bucket_count)
+		return NULL;
+	struct dir_watch_playlist_item **item =
+		&playlist->buckets[hash % playlist->bucket_count];
+	while (*item && ((*item)->hash != hash ||
+			 astrcmpi((*item)->path, path) != 0))
+		item = &(*item)->next;
+	return item;
+}
+
+static void playlist_grow(struct dir_watch_playlist *playlist)
+{
+	const size_t bucket_count =
+		playlist->bucket_count ? playlist->bucket_count * 2 : 64;
+	struct dir_watch_playlist_item **buckets =
+		bzalloc(bucket_count * sizeof(*buckets));
+	for (size_t i = 0; i < playlist->bucket_count; i++) {
+		struct dir_watch_playlist_item *item = playlist->buckets[i];
+		while (item) {
+			struct dir_watch_playlist_item *next = item->next;
+			const size_t bucket = item->hash % bucket_count;
+			item->next = buckets[bucket];
+			buckets[bucket] = item;
+			item = next;
+		}
+	}
+	bfree(playlist->buckets);
+	playlist->buckets = buckets;
+	playlist->bucket_count = bucket_count;
+}
+
+static void playlist_insert(struct dir_watch_playlist *playlist,
+			    const char *path)
+{
+	const uint64_t hash = hash_path(path);
+	struct dir_watch_playlist_item **item =
+		playlist_find(playlist, path, hash);
+	if (item && *item) {
+		(*item)->refs++;
+		return;
+	}
+	if (playlist->item_count >= playlist->bucket_count) {
+		playlist_grow(playlist);
+		item = playlist_find(playlist, path, hash);
+	}
+	const size_t len = strlen(path);
+	struct dir_watch_playlist_item *new_item =
+		bmalloc(sizeof(struct dir_watch_playlist_item) + len + 1);
+	new_item->next = NULL;
+	new_item->hash = hash;
+	new_item->refs = 1;
+	memcpy(new_item->path, path, len + 1);
+	*item = new_item;
+	playlist->item_count++;
+}
+
+static void playlist_remove(struct dir_watch_playlist *playlist,
+			    const char *path)
+{
+	struct dir_watch_playlist_item **item =
+		playlist_find(playlist, path, hash_path(path));
+	if (!item || !*item || --(*item)->refs)
+		return;
+	struct dir_watch_playlist_item *old = *item;
+	*item = old->next;
+	bfree(old);
+	playlist->item_count--;
+}
+
+static void playlist_reset(struct dir_watch_playlist *playlist)
+{
+	for (size_t i = 0; i < playlist->bucket_count; i++) {
+		struct dir_watch_playlist_item *item = playlist->buckets[i];
+		while (item) {
+			struct dir_watch_playlist_item *next = item->next;
+			bfree(item);
+			item = next;
+		}
+		playlist->buckets[i] = NULL;
+	}
+	playlist->item_count = 0;
+	playlist->count = 0;
+	playlist->added_first = 0;
+	bfree(playlist->last);
+	playlist->last = NULL;
+}
+
+static inline uint64_t *playlist_added(struct dir_watch_playlist *playlist,
+				       size_t index)
+{
+	return &playlist->added[(playlist->added_first + index) %
+				playlist->added_capacity];
+}
+
+/* Makes room for one more item, call before count grows */
+static void playlist_reserve(struct dir_watch_playlist *playlist)
+{
+	if (playlist->count < playlist->added_capacity)
+		return;
+	const size_t capacity = playlist->added_capacity
+					? playlist->added_capacity * 2
+					: 16;
+	uint64_t *added = bmalloc(capacity * sizeof(*added));
+	for (size_t i = 0; i < playlist->count; i++)
+		added[i] = *playlist_added(playlist, i);
+	bfree(playlist->added);
+	playlist->added = added;
+	playlist->added_first = 0;
+	playlist->added_capacity = capacity;
+}
+
+static const char *array_path(obs_data_array_t *array, size_t index,
+			      obs_data_t **item)
+{
+	*item = obs_data_array_item(array, index);
+	return *item ? obs_data_get_string(*item, S_VALUE) : "";
+}
+
+static void playlist_set_last(struct dir_watch_playlist *playlist)
+{
+	bfree(playlist->last);
+	playlist->last = NULL;
+	if (!playlist->count)
+		return;
+	obs_data_t *item;
+	playlist->last = bstrdup(
+		array_path(playlist->array, playlist->count - 1, &item));
+	obs_data_release(item);
+}
+
+void dir_watch_playlist_init(struct dir_watch_playlist *playlist)
+{
+	memset(playlist, 0, sizeof(*playlist));
+}
+
+void dir_watch_playlist_free(struct dir_watch_playlist *playlist)
+{
+	playlist_reset(playlist);
+	bfree(playlist->buckets);
+	bfree(playlist->added);
+	obs_data_array_release(playlist->array);
+	memset(playlist, 0, sizeof(*playlist));
+}
+
+/* Cheap check for changes made without going through the playlist */
+static bool playlist_in_sync(const struct dir_watch_playlist *playlist,
+			     obs_data_array_t *array)
+{
+	if (playlist->array != array ||
+	    playlist->count != obs_data_array_count(array))
+		return false;
+	if (!playlist->count)
+		return true;
+	obs_data_t *item;
+	const char *last = array_path(array, playlist->count - 1, &item);
+	const bool same = playlist->last && strcmp(playlist->last, last) == 0;
+	obs_data_release(item);
+	return same;
+}
+
+void dir_watch_playlist_sync(struct dir_watch_playlist *playlist,
+			     obs_data_array_t *array)
+{
+	if (playlist_in_sync(playlist, array))
+		return;
+	playlist_reset(playlist);
+	obs_data_array_addref(array);
+	obs_data_array_release(playlist->array);
+	playlist->array = array;
+	const size_t count = obs_data_array_count(array);
+	const uint64_t now = os_gettime_ns();
+	for (size_t i = 0; i < count; i++) {
+		obs_data_t *item;
+		playlist_insert(playlist, array_path(array, i, &item));
+		obs_data_release(item);
+		playlist_reserve(playlist);
+		*playlist_added(playlist, playlist->count++) = now;
+	}
+	playlist_set_last(playlist);
+}
+
+bool dir_watch_playlist_contains(const struct dir_watch_playlist *playlist,
+				 const char *path)
+{
+	struct dir_watch_playlist_item **item =
+		playlist_find(playlist, path, hash_path(path));
+	return item && *item;
+}
+
+bool dir_watch_playlist_add(struct dir_watch_playlist *playlist,
+			    const char *path, uint64_t now)
+{
+	if (!playlist->array || dir_watch_playlist_contains(playlist, path))
+		return false;
+	obs_data_t *item = obs_data_create();
+	obs_data_set_string(item, S_VALUE, path);
+	obs_data_array_push_back(playlist->array, item);
+	obs_data_release(item);
+	playlist_insert(playlist, path);
+	playlist_reserve(playlist);
+	*playlist_added(playlist, playlist->count++) = now;
+	bfree(playlist->last);
+	playlist->last = bstrdup(path);
+	return true;
+}
+
+char *dir_watch_playlist_erase(struct dir_watch_playlist *playlist,
+			       size_t index)
+{
+	if (!playlist->array || index >= playlist->count)
+		return NULL;
+	obs_data_t *item;
+	char *path = bstrdup(array_path(playlist->array, index, &item));
+	obs_data_release(item);
+	obs_data_array_erase(playlist->array, index);
+	playlist_remove(playlist, path);
+	if (index == 0) {
+		playlist->added_first = (playlist->added_first + 1) %
+					playlist->added_capacity;
+	} else {
+		for (size_t i = index; i + 1 < playlist->count; i++)
+			*playlist_added(playlist, i) =
+				*playlist_added(playlist, i + 1);
+	}
+	playlist->count--;
+	if (index == playlist->count)
+		playlist_set_last(playlist);
+	return path;
+}
+
+void dir_watch_playlist_clear(struct dir_watch_playlist *playlist)
+{
+	if (!playlist->array)
+		return;
+	/* from the back so nothing has to move */
+	while (playlist->count)
+		obs_data_array_erase(playlist->array, --playlist->count);
+	playlist_reset(playlist);
+}
+
+char *dir_watch_playlist_evict(struct dir_watch_playlist *playlist,
+			       size_t max_count, uint64_t max_age,
+			       uint64_t now)
+{
+	if (!playlist->count)
+		return NULL;
+	const bool full = max_count && playlist->count > max_count;
+	const bool old = max_age &&
+			 now - *playlist_added(playlist, 0) >= max_age;
+	return full || old ? dir_watch_playlist_erase(playlist, 0) : NULL;
+}
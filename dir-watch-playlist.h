@@ -0,0 +1,53 @@
+#pragma once
+
+#include <obs-module.h>
+
+struct dir_watch_playlist_item;
+
+/* Mirror of the paths in a vlc_source playlist array, so a file can be
+ * checked for without walking the array. Paths compare case insensitive.
+ * The array is reread when it was replaced or its length or last path
+ * changed, which covers edits in the properties and other plugins. */
+struct dir_watch_playlist {
+	obs_data_array_t *array;
+	size_t count;
+	char *last;
+
+	struct dir_watch_playlist_item **buckets;
+	size_t bucket_count;
+	size_t item_count;
+
+	/* when each item was added in array order, a ring so evicting the
+	 * first one does not move the others. Items found on a reread count
+	 * as added then. */
+	uint64_t *added;
+	size_t added_first;
+	size_t added_capacity;
+};
+
+void dir_watch_playlist_init(struct dir_watch_playlist *playlist);
+void dir_watch_playlist_free(struct dir_watch_playlist *playlist);
+
+/* Makes the playlist mirror the array, the calls below work on it */
+void dir_watch_playlist_sync(struct dir_watch_playlist *playlist,
+			     obs_data_array_t *array);
+
+bool dir_watch_playlist_contains(const struct dir_watch_playlist *playlist,
+				 const char *path);
+
+/* Appends the path unless the playlist has it, returns true if it did */
+bool dir_watch_playlist_add(struct dir_watch_playlist *playlist,
+			    const char *path, uint64_t now);
+
+/* Erases an item, returns its path to be freed with bfree */
+char *dir_watch_playlist_erase(struct dir_watch_playlist *playlist,
+			       size_t index);
+
+void dir_watch_playlist_clear(struct dir_watch_playlist *playlist);
+
+/* Erases the first item when there are more than max_count items or it was
+ * added max_age ago, 0 disables a limit. Returns its path to be freed with
+ * bfree, NULL when the playlist is within the limits. */
+char *dir_watch_playlist_evict(struct dir_watch_playlist *playlist,
+			       size_t max_count, uint64_t max_age,
+			       uint64_t now);
@@ -0,0 +1,201 @@
+#include "dir-watch-prefetch.h"
+#include <obs-module.h>
+#include <util/threading.h>
+#include <util/platform.h>
+#include <util/darray.h>
+
+/* images are read in pieces of this size */
+#define PREFETCH_CHUNK 1048576
+
+struct prefetch_entry {
+	char *path;
+	enum dir_watch_prefetch_state state;
+};
+
+struct dir_watch_prefetch {
+	pthread_t thread;
+	bool thread_created;
+	os_event_t *wake;
+	volatile bool stopping;
+
+	/* protected by mutex */
+	pthread_mutex_t mutex;
+	size_t depth;
+	/* least recently requested first */
+	DARRAY(struct prefetch_entry) entries;
+	/* entry being read, it is never dropped */
+	const char *reading;
+
+	/* only used by the worker thread */
+	uint8_t *buffer;
+};
+
+static size_t prefetch_find(struct dir_watch_prefetch *prefetch,
+			    const char *path)
+{
+	for (size_t i = 0; i < prefetch->entries.num; i++) {
+		if (strcmp(prefetch->entries.array[i].path, path) == 0)
+			return i;
+	}
+	return DARRAY_INVALID;
+}
+
+/* Drops the least recently requested entries beyond the depth */
+static void prefetch_trim(struct dir_watch_prefetch *prefetch)
+{
+	size_t i = 0;
+	while (prefetch->entries.num > prefetch->depth &&
+	       i < prefetch->entries.num) {
+		struct prefetch_entry *entry = &prefetch->entries.array[i];
+		if (entry->path == prefetch->reading) {
+			i++;
+			continue;
+		}
+		bfree(entry->path);
+		da_erase(prefetch->entries, i);
+	}
+}
+
+/* The most recent request is the one about to be shown */
+static char *prefetch_next(struct dir_watch_prefetch *prefetch)
+{
+	for (size_t i = prefetch->entries.num; i > 0; i--) {
+		struct prefetch_entry *entry = &prefetch->entries.array[i - 1];
+		if (entry->state == prefetch_pending) {
+			prefetch->reading = entry->path;
+			return entry->path;
+		}
+	}
+	return NULL;
+}
+
+/* Reads the whole file so the image source decodes it from memory, true
+ * when it could be read to the end */
+static bool prefetch_read(struct dir_watch_prefetch *prefetch,
+			  const char *path)
+{
+	FILE *file = os_fopen(path, "rb");
+	if (!file)
+		return false;
+	if (!prefetch->buffer)
+		prefetch->buffer = bmalloc(PREFETCH_CHUNK);
+	size_t read;
+	do {
+		read = fread(prefetch->buffer, 1, PREFETCH_CHUNK, file);
+	} while (read == PREFETCH_CHUNK &&
+		 !os_atomic_load_bool(&prefetch->stopping));
+	const bool complete = !ferror(file) && feof(file);
+	fclose(file);
+	return complete;
+}
+
+static void *prefetch_thread(void *data)
+{
+	struct dir_watch_prefetch *prefetch = data;
+	os_set_thread_name("dir-watch-media: prefetch");
+
+	while (!os_atomic_load_bool(&prefetch->stopping)) {
+		pthread_mutex_lock(&prefetch->mutex);
+		char *path = prefetch_next(prefetch);
+		pthread_mutex_unlock(&prefetch->mutex);
+		if (!path) {
+			os_event_wait(prefetch->wake);
+			continue;
+		}
+
+		/* the path stays valid while it is being read */
+		const bool loaded = prefetch_read(prefetch, path);
+
+		pthread_mutex_lock(&prefetch->mutex);
+		const size_t i = prefetch_find(prefetch, path);
+		prefetch->reading = NULL;
+		if (i != DARRAY_INVALID)
+			prefetch->entries.array[i].state =
+				loaded ? prefetch_ready : prefetch_failed;
+		prefetch_trim(prefetch);
+		pthread_mutex_unlock(&prefetch->mutex);
+	}
+	return NULL;
+}
+
+struct dir_watch_prefetch *dir_watch_prefetch_create(void)
+{
+	struct dir_watch_prefetch *prefetch =
+		bzalloc(sizeof(struct dir_watch_prefetch));
+	pthread_mutex_init_value(&prefetch->mutex);
+	if (pthread_mutex_init(&prefetch->mutex, NULL) != 0)
+		goto fail;
+	if (os_event_init(&prefetch->wake, OS_EVENT_TYPE_AUTO) != 0)
+		goto fail;
+	return prefetch;
+
+fail:
+	dir_watch_prefetch_destroy(prefetch);
+	return NULL;
+}
+
+void dir_watch_prefetch_destroy(struct dir_watch_prefetch *prefetch)
+{
+	if (!prefetch)
+		return;
+	if (prefetch->thread_created) {
+		os_atomic_set_bool(&prefetch->stopping, true);
+		os_event_signal(prefetch->wake);
+		pthread_join(prefetch->thread, NULL);
+	}
+	for (size_t i = 0; i < prefetch->entries.num; i++)
+		bfree(prefetch->entries.array[i].path);
+	da_free(prefetch->entries);
+	os_event_destroy(prefetch->wake);
+	pthread_mutex_destroy(&prefetch->mutex);
+	bfree(prefetch->buffer);
+	bfree(prefetch);
+}
+
+void dir_watch_prefetch_set_depth(struct dir_watch_prefetch *prefetch,
+				  size_t depth)
+{
+	if (!prefetch)
+		return;
+	pthread_mutex_lock(&prefetch->mutex);
+	prefetch->depth = depth;
+	prefetch_trim(prefetch);
+	pthread_mutex_unlock(&prefetch->mutex);
+}
+
+enum dir_watch_prefetch_state
+dir_watch_prefetch_request(struct dir_watch_prefetch *prefetch,
+			   const char *path)
+{
+	if (!prefetch || !path || !*path)
+		return prefetch_unknown;
+	pthread_mutex_lock(&prefetch->mutex);
+	if (!prefetch->depth) {
+		pthread_mutex_unlock(&prefetch->mutex);
+		return prefetch_unknown;
+	}
+	struct prefetch_entry entry;
+	const size_t i = prefetch_find(prefetch, path);
+	if (i != DARRAY_INVALID) {
+		/* most recently requested again */
+		entry = prefetch->entries.array[i];
+		da_erase(prefetch->entries, i);
+	} else {
+		entry.path = bstrdup(path);
+		entry.state = prefetch_pending;
+	}
+	da_push_back(prefetch->entries, &entry);
+	prefetch_trim(prefetch);
+
+	/* started with the first image */
+	if (!prefetch->thread_created &&
+	    pthread_create(&prefetch->thread, NULL, prefetch_thread,
+			   prefetch) == 0)
+		prefetch->thread_created = true;
+	const bool running = prefetch->thread_created;
+	pthread_mutex_unlock(&prefetch->mutex);
+
+	if (entry.state == prefetch_pending)
+		os_event_signal(prefetch->wake);
+	return running ? entry.state : prefetch_unknown;
+}
@@ -0,0 +1,30 @@
+#pragma once
+
+#include <stddef.h>
+
+/* Reads upcoming images on a worker thread before they are handed to an
+ * image source. The source decodes the file itself during its update on the
+ * video thread, but then from the page cache instead of the disk, and only
+ * once the file could be read completely. */
+struct dir_watch_prefetch;
+
+enum dir_watch_prefetch_state {
+	/* not tracked, prefetching is off */
+	prefetch_unknown,
+	prefetch_pending,
+	prefetch_ready,
+	prefetch_failed,
+};
+
+struct dir_watch_prefetch *dir_watch_prefetch_create(void);
+void dir_watch_prefetch_destroy(struct dir_watch_prefetch *prefetch);
+
+/* How many images are remembered queued or read, the least recently
+ * requested are dropped first, 0 turns prefetching off */
+void dir_watch_prefetch_set_depth(struct dir_watch_prefetch *prefetch,
+				  size_t depth);
+
+/* Queues the image for reading unless it already is, returns its state */
+enum dir_watch_prefetch_state
+dir_watch_prefetch_request(struct dir_watch_prefetch *prefetch,
+			   const char *path);
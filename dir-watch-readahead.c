@@ -0,0 +1,250 @@
+#include "dir-watch-readahead.h"
+#include <obs-module.h>
+#include <util/threading.h>
+#include <util/platform.h>
+#include <util/darray.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#ifndef _WIN32
+#include <unistd.h>
+#endif
+
+/* files remembered at most, whatever their size */
+#define READAHEAD_MAX_FILES 64
+/* read in pieces of this size where the kernel cannot be asked to */
+#define READAHEAD_CHUNK 1048576
+
+struct readahead_file {
+	char *path;
+	/* bytes read ahead, counted against the budget once done */
+	uint64_t bytes;
+	bool done;
+};
+
+struct dir_watch_readahead {
+	pthread_t thread;
+	bool thread_created;
+	os_event_t *wake;
+	volatile bool stopping;
+
+	/* protected by mutex */
+	pthread_mutex_t mutex;
+	uint64_t size;
+	uint64_t budget;
+	uint64_t used;
+	/* in the order they were requested */
+	DARRAY(struct readahead_file) files;
+	/* file being read, it is never dropped */
+	const char *reading;
+
+	/* only used by the worker thread */
+	uint8_t *buffer;
+};
+
+static size_t readahead_find(struct dir_watch_readahead *readahead,
+			     const char *path)
+{
+	for (size_t i = 0; i < readahead->files.num; i++) {
+		if (strcmp(readahead->files.array[i].path, path) == 0)
+			return i;
+	}
+	return DARRAY_INVALID;
+}
+
+/* Forgets the oldest files until another extra bytes fit in the budget */
+static void readahead_trim(struct dir_watch_readahead *readahead,
+			   uint64_t extra)
+{
+	size_t i = 0;
+	while (i < readahead->files.num &&
+	       (readahead->files.num > READAHEAD_MAX_FILES ||
+		readahead->used + extra > readahead->budget)) {
+		struct readahead_file *file = &readahead->files.array[i];
+		if (file->path == readahead->reading) {
+			i++;
+			continue;
+		}
+		readahead->used -= file->bytes;
+		bfree(file->path);
+		da_erase(readahead->files, i);
+	}
+}
+
+static struct readahead_file *
+readahead_next(struct dir_watch_readahead *readahead)
+{
+	for (size_t i = 0; i < readahead->files.num; i++) {
+		struct readahead_file *file = &readahead->files.array[i];
+		if (!file->done)
+			return file;
+	}
+	return NULL;
+}
+
+/* Returns the bytes brought into the page cache */
+static uint64_t readahead_read(struct dir_watch_readahead *readahead,
+			       const char *path, uint64_t size)
+{
+#ifdef POSIX_FADV_WILLNEED
+	UNUSED_PARAMETER(readahead);
+	const int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return 0;
+	struct stat stats;
+	uint64_t bytes = 0;
+	if (fstat(fd, &stats) == 0) {
+		bytes = (uint64_t)stats.st_size < size
+				? (uint64_t)stats.st_size
+				: size;
+		/* the kernel reads in the background, the file does not
+		 * have to stay open for it */
+		if (bytes && posix_fadvise(fd, 0, (off_t)bytes,
+					   POSIX_FADV_WILLNEED) != 0)
+			bytes = 0;
+	}
+	close(fd);
+	return bytes;
+#else
+	FILE *file = os_fopen(path, "rb");
+	if (!file)
+		return 0;
+	if (!readahead->buffer)
+		readahead->buffer = bmalloc(READAHEAD_CHUNK);
+	uint64_t bytes = 0;
+	while (bytes < size && !os_atomic_load_bool(&readahead->stopping)) {
+		const size_t chunk = size - bytes < READAHEAD_CHUNK
+					     ? (size_t)(size - bytes)
+					     : READAHEAD_CHUNK;
+		const size_t read = fread(readahead->buffer, 1, chunk, file);
+		bytes += read;
+		if (read < chunk)
+			break;
+	}
+	fclose(file);
+	return bytes;
+#endif
+}
+
+static void *readahead_thread(void *data)
+{
+	struct dir_watch_readahead *readahead = data;
+	os_set_thread_name("dir-watch-media: readahead");
+
+	while (!os_atomic_load_bool(&readahead->stopping)) {
+		pthread_mutex_lock(&readahead->mutex);
+		struct readahead_file *file = readahead_next(readahead);
+		uint64_t size = readahead->size;
+		if (size > readahead->budget)
+			size = readahead->budget;
+		char *path = NULL;
+		if (file) {
+			path = file->path;
+			readahead->reading = path;
+			/* room for it before it is read */
+			readahead_trim(readahead, size);
+		}
+		pthread_mutex_unlock(&readahead->mutex);
+		if (!path) {
+			os_event_wait(readahead->wake);
+			continue;
+		}
+
+		/* the path stays valid while it is being read */
+		const uint64_t bytes = readahead_read(readahead, path, size);
+
+		pthread_mutex_lock(&readahead->mutex);
+		const size_t i = readahead_find(readahead, path);
+		readahead->reading = NULL;
+		if (i != DARRAY_INVALID) {
+			readahead->files.array[i].bytes = bytes;
+			readahead->files.array[i].done = true;
+			readahead->used += bytes;
+		}
+		readahead_trim(readahead, 0);
+		pthread_mutex_unlock(&readahead->mutex);
+	}
+	return NULL;
+}
+
+struct dir_watch_readahead *dir_watch_readahead_create(void)
+{
+	struct dir_watch_readahead *readahead =
+		bzalloc(sizeof(struct dir_watch_readahead));
+	pthread_mutex_init_value(&readahead->mutex);
+	if (pthread_mutex_init(&readahead->mutex, NULL) != 0)
+		goto fail;
+	if (os_event_init(&readahead->wake, OS_EVENT_TYPE_AUTO) != 0)
+		goto fail;
+	return readahead;
+
+fail:
+	dir_watch_readahead_destroy(readahead);
+	return NULL;
+}
+
+void dir_watch_readahead_destroy(struct dir_watch_readahead *readahead)
+{
+	if (!readahead)
+		return;
+	if (readahead->thread_created) {
+		os_atomic_set_bool(&readahead->stopping, true);
+		os_event_signal(readahead->wake);
+		pthread_join(readahead->thread, NULL);
+	}
+	for (size_t i = 0; i < readahead->files.num; i++)
+		bfree(readahead->files.array[i].path);
+	da_free(readahead->files);
+	os_event_destroy(readahead->wake);
+	pthread_mutex_destroy(&readahead->mutex);
+	bfree(readahead->buffer);
+	bfree(readahead);
+}
+
+void dir_watch_readahead_set_size(struct dir_watch_readahead *readahead,
+				  uint64_t size, uint64_t budget)
+{
+	if (!readahead)
+		return;
+	pthread_mutex_lock(&readahead->mutex);
+	readahead->size = size;
+	readahead->budget = budget;
+	readahead_trim(readahead, 0);
+	pthread_mutex_unlock(&readahead->mutex);
+}
+
+void dir_watch_readahead_request(struct dir_watch_readahead *readahead,
+				 const char *path)
+{
+	if (!readahead || !path || !*path)
+		return;
+	pthread_mutex_lock(&readahead->mutex);
+	if (!readahead->size || !readahead->budget ||
+	    readahead_find(readahead, path) != DARRAY_INVALID) {
+		pthread_mutex_unlock(&readahead->mutex);
+		return;
+	}
+	struct readahead_file file = {bstrdup(path), 0, false};
+	da_push_back(readahead->files, &file);
+	readahead_trim(readahead, 0);
+
+	/* started with the first file */
+	if (!readahead->thread_created &&
+	    pthread_create(&readahead->thread, NULL, readahead_thread,
+			   readahead) == 0)
+		readahead->thread_created = true;
+	pthread_mutex_unlock(&readahead->mutex);
+	os_event_signal(readahead->wake);
+}
+
+bool dir_watch_readahead_pending(struct dir_watch_readahead *readahead,
+				 const char *path)
+{
+	if (!readahead || !path || !*path)
+		return false;
+	pthread_mutex_lock(&readahead->mutex);
+	const size_t i = readahead_find(readahead, path);
+	const bool pending = i != DARRAY_INVALID &&
+			     !readahead->files.array[i].done;
+	pthread_mutex_unlock(&readahead->mutex);
+	return pending;
+}
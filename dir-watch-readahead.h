@@ -0,0 +1,28 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* Reads the start of upcoming media files into the page cache on a worker
+ * thread, so a source switching to one on a spinning disk or a network
+ * share does not stall on its first frames. Files read ahead are
+ * remembered until the memory budget is used up, the oldest are forgotten
+ * first. */
+struct dir_watch_readahead;
+
+struct dir_watch_readahead *dir_watch_readahead_create(void);
+void dir_watch_readahead_destroy(struct dir_watch_readahead *readahead);
+
+/* Bytes read from the start of every file, 0 turns reading ahead off, and
+ * how much all files remembered may take together */
+void dir_watch_readahead_set_size(struct dir_watch_readahead *readahead,
+				  uint64_t size, uint64_t budget);
+
+/* Queues the file unless it was read ahead already, never blocks. Files
+ * are read in the order they were requested. */
+void dir_watch_readahead_request(struct dir_watch_readahead *readahead,
+				 const char *path);
+
+/* True while the file is queued or being read */
+bool dir_watch_readahead_pending(struct dir_watch_readahead *readahead,
+				 const char *path);
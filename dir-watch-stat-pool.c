@@ -0,0 +1,131 @@
+#include "dir-watch-stat-pool.h"
+#include <obs-module.h>
+#include <util/threading.h>
+#include <util/darray.h>
+
+/* smaller batches are not worth waking the workers for */
+#define STAT_POOL_MIN_BATCH 8
+
+struct dir_watch_stat_pool {
+	DARRAY(pthread_t) threads;
+	os_sem_t *start;
+	os_event_t *done;
+	volatile bool stopping;
+
+	/* the batch being run */
+	void (*job)(void *param, size_t index);
+	void *param;
+	size_t count;
+	volatile long next;
+	/* workers that did not finish the batch yet */
+	volatile long running;
+};
+
+static void stat_pool_work(struct dir_watch_stat_pool *pool)
+{
+	for (;;) {
+		const long index = os_atomic_inc_long(&pool->next) - 1;
+		if (index < 0 || (size_t)index >= pool->count)
+			return;
+		pool->job(pool->param, (size_t)index);
+	}
+}
+
+static void *stat_pool_thread(void *data)
+{
+	struct dir_watch_stat_pool *pool = data;
+	os_set_thread_name("dir-watch-media: stat");
+
+	for (;;) {
+		os_sem_wait(pool->start);
+		if (os_atomic_load_bool(&pool->stopping))
+			break;
+		stat_pool_work(pool);
+		if (os_atomic_dec_long(&pool->running) == 0)
+			os_event_signal(pool->done);
+	}
+	return NULL;
+}
+
+static void stat_pool_stop(struct dir_watch_stat_pool *pool)
+{
+	if (!pool->threads.num)
+		return;
+	os_atomic_set_bool(&pool->stopping, true);
+	for (size_t i = 0; i < pool->threads.num; i++)
+		os_sem_post(pool->start);
+	for (size_t i = 0; i < pool->threads.num; i++)
+		pthread_join(pool->threads.array[i], NULL);
+	da_resize(pool->threads, 0);
+	os_atomic_set_bool(&pool->stopping, false);
+}
+
+struct dir_watch_stat_pool *dir_watch_stat_pool_create(void)
+{
+	struct dir_watch_stat_pool *pool =
+		bzalloc(sizeof(struct dir_watch_stat_pool));
+	if (os_sem_init(&pool->start, 0) != 0)
+		goto fail;
+	if (os_event_init(&pool->done, OS_EVENT_TYPE_AUTO) != 0)
+		goto fail;
+	return pool;
+
+fail:
+	dir_watch_stat_pool_destroy(pool);
+	return NULL;
+}
+
+void dir_watch_stat_pool_destroy(struct dir_watch_stat_pool *pool)
+{
+	if (!pool)
+		return;
+	stat_pool_stop(pool);
+	da_free(pool->threads);
+	os_sem_destroy(pool->start);
+	os_event_destroy(pool->done);
+	bfree(pool);
+}
+
+void dir_watch_stat_pool_set_threads(struct dir_watch_stat_pool *pool,
+				     size_t threads)
+{
+	if (!pool || threads == pool->threads.num + 1)
+		return;
+	stat_pool_stop(pool);
+	/* the calling thread is one of them */
+	for (size_t i = 1; i < threads; i++) {
+		pthread_t thread;
+		if (pthread_create(&thread, NULL, stat_pool_thread, pool) !=
+		    0) {
+			blog(LOG_WARNING,
+			     "[Directory watch media] failed to create a stat thread");
+			break;
+		}
+		da_push_back(pool->threads, &thread);
+	}
+}
+
+size_t dir_watch_stat_pool_threads(const struct dir_watch_stat_pool *pool)
+{
+	return pool ? pool->threads.num + 1 : 1;
+}
+
+void dir_watch_stat_pool_run(struct dir_watch_stat_pool *pool, size_t count,
+			     void (*job)(void *param, size_t index),
+			     void *param)
+{
+	if (!pool || !pool->threads.num || count < STAT_POOL_MIN_BATCH) {
+		for (size_t i = 0; i < count; i++)
+			job(param, i);
+		return;
+	}
+	pool->job = job;
+	pool->param = param;
+	pool->count = count;
+	os_atomic_set_long(&pool->next, 0);
+	os_atomic_set_long(&pool->running, (long)pool->threads.num);
+	for (size_t i = 0; i < pool->threads.num; i++)
+		os_sem_post(pool->start);
+	stat_pool_work(pool);
+	os_event_wait(pool->done);
+}
@@ -0,0 +1,25 @@
+#pragma once
+
+#include <stddef.h>
+
+/* Worker threads running the file queries of a scan side by side. On
+ * network shares every query waits a round trip, running them together
+ * makes a scan take about the round trip times the files divided by the
+ * threads instead of times the files. */
+struct dir_watch_stat_pool;
+
+struct dir_watch_stat_pool *dir_watch_stat_pool_create(void);
+void dir_watch_stat_pool_destroy(struct dir_watch_stat_pool *pool);
+
+/* Queries run on this many threads at once, the calling thread included,
+ * 1 runs them one after another on the calling thread. Not to be called
+ * while a batch runs. */
+void dir_watch_stat_pool_set_threads(struct dir_watch_stat_pool *pool,
+				     size_t threads);
+size_t dir_watch_stat_pool_threads(const struct dir_watch_stat_pool *pool);
+
+/* Calls job for every index below count and returns once all are done,
+ * jobs may run in any order on any of the threads */
+void dir_watch_stat_pool_run(struct dir_watch_stat_pool *pool, size_t count,
+			     void (*job)(void *param, size_t index),
+			     void *param);
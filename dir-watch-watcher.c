@@ -0,0 +1,1862 @@
+#include "dir-watch-watcher.h"
+#include "dir-watch-index.h"
+#include <util/platform.h>
+#include <util/threading.h>
+#include <util/darray.h>
+#include <util/dstr.h>
+#include <sys/stat.h>
+
+#ifdef __linux__
+#include <limits.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#endif
+
+/* a file is stable when its size and modification time did not change for
+ * this long, modification times can have a granularity of a second */
+#define STABLE_SECONDS 2
+
+/* polling slows down while it finds nothing new, doubling the interval up
+ * to 16 times the scan interval but not beyond 30 seconds */
+#define IDLE_BACKOFF_STEPS 4
+#define IDLE_BACKOFF_MAX_MS 30000
+
+/* the index snapshot is written at most this often while files change */
+#define SNAPSHOT_INTERVAL_NS 60000000000ULL
+
+#ifdef __linux__
+struct folder_watch {
+	int watch;
+	struct dir_watch_folder *folder;
+};
+
+/* a file seen being created, ready once the writer closed it */
+struct write_state {
+	char *name;
+	bool closed;
+};
+#endif
+
+struct dir_watch_watcher;
+
+/* A file selected in one directory with what its sort mode compares, the
+ * name and times of key */
+struct dir_watch_pick {
+	char *path;
+	/* file selected after it unless the directory changes, NULL when
+	 * there is none or it is drawn at random */
+	char *next;
+	struct dir_watch_entry key;
+	/* files in the view it was picked from */
+	size_t count;
+};
+
+/* A filter instance attached to the watcher of its directory, with its own
+ * view on the shared index */
+struct dir_watch_subscriber {
+	struct dir_watch_subscriber *next;
+	volatile long refs;
+	struct dir_watch_watcher *watcher;
+
+	/* protected by the watcher mutex */
+	struct dir_watch_matcher *matcher;
+	enum sort_by sort_by;
+	long long scan_interval;
+	int max_depth;
+	bool snapshot;
+	int stat_threads;
+	long config_gen;
+	bool reset_time;
+	bool scan_requested;
+	bool removed;
+	struct dir_watch_pick result;
+	uint64_t result_detected;
+	struct dir_watch_scan_stats stats;
+	/* files that joined or left the view since they were taken */
+	struct dir_watch_view_changes changes;
+	/* drawn ahead so the random hotkey does not wait on the thread */
+	char *random;
+	size_t random_count;
+
+	volatile long result_gen;
+
+	/* only used by the watcher thread */
+	bool attached;
+	bool indexed;
+	bool rebuild;
+	bool publish;
+	/* random order picks a new file every scan interval */
+	bool rotate;
+	bool waiting;
+	long scan_gen;
+	struct dir_watch_view view;
+	time_t time;
+	char *published;
+
+	/* selected file waiting to become stable before it is published */
+	char *pending;
+	int64_t pending_size;
+	time_t pending_modified;
+	uint64_t pending_since;
+};
+
+/* One scan and watch engine per directory, shared by all filters on it */
+struct dir_watch_watcher {
+	struct dir_watch_watcher *next;
+	/* protected by the registry mutex */
+	long refs;
+	char *directory;
+
+	pthread_t thread;
+	bool thread_created;
+	os_event_t *wake;
+	volatile bool stopping;
+
+	/* protected by mutex */
+	pthread_mutex_t mutex;
+	struct dir_watch_subscriber *subscribers;
+	bool scan_requested;
+	bool reselect;
+	bool draw_requested;
+
+	/* held by the watcher thread while it changes the index and the
+	 * views, queries read them under it. A listing takes it once per
+	 * change, so queries never wait on the file system. */
+	pthread_mutex_t index_mutex;
+
+	/* only used by the watcher thread */
+	struct dir_watch_index index;
+	DARRAY(struct dir_watch_subscriber *) attached;
+	DARRAY(char *) changes;
+	bool full_rescan;
+	/* polls in a row that found no change */
+	int idle_polls;
+	uint64_t scan_start;
+	uint64_t scan_time;
+	uint64_t recheck_time;
+	/* random subscribers last picked a new file */
+	uint64_t rotate_time;
+	/* index snapshot in the plugin config */
+	bool snapshot;
+	int stat_threads;
+	char *snapshot_file;
+	uint64_t snapshot_changes;
+	uint64_t snapshot_time;
+
+#ifdef __linux__
+	int wake_fd;
+	int inotify_fd;
+	int watch_descriptor;
+	char *watched_directory;
+	/* sorted on watch descriptor */
+	DARRAY(struct folder_watch) folder_watches;
+	DARRAY(struct write_state) writes;
+#endif
+};
+
+/* One of the directories of a subscription */
+struct dir_watch_source {
+	struct dir_watch_subscriber *subscriber;
+	long taken_gen;
+	/* the last result taken from it */
+	struct dir_watch_pick pick;
+	uint64_t detected;
+};
+
+struct dir_watch_subscription {
+	/* guards sources against take on the video thread */
+	pthread_mutex_t mutex;
+	DARRAY(struct dir_watch_source) sources;
+	enum sort_by sort_by;
+	uint64_t random_state;
+	/* a directory was removed, its pick may have been the selected one */
+	bool merge_needed;
+	/* its files left the listings without being reported */
+	bool changes_reset;
+};
+
+static pthread_mutex_t registry_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct dir_watch_watcher *registry;
+
+static void dir_watch_pick_free(struct dir_watch_pick *pick)
+{
+	bfree(pick->path);
+	bfree(pick->next);
+	bfree(pick->key.name);
+	memset(pick, 0, sizeof(*pick));
+}
+
+static void dir_watch_subscriber_release(struct dir_watch_subscriber *sub)
+{
+	if (!sub || os_atomic_dec_long(&sub->refs) != 0)
+		return;
+	dir_watch_view_free(&sub->view);
+	dir_watch_matcher_release(sub->matcher);
+	dir_watch_pick_free(&sub->result);
+	dir_watch_view_changes_free(&sub->changes);
+	bfree(sub->random);
+	bfree(sub->published);
+	bfree(sub->pending);
+	bfree(sub);
+}
+
+static void dir_watch_watcher_clear_changes(struct dir_watch_watcher *watcher)
+{
+	for (size_t i = 0; i < watcher->changes.num; i++)
+		bfree(watcher->changes.array[i]);
+	watcher->changes.num = 0;
+}
+
+static void dir_watch_watcher_add_change(struct dir_watch_watcher *watcher,
+					 const char *name)
+{
+	for (size_t i = 0; i < watcher->changes.num; i++) {
+		if (strcmp(watcher->changes.array[i], name) == 0)
+			return;
+	}
+	char *change = bstrdup(name);
+	da_push_back(watcher->changes, &change);
+}
+static void dir_watch_watcher_recheck(struct dir_watch_watcher *watcher,
+				      uint64_t time)
+{
+	if (!watcher->recheck_time || time < watcher->recheck_time)
+		watcher->recheck_time = time;
+}
+
+#ifdef __linux__
+static size_t dir_watch_watcher_find_write(struct dir_watch_watcher *watcher,
+					   const char *name)
+{
+	for (size_t i = 0; i < watcher->writes.num; i++) {
+		if (strcmp(watcher->writes.array[i].name, name) == 0)
+			return i;
+	}
+	return DARRAY_INVALID;
+}
+
+static void dir_watch_watcher_set_write(struct dir_watch_watcher *watcher,
+					const char *name, bool closed)
+{
+	const size_t idx = dir_watch_watcher_find_write(watcher, name);
+	if (idx != DARRAY_INVALID) {
+		watcher->writes.array[idx].closed = closed;
+		return;
+	}
+	struct write_state state = {bstrdup(name), closed};
+	da_push_back(watcher->writes, &state);
+}
+
+static void dir_watch_watcher_remove_write(struct dir_watch_watcher *watcher,
+					   const char *name)
+{
+	const size_t idx = dir_watch_watcher_find_write(watcher, name);
+	if (idx == DARRAY_INVALID)
+		return;
+	bfree(watcher->writes.array[idx].name);
+	da_erase(watcher->writes, idx);
+}
+
+static void dir_watch_watcher_track_write(struct dir_watch_watcher *watcher,
+					  const char *name, uint32_t mask)
+{
+	if (mask & IN_CREATE)
+		dir_watch_watcher_set_write(watcher, name, false);
+	else if (mask & (IN_CLOSE_WRITE | IN_MOVED_TO))
+		dir_watch_watcher_set_write(watcher, name, true);
+	else
+		dir_watch_watcher_remove_write(watcher, name);
+}
+
+/* drops the files that were closed, or all when events may have been lost */
+static void dir_watch_watcher_clear_writes(struct dir_watch_watcher *watcher,
+					   bool all)
+{
+	size_t i = 0;
+	while (i < watcher->writes.num) {
+		struct write_state *state = &watcher->writes.array[i];
+		if (all || state->closed) {
+			/* an open file waits for the close event, check it
+			 * again without */
+			if (!state->closed)
+				dir_watch_watcher_recheck(watcher,
+							  os_gettime_ns());
+			bfree(state->name);
+			da_erase(watcher->writes, i);
+		} else {
+			i++;
+		}
+	}
+}
+#endif
+
+/* Returns true when the file has data and its writer is done with it: the
+ * close was seen by inotify, or size and modification time stay the same
+ * for a while. Otherwise a recheck is scheduled when it may be needed. */
+static bool dir_watch_watcher_file_ready(struct dir_watch_watcher *watcher,
+					 struct dir_watch_subscriber *sub,
+					 const char *path, const char *name)
+{
+	const uint64_t now = os_gettime_ns();
+	struct stat stats;
+	if (os_stat(path, &stats) != 0 || stats.st_size <= 0) {
+		dir_watch_watcher_recheck(watcher,
+					  now + STABLE_SECONDS * 1000000000ULL);
+		return false;
+	}
+
+#ifdef __linux__
+	const size_t idx = dir_watch_watcher_find_write(watcher, name);
+	/* wait for the close event instead */
+	if (idx != DARRAY_INVALID)
+		return watcher->writes.array[idx].closed;
+#endif
+
+	if (time(NULL) - stats.st_mtime >= STABLE_SECONDS)
+		return true;
+	if (sub->pending && strcmp(sub->pending, name) == 0 &&
+	    sub->pending_size == (int64_t)stats.st_size &&
+	    sub->pending_modified == stats.st_mtime) {
+		if (now - sub->pending_since >= STABLE_SECONDS * 1000000000ULL)
+			return true;
+	} else {
+		bfree(sub->pending);
+		sub->pending = bstrdup(name);
+		sub->pending_size = (int64_t)stats.st_size;
+		sub->pending_modified = stats.st_mtime;
+		sub->pending_since = now;
+	}
+	dir_watch_watcher_recheck(watcher,
+				  sub->pending_since +
+					  STABLE_SECONDS * 1000000000ULL);
+	return false;
+}
+
+/* Picks up subscriber changes, returns the deepest subdirectory level
+ * any subscriber needs */
+static int dir_watch_watcher_sync(struct dir_watch_watcher *watcher)
+{
+	int max_depth = 0;
+	bool snapshot = false;
+	int stat_threads = 1;
+	pthread_mutex_lock(&watcher->mutex);
+	size_t i = 0;
+	while (i < watcher->attached.num) {
+		struct dir_watch_subscriber *sub = watcher->attached.array[i];
+		if (!sub->removed) {
+			i++;
+			continue;
+		}
+		if (sub->indexed)
+			dir_watch_index_remove_view(&watcher->index,
+						    &sub->view);
+		dir_watch_subscriber_release(sub);
+		da_erase(watcher->attached, i);
+	}
+	for (struct dir_watch_subscriber *sub = watcher->subscribers; sub;
+	     sub = sub->next) {
+		if (!sub->attached) {
+			sub->attached = true;
+			sub->rebuild = true;
+			os_atomic_inc_long(&sub->refs);
+			da_push_back(watcher->attached, &sub);
+		}
+		if (dir_watch_view_update(&sub->view, sub->matcher,
+					  sub->sort_by, sub->max_depth))
+			sub->rebuild = true;
+		if (sub->reset_time) {
+			sub->reset_time = false;
+			sub->time = 0;
+		}
+		sub->scan_gen = sub->config_gen;
+		sub->publish = sub->scan_interval > 0 || sub->scan_requested ||
+			       sub->waiting;
+		sub->rotate = sub->sort_by == sort_random &&
+			      sub->scan_interval > 0;
+		sub->scan_requested = false;
+		if (sub->max_depth > max_depth)
+			max_depth = sub->max_depth;
+		snapshot = snapshot || sub->snapshot;
+		if (sub->stat_threads > stat_threads)
+			stat_threads = sub->stat_threads;
+	}
+	pthread_mutex_unlock(&watcher->mutex);
+	watcher->snapshot = snapshot;
+	watcher->stat_threads = stat_threads;
+	return max_depth;
+}
+
+/* Sort modes that select the last file of a view */
+static inline bool sort_selects_last(enum sort_by sort_by)
+{
+	return sort_by == created_newest || sort_by == modified_newest ||
+	       sort_by == alphabetically_last;
+}
+
+/* The nth file of the view in the order files are selected in */
+static struct dir_watch_entry *
+dir_watch_subscriber_at(const struct dir_watch_subscriber *sub, size_t n)
+{
+	const struct dir_watch_view *view = &sub->view;
+	const size_t count = dir_watch_view_count(view);
+	if (n >= count)
+		return NULL;
+	return dir_watch_view_at(view, sort_selects_last(view->sort_by)
+					       ? count - 1 - n
+					       : n);
+}
+
+static char *dir_watch_subscriber_path(const struct dir_watch_subscriber *sub,
+				       const struct dir_watch_entry *entry)
+{
+	struct dstr path;
+	dstr_init_copy(&path, sub->watcher->index.directory);
+	dstr_cat_ch(&path, '/');
+	dstr_cat(&path, entry->name);
+	return path.array;
+}
+
+static void dir_watch_watcher_select(struct dir_watch_watcher *watcher,
+				     struct dir_watch_subscriber *sub)
+{
+	struct dstr selected_path;
+	dstr_init(&selected_path);
+	const struct dir_watch_entry *entry =
+		dir_watch_view_select(&sub->view, &sub->time);
+	if (entry) {
+		dstr_copy(&selected_path, watcher->index.directory);
+		dstr_cat_ch(&selected_path, '/');
+		dstr_cat(&selected_path, entry->name);
+	}
+
+	if (selected_path.array && selected_path.len &&
+	    (!sub->published ||
+	     strcmp(sub->published, selected_path.array) != 0) &&
+	    !dir_watch_watcher_file_ready(watcher, sub, selected_path.array,
+					  entry->name)) {
+		/* keep checking even without an interval */
+		sub->waiting = true;
+		dstr_free(&selected_path);
+		return;
+	}
+	sub->waiting = false;
+
+	/* a file that had to become stable was seen before this scan */
+	const uint64_t detected =
+		entry && sub->pending && strcmp(sub->pending, entry->name) == 0
+			? sub->pending_since
+			: watcher->scan_start;
+	bfree(sub->pending);
+	sub->pending = NULL;
+
+	struct dir_watch_pick pick = {0};
+	pick.path = bstrdup(selected_path.array ? selected_path.array : "");
+	if (entry) {
+		pick.key.name = bstrdup(entry->name);
+		pick.key.created = entry->created;
+		pick.key.modified = entry->modified;
+	}
+	pick.count = dir_watch_view_count(&sub->view);
+	const struct dir_watch_entry *next =
+		entry && sub->view.sort_by != sort_random
+			? dir_watch_subscriber_at(sub, 1)
+			: NULL;
+	if (next)
+		pick.next = dir_watch_subscriber_path(sub, next);
+
+	pthread_mutex_lock(&watcher->mutex);
+	if (sub->scan_gen == sub->config_gen) {
+		const char *path = pick.path;
+		dir_watch_pick_free(&sub->result);
+		sub->result = pick;
+		memset(&pick, 0, sizeof(pick));
+		sub->result_detected = detected;
+		os_atomic_inc_long(&sub->result_gen);
+		bfree(sub->published);
+		sub->published = bstrdup(path);
+	}
+	pthread_mutex_unlock(&watcher->mutex);
+	dir_watch_pick_free(&pick);
+	dstr_free(&selected_path);
+}
+
+/* Keeps a random file ready for the hotkey, drawn again when it is taken or
+ * no longer part of the view */
+static void dir_watch_watcher_draw(struct dir_watch_watcher *watcher,
+				   struct dir_watch_subscriber *sub)
+{
+	const size_t dir_len = strlen(watcher->index.directory);
+	pthread_mutex_lock(&watcher->mutex);
+	bool valid = false;
+	if (sub->random && sub->scan_gen == sub->config_gen) {
+		struct dir_watch_entry *entry = dir_watch_index_find(
+			&watcher->index, sub->random + dir_len + 1);
+		valid = entry && dir_watch_view_matches(&sub->view, entry);
+	}
+	if (valid)
+		sub->random_count = dir_watch_view_count(&sub->view);
+	pthread_mutex_unlock(&watcher->mutex);
+	if (valid)
+		return;
+
+	struct dstr path;
+	dstr_init(&path);
+	const struct dir_watch_entry *entry =
+		dir_watch_view_draw(&sub->view);
+	if (entry) {
+		dstr_copy(&path, watcher->index.directory);
+		dstr_cat_ch(&path, '/');
+		dstr_cat(&path, entry->name);
+	}
+	pthread_mutex_lock(&watcher->mutex);
+	if (sub->scan_gen == sub->config_gen) {
+		bfree(sub->random);
+		sub->random = path.array;
+		sub->random_count = dir_watch_view_count(&sub->view);
+		path.array = NULL;
+	}
+	pthread_mutex_unlock(&watcher->mutex);
+	dstr_free(&path);
+}
+
+/* The snapshot of a directory in the plugin config */
+static char *dir_watch_watcher_snapshot_file(const char *directory)
+{
+	uint64_t hash = 14695981039346656037ULL;
+	for (const char *c = directory; *c; c++) {
+		hash ^= (uint8_t)*c;
+		hash *= 1099511628211ULL;
+	}
+	struct dstr name;
+	dstr_init(&name);
+	dstr_printf(&name, "index/%016llx.bin", (unsigned long long)hash);
+	char *file = obs_module_config_path(name.array);
+	dstr_free(&name);
+	return file;
+}
+
+/* Writes the snapshot when the index changed since, at most once per
+ * interval unless forced */
+static void dir_watch_watcher_save(struct dir_watch_watcher *watcher,
+				   bool force)
+{
+	if (!watcher->snapshot || !watcher->index.root ||
+	    watcher->index.changes == watcher->snapshot_changes)
+		return;
+	const uint64_t now = os_gettime_ns();
+	if (!force && watcher->snapshot_time &&
+	    now - watcher->snapshot_time < SNAPSHOT_INTERVAL_NS)
+		return;
+	watcher->snapshot_time = now;
+	watcher->snapshot_changes = watcher->index.changes;
+	if (!watcher->snapshot_file)
+		watcher->snapshot_file =
+			dir_watch_watcher_snapshot_file(watcher->directory);
+	char *folder = obs_module_config_path("index");
+	if (folder)
+		os_mkdirs(folder);
+	bfree(folder);
+	if (!watcher->snapshot_file ||
+	    !dir_watch_index_save(&watcher->index, watcher->snapshot_file))
+		blog(LOG_WARNING,
+		     "[Directory watch media] failed to save the index of '%s'",
+		     watcher->directory);
+}
+
+static bool dir_watch_watcher_load(struct dir_watch_watcher *watcher)
+{
+	if (!watcher->snapshot_file)
+		watcher->snapshot_file =
+			dir_watch_watcher_snapshot_file(watcher->directory);
+	if (!watcher->snapshot_file ||
+	    !dir_watch_index_load(&watcher->index, watcher->snapshot_file))
+		return false;
+	watcher->snapshot_changes = watcher->index.changes;
+	return true;
+}
+
+static void dir_watch_watcher_publish(struct dir_watch_watcher *watcher)
+{
+	watcher->rotate_time = os_gettime_ns();
+	for (size_t i = 0; i < watcher->attached.num; i++) {
+		struct dir_watch_subscriber *sub = watcher->attached.array[i];
+		if (sub->publish)
+			dir_watch_watcher_select(watcher, sub);
+		dir_watch_watcher_draw(watcher, sub);
+	}
+}
+
+/* Picks a new random file without scanning, the watch keeps the listing
+ * current */
+static void dir_watch_watcher_rotate(struct dir_watch_watcher *watcher)
+{
+	watcher->rotate_time = os_gettime_ns();
+	for (size_t i = 0; i < watcher->attached.num; i++) {
+		struct dir_watch_subscriber *sub = watcher->attached.array[i];
+		if (sub->rotate)
+			dir_watch_watcher_select(watcher, sub);
+	}
+}
+
+/* Hands the changes of the views to the subscribers */
+static void dir_watch_watcher_collect(struct dir_watch_watcher *watcher)
+{
+	pthread_mutex_lock(&watcher->mutex);
+	for (size_t i = 0; i < watcher->attached.num; i++) {
+		struct dir_watch_subscriber *sub = watcher->attached.array[i];
+		dir_watch_view_changes_move(&sub->changes, &sub->view.changes);
+	}
+	pthread_mutex_unlock(&watcher->mutex);
+}
+
+static void
+dir_watch_watcher_add_stats(struct dir_watch_watcher *watcher,
+			    const struct dir_watch_index_stats *before)
+{
+	const uint64_t duration = os_gettime_ns() - watcher->scan_start;
+	const struct dir_watch_index_stats *after = &watcher->index.stats;
+	size_t bucket = 0;
+	while (bucket < DIR_WATCH_SCAN_BUCKETS - 1 &&
+	       duration >= (1000000ULL << bucket))
+		bucket++;
+
+	pthread_mutex_lock(&watcher->mutex);
+	for (size_t i = 0; i < watcher->attached.num; i++) {
+		struct dir_watch_scan_stats *stats =
+			&watcher->attached.array[i]->stats;
+		stats->scans++;
+		stats->scan_time_total += duration;
+		if (duration > stats->scan_time_max)
+			stats->scan_time_max = duration;
+		stats->histogram[bucket]++;
+		stats->entries += after->entries - before->entries;
+		stats->stat_calls += after->stat_calls - before->stat_calls;
+		stats->open_calls += after->open_calls - before->open_calls;
+	}
+	pthread_mutex_unlock(&watcher->mutex);
+}
+
+static void dir_watch_watcher_scan_dir(struct dir_watch_watcher *watcher,
+				       bool full, bool force)
+{
+	watcher->scan_start = os_gettime_ns();
+	const struct dir_watch_index_stats before = watcher->index.stats;
+	pthread_mutex_lock(&watcher->index_mutex);
+	const int max_depth = dir_watch_watcher_sync(watcher);
+	/* nothing to select from before the first listing */
+	if (!watcher->scan_time)
+		full = true;
+	const bool cleared = dir_watch_index_set_directory(
+		&watcher->index, watcher->directory, max_depth);
+	dir_watch_index_set_stat_threads(&watcher->index,
+					 (size_t)watcher->stat_threads);
+	if (cleared) {
+		full = true;
+		force = true;
+	}
+	for (size_t i = 0; i < watcher->attached.num; i++) {
+		struct dir_watch_subscriber *sub = watcher->attached.array[i];
+		if (!sub->rebuild)
+			continue;
+		sub->rebuild = false;
+		if (sub->indexed) {
+			dir_watch_view_rebuild(&sub->view, &watcher->index);
+		} else {
+			sub->indexed = true;
+			dir_watch_index_add_view(&watcher->index, &sub->view);
+		}
+	}
+
+	/* select from the last session right away, the listing below then
+	 * only reads the folders that changed since */
+	if (cleared && watcher->snapshot && dir_watch_watcher_load(watcher)) {
+		dir_watch_watcher_publish(watcher);
+		force = false;
+	}
+	/* the listing takes the lock itself, only while it changes the
+	 * index */
+	pthread_mutex_unlock(&watcher->index_mutex);
+
+	bool listed = true;
+	watcher->recheck_time = 0;
+	if (full) {
+		watcher->scan_time = os_gettime_ns();
+		dir_watch_watcher_clear_changes(watcher);
+		listed = dir_watch_index_scan(&watcher->index, force);
+	} else {
+		for (size_t i = 0; i < watcher->changes.num; i++)
+			dir_watch_index_refresh(&watcher->index,
+						watcher->changes.array[i]);
+		dir_watch_watcher_clear_changes(watcher);
+	}
+	pthread_mutex_lock(&watcher->index_mutex);
+	if (listed) {
+		dir_watch_watcher_publish(watcher);
+#ifdef __linux__
+		dir_watch_watcher_clear_writes(watcher, false);
+#endif
+	}
+	dir_watch_watcher_collect(watcher);
+	pthread_mutex_unlock(&watcher->index_mutex);
+	/* do not keep the directory busy between scans */
+	dir_watch_index_close(&watcher->index);
+	dir_watch_watcher_add_stats(watcher, &before);
+}
+
+static void dir_watch_watcher_signal(struct dir_watch_watcher *watcher)
+{
+	os_event_signal(watcher->wake);
+#ifdef __linux__
+	if (watcher->wake_fd >= 0)
+		eventfd_write(watcher->wake_fd, 1);
+#endif
+}
+
+enum watch_result {
+	watch_stop,
+	watch_woken,
+	watch_timeout,
+	watch_rotate,
+	watch_recheck,
+	watch_changed,
+};
+
+/* The scan interval backed off for the polls that found nothing, random
+ * order keeps picking at the scan interval */
+static long long dir_watch_watcher_poll_time(struct dir_watch_watcher *watcher,
+					     long long scan_interval)
+{
+	long long interval = scan_interval;
+	for (int i = 0; i < watcher->idle_polls; i++) {
+		if (interval * 2 > IDLE_BACKOFF_MAX_MS)
+			return interval > scan_interval ? IDLE_BACKOFF_MAX_MS
+							: scan_interval;
+		interval *= 2;
+	}
+	return interval;
+}
+
+/* Milliseconds until interval passed since time, rounded up as waking
+ * early only leads to another wait */
+static long long dir_watch_watcher_due(uint64_t now, uint64_t time,
+				       long long interval)
+{
+	const uint64_t next = time + (uint64_t)interval * 1000000;
+	return next > now ? (long long)((next - now + 999999) / 1000000) : 0;
+}
+
+/* milliseconds until the next poll, rotation or recheck, -1 when there is
+ * none */
+static long long dir_watch_watcher_wait_time(struct dir_watch_watcher *watcher,
+					     long long poll_interval,
+					     long long rotate_interval)
+{
+	const uint64_t now = os_gettime_ns();
+	long long timeout = -1;
+	if (poll_interval > 0)
+		timeout = dir_watch_watcher_due(now, watcher->scan_time,
+						poll_interval);
+	if (rotate_interval > 0) {
+		const long long rotate = dir_watch_watcher_due(
+			now, watcher->rotate_time, rotate_interval);
+		if (timeout < 0 || rotate < timeout)
+			timeout = rotate;
+	}
+	if (watcher->recheck_time) {
+		const long long recheck =
+			watcher->recheck_time > now
+				? (long long)((watcher->recheck_time - now) /
+					      1000000) +
+					  1
+				: 0;
+		if (timeout < 0 || recheck < timeout)
+			timeout = recheck;
+	}
+	return timeout;
+}
+
+static enum watch_result
+dir_watch_watcher_timed_out(struct dir_watch_watcher *watcher,
+			    long long poll_interval, long long rotate_interval)
+{
+	const uint64_t now = os_gettime_ns();
+	if (poll_interval > 0 &&
+	    now >= watcher->scan_time + (uint64_t)poll_interval * 1000000)
+		return watch_timeout;
+	if (rotate_interval > 0 &&
+	    now >= watcher->rotate_time + (uint64_t)rotate_interval * 1000000)
+		return watch_rotate;
+	return watch_recheck;
+}
+
+static enum watch_result
+dir_watch_watcher_event_wait(struct dir_watch_watcher *watcher,
+			     long long scan_interval, long long rotate_interval)
+{
+	const long long poll_interval =
+		dir_watch_watcher_poll_time(watcher, scan_interval);
+	const long long timeout =
+		dir_watch_watcher_wait_time(watcher, poll_interval,
+					    rotate_interval);
+	int ret;
+	if (timeout >= 0)
+		ret = os_event_timedwait(watcher->wake,
+					 (unsigned long)timeout);
+	else
+		ret = os_event_wait(watcher->wake);
+	if (ret == EINVAL)
+		return watch_stop;
+	if (ret == 0)
+		return watch_woken;
+	return dir_watch_watcher_timed_out(watcher, poll_interval,
+					   rotate_interval);
+}
+
+#ifdef __linux__
+#define INOTIFY_MASK                                                 \
+	(IN_CREATE | IN_CLOSE_WRITE | IN_MOVED_TO | IN_DELETE |      \
+	 IN_MOVED_FROM | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR)
+
+static void dir_watch_watcher_folder_added(void *param,
+					   struct dir_watch_folder *folder)
+{
+	struct dir_watch_watcher *watcher = param;
+	/* subdirectories are only watched together with the directory */
+	if (watcher->watch_descriptor < 0 || !*folder->path ||
+	    folder->watch >= 0)
+		return;
+
+	struct dstr path;
+	dstr_init(&path);
+	dstr_copy(&path, watcher->watched_directory);
+	dstr_cat_ch(&path, '/');
+	dstr_cat(&path, folder->path);
+	folder->watch = inotify_add_watch(watcher->inotify_fd, path.array,
+					  INOTIFY_MASK);
+	dstr_free(&path);
+	if (folder->watch < 0)
+		return;
+
+	struct folder_watch item = {folder->watch, folder};
+	size_t idx = watcher->folder_watches.num;
+	while (idx > 0 && watcher->folder_watches.array[idx - 1].watch >
+				  item.watch)
+		idx--;
+	da_insert(watcher->folder_watches, idx, &item);
+}
+
+static size_t dir_watch_watcher_find_watch(struct dir_watch_watcher *watcher,
+					   int watch)
+{
+	size_t low = 0;
+	size_t high = watcher->folder_watches.num;
+	while (low < high) {
+		const size_t mid = (low + high) / 2;
+		const int mid_watch = watcher->folder_watches.array[mid].watch;
+		if (mid_watch == watch)
+			return mid;
+		if (mid_watch < watch)
+			low = mid + 1;
+		else
+			high = mid;
+	}
+	return DARRAY_INVALID;
+}
+
+static void dir_watch_watcher_folder_removed(void *param,
+					     struct dir_watch_folder *folder)
+{
+	struct dir_watch_watcher *watcher = param;
+	if (folder->watch < 0)
+		return;
+	const size_t idx =
+		dir_watch_watcher_find_watch(watcher, folder->watch);
+	if (idx != DARRAY_INVALID) {
+		inotify_rm_watch(watcher->inotify_fd, folder->watch);
+		da_erase(watcher->folder_watches, idx);
+	}
+	folder->watch = -1;
+}
+
+static void dir_watch_watcher_inotify_remove(struct dir_watch_watcher *watcher)
+{
+	for (size_t i = 0; i < watcher->folder_watches.num; i++) {
+		struct folder_watch *item = &watcher->folder_watches.array[i];
+		inotify_rm_watch(watcher->inotify_fd, item->watch);
+		item->folder->watch = -1;
+	}
+	watcher->folder_watches.num = 0;
+
+	if (watcher->watch_descriptor >= 0)
+		inotify_rm_watch(watcher->inotify_fd,
+				 watcher->watch_descriptor);
+	watcher->watch_descriptor = -1;
+	bfree(watcher->watched_directory);
+	watcher->watched_directory = NULL;
+	dir_watch_watcher_clear_writes(watcher, true);
+}
+
+/* returns true when a new watch was added */
+static bool dir_watch_watcher_inotify_add(struct dir_watch_watcher *watcher,
+					  const char *directory)
+{
+	if (watcher->watch_descriptor >= 0 && directory &&
+	    strcmp(watcher->watched_directory, directory) == 0)
+		return false;
+	dir_watch_watcher_inotify_remove(watcher);
+	if (!directory)
+		return false;
+
+	watcher->watch_descriptor = inotify_add_watch(watcher->inotify_fd,
+						      directory, INOTIFY_MASK);
+	if (watcher->watch_descriptor < 0) {
+		if (errno == ENOSPC)
+			blog(LOG_WARNING,
+			     "[Directory watch media] inotify watch limit reached, polling '%s'",
+			     directory);
+		return false;
+	}
+	watcher->watched_directory = bstrdup(directory);
+	/* subdirectories that are already known */
+	if (watcher->index.directory &&
+	    strcmp(watcher->index.directory, directory) == 0)
+		dir_watch_index_enum_folders(&watcher->index,
+					     dir_watch_watcher_folder_added,
+					     watcher);
+	return true;
+}
+
+/* returns true when the directory content changed */
+static bool dir_watch_watcher_inotify_read(struct dir_watch_watcher *watcher)
+{
+	char buffer[4096]
+		__attribute__((aligned(__alignof__(struct inotify_event))));
+	struct dstr name;
+	dstr_init(&name);
+	bool changed = false;
+
+	for (;;) {
+		const ssize_t len = read(watcher->inotify_fd, buffer,
+					 sizeof(buffer));
+		if (len <= 0)
+			break;
+		for (char *ptr = buffer; ptr < buffer + len;) {
+			const struct inotify_event *event =
+				(const struct inotify_event *)ptr;
+			ptr += sizeof(struct inotify_event) + event->len;
+			if (event->mask & IN_Q_OVERFLOW) {
+				dir_watch_watcher_clear_writes(watcher, true);
+				watcher->full_rescan = true;
+				changed = true;
+				continue;
+			}
+
+			const char *folder = NULL;
+			if (event->wd == watcher->watch_descriptor &&
+			    event->wd >= 0) {
+				folder = "";
+			} else {
+				const size_t idx = dir_watch_watcher_find_watch(
+					watcher, event->wd);
+				if (idx == DARRAY_INVALID)
+					continue;
+				struct folder_watch *item =
+					&watcher->folder_watches.array[idx];
+				folder = item->folder->path;
+				if (event->mask & IN_IGNORED) {
+					/* the parent reports the removal */
+					item->folder->watch = -1;
+					da_erase(watcher->folder_watches, idx);
+					continue;
+				}
+			}
+
+			if (!event->len) {
+				/* subdirectories report through their parent */
+				if (*folder)
+					continue;
+				/* directory itself moved or removed */
+				watcher->full_rescan = true;
+				changed = true;
+				if (!(event->mask & IN_IGNORED))
+					continue;
+				watcher->watch_descriptor = -1;
+				dir_watch_watcher_inotify_remove(watcher);
+				continue;
+			}
+
+			dstr_copy(&name, folder);
+			if (*folder)
+				dstr_cat_ch(&name, '/');
+			dstr_cat(&name, event->name);
+			if (!(event->mask & IN_ISDIR))
+				dir_watch_watcher_track_write(
+					watcher, name.array, event->mask);
+			dir_watch_watcher_add_change(watcher, name.array);
+			changed = true;
+		}
+	}
+	dstr_free(&name);
+	return changed;
+}
+
+static enum watch_result
+dir_watch_watcher_inotify_wait(struct dir_watch_watcher *watcher,
+			       long long scan_interval,
+			       long long rotate_interval)
+{
+	if (scan_interval > 0) {
+		if (dir_watch_watcher_inotify_add(watcher,
+						  watcher->directory)) {
+			watcher->full_rescan = true;
+			return watch_changed;
+		}
+	} else {
+		dir_watch_watcher_inotify_remove(watcher);
+	}
+
+	struct pollfd fds[2] = {
+		{.fd = watcher->wake_fd, .events = POLLIN},
+		{.fd = watcher->inotify_fd, .events = POLLIN},
+	};
+	/* without a watch fall back to polling at the scan interval, with
+	 * one the listing only has to be read when files change but random
+	 * order still picks a new file every interval */
+	const long long poll_interval =
+		watcher->watch_descriptor < 0
+			? dir_watch_watcher_poll_time(watcher, scan_interval)
+			: 0;
+	const long long timeout = dir_watch_watcher_wait_time(
+		watcher, poll_interval, rotate_interval);
+	const int ret =
+		poll(fds, 2, timeout > INT_MAX ? INT_MAX : (int)timeout);
+	if (ret == 0)
+		return dir_watch_watcher_timed_out(watcher, poll_interval,
+						   rotate_interval);
+	if (ret < 0)
+		return errno == EINTR ? watch_woken : watch_stop;
+
+	enum watch_result result = watch_woken;
+	if (fds[0].revents & POLLIN) {
+		eventfd_t value;
+		eventfd_read(watcher->wake_fd, &value);
+	}
+	if ((fds[1].revents & POLLIN) &&
+	    dir_watch_watcher_inotify_read(watcher))
+		result = watch_changed;
+	return result;
+}
+#endif
+
+/* The most frequent interval of all subscribers, rotate_interval that of
+ * the ones in random order */
+static long long dir_watch_watcher_interval(struct dir_watch_watcher *watcher,
+					    long long *rotate_interval)
+{
+	long long scan_interval = 0;
+	*rotate_interval = 0;
+	pthread_mutex_lock(&watcher->mutex);
+	for (struct dir_watch_subscriber *sub = watcher->subscribers; sub;
+	     sub = sub->next) {
+		if (sub->scan_interval <= 0)
+			continue;
+		if (!scan_interval || sub->scan_interval < scan_interval)
+			scan_interval = sub->scan_interval;
+		if (sub->sort_by == sort_random &&
+		    (!*rotate_interval ||
+		     sub->scan_interval < *rotate_interval))
+			*rotate_interval = sub->scan_interval;
+	}
+	pthread_mutex_unlock(&watcher->mutex);
+	return scan_interval;
+}
+
+static void *dir_watch_watcher_thread(void *data)
+{
+	struct dir_watch_watcher *watcher = data;
+	os_set_thread_name("dir-watch-media: watcher");
+
+	while (!os_atomic_load_bool(&watcher->stopping)) {
+		long long rotate_interval;
+		const long long scan_interval =
+			dir_watch_watcher_interval(watcher, &rotate_interval);
+
+		enum watch_result result;
+#ifdef __linux__
+		if (watcher->inotify_fd >= 0)
+			result = dir_watch_watcher_inotify_wait(
+				watcher, scan_interval, rotate_interval);
+		else
+#endif
+			result = dir_watch_watcher_event_wait(
+				watcher, scan_interval, rotate_interval);
+		if (result == watch_stop ||
+		    os_atomic_load_bool(&watcher->stopping))
+			break;
+
+		pthread_mutex_lock(&watcher->mutex);
+		const bool scan_requested = watcher->scan_requested;
+		const bool reselect = watcher->reselect;
+		const bool draw_requested = watcher->draw_requested;
+		watcher->scan_requested = false;
+		watcher->reselect = false;
+		watcher->draw_requested = false;
+		pthread_mutex_unlock(&watcher->mutex);
+		/* woken up or due to rotate, only scan when that was asked
+		 * for */
+		if ((result == watch_woken || result == watch_rotate) &&
+		    !scan_requested && !reselect) {
+			pthread_mutex_lock(&watcher->index_mutex);
+			if (result == watch_rotate)
+				dir_watch_watcher_rotate(watcher);
+			for (size_t i = 0;
+			     draw_requested && i < watcher->attached.num; i++)
+				dir_watch_watcher_draw(
+					watcher, watcher->attached.array[i]);
+			pthread_mutex_unlock(&watcher->index_mutex);
+			continue;
+		}
+		/* only file changes reported by the watch can skip the full
+		 * listing, unchanged folders are skipped when polling */
+		const bool force = scan_requested || watcher->full_rescan;
+		const bool full = ((result == watch_timeout ||
+				    result == watch_woken) &&
+				   !reselect) ||
+				  force;
+		watcher->full_rescan = false;
+		const uint64_t changes = watcher->index.changes;
+		dir_watch_watcher_scan_dir(watcher, full, force);
+		dir_watch_watcher_save(watcher, false);
+		if (watcher->index.changes != changes || scan_requested)
+			watcher->idle_polls = 0;
+		else if (result == watch_timeout &&
+			 watcher->idle_polls < IDLE_BACKOFF_STEPS)
+			watcher->idle_polls++;
+	}
+	return NULL;
+}
+
+static void dir_watch_watcher_destroy(struct dir_watch_watcher *watcher)
+{
+	if (!watcher)
+		return;
+	if (watcher->thread_created) {
+		os_atomic_set_bool(&watcher->stopping, true);
+		dir_watch_watcher_signal(watcher);
+		pthread_join(watcher->thread, NULL);
+	}
+	dir_watch_watcher_save(watcher, true);
+#ifdef __linux__
+	if (watcher->inotify_fd >= 0) {
+		dir_watch_watcher_inotify_remove(watcher);
+		close(watcher->inotify_fd);
+	}
+	watcher->inotify_fd = -1;
+	if (watcher->wake_fd >= 0)
+		close(watcher->wake_fd);
+#endif
+	os_event_destroy(watcher->wake);
+	pthread_mutex_destroy(&watcher->mutex);
+	pthread_mutex_destroy(&watcher->index_mutex);
+	dir_watch_index_free(&watcher->index);
+	for (size_t i = 0; i < watcher->attached.num; i++)
+		dir_watch_subscriber_release(watcher->attached.array[i]);
+	da_free(watcher->attached);
+	dir_watch_watcher_clear_changes(watcher);
+	da_free(watcher->changes);
+#ifdef __linux__
+	da_free(watcher->folder_watches);
+	dir_watch_watcher_clear_writes(watcher, true);
+	da_free(watcher->writes);
+#endif
+	bfree(watcher->snapshot_file);
+	bfree(watcher->directory);
+	bfree(watcher);
+}
+
+static struct dir_watch_watcher *dir_watch_watcher_create(const char *directory)
+{
+	struct dir_watch_watcher *watcher =
+		bzalloc(sizeof(struct dir_watch_watcher));
+	watcher->directory = bstrdup(directory);
+	pthread_mutex_init_value(&watcher->mutex);
+	pthread_mutex_init_value(&watcher->index_mutex);
+	dir_watch_index_init(&watcher->index);
+#ifdef __linux__
+	watcher->index.folder_added = dir_watch_watcher_folder_added;
+	watcher->index.folder_removed = dir_watch_watcher_folder_removed;
+	watcher->index.param = watcher;
+	watcher->watch_descriptor = -1;
+	watcher->wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	watcher->inotify_fd = watcher->wake_fd >= 0
+				      ? inotify_init1(IN_CLOEXEC | IN_NONBLOCK)
+				      : -1;
+#endif
+	if (pthread_mutex_init(&watcher->mutex, NULL) != 0)
+		goto fail;
+	if (pthread_mutex_init(&watcher->index_mutex, NULL) != 0)
+		goto fail;
+	watcher->index.mutex = &watcher->index_mutex;
+	/* a scan in progress does not hold up the thread being joined */
+	watcher->index.stopping = &watcher->stopping;
+	if (os_event_init(&watcher->wake, OS_EVENT_TYPE_AUTO) != 0)
+		goto fail;
+	if (pthread_create(&watcher->thread, NULL, dir_watch_watcher_thread,
+			   watcher) != 0)
+		goto fail;
+	watcher->thread_created = true;
+	return watcher;
+
+fail:
+	blog(LOG_WARNING,
+	     "[Directory watch media] failed to create watcher thread");
+	dir_watch_watcher_destroy(watcher);
+	return NULL;
+}
+
+/* Returns the watcher of the directory, started for the first user */
+static struct dir_watch_watcher *
+dir_watch_watcher_acquire(const char *directory)
+{
+	pthread_mutex_lock(&registry_mutex);
+	struct dir_watch_watcher *watcher = registry;
+	while (watcher && strcmp(watcher->directory, directory) != 0)
+		watcher = watcher->next;
+	if (!watcher) {
+		watcher = dir_watch_watcher_create(directory);
+		if (watcher) {
+			watcher->next = registry;
+			registry = watcher;
+		}
+	}
+	if (watcher)
+		watcher->refs++;
+	pthread_mutex_unlock(&registry_mutex);
+	return watcher;
+}
+
+static void dir_watch_watcher_release(struct dir_watch_watcher *watcher)
+{
+	pthread_mutex_lock(&registry_mutex);
+	const bool last = --watcher->refs == 0;
+	if (last) {
+		struct dir_watch_watcher **prev = &registry;
+		while (*prev != watcher)
+			prev = &(*prev)->next;
+		*prev = watcher->next;
+	}
+	pthread_mutex_unlock(&registry_mutex);
+	if (last)
+		dir_watch_watcher_destroy(watcher);
+}
+
+/* The same directory reached through different paths shares a watcher */
+static char *canonical_directory(const char *directory)
+{
+	if (!directory || !*directory)
+		return NULL;
+	char *path = os_get_abs_path_ptr(directory);
+	if (!path)
+		path = bstrdup(directory);
+	size_t len = strlen(path);
+	while (len > 1 && (path[len - 1] == '/' || path[len - 1] == '\\'))
+		path[--len] = 0;
+	return path;
+}
+
+static void dir_watch_subscriber_remove(struct dir_watch_subscriber *sub)
+{
+	struct dir_watch_watcher *watcher = sub->watcher;
+	pthread_mutex_lock(&watcher->mutex);
+	struct dir_watch_subscriber **prev = &watcher->subscribers;
+	while (*prev != sub)
+		prev = &(*prev)->next;
+	*prev = sub->next;
+	sub->removed = true;
+	pthread_mutex_unlock(&watcher->mutex);
+	dir_watch_watcher_signal(watcher);
+	dir_watch_subscriber_release(sub);
+	dir_watch_watcher_release(watcher);
+}
+
+static struct dir_watch_subscriber *
+dir_watch_subscriber_add(const char *directory)
+{
+	struct dir_watch_watcher *watcher =
+		dir_watch_watcher_acquire(directory);
+	if (!watcher)
+		return NULL;
+	struct dir_watch_subscriber *sub =
+		bzalloc(sizeof(struct dir_watch_subscriber));
+	sub->refs = 1;
+	sub->watcher = watcher;
+	dir_watch_view_init(&sub->view);
+	pthread_mutex_lock(&watcher->mutex);
+	sub->next = watcher->subscribers;
+	watcher->subscribers = sub;
+	pthread_mutex_unlock(&watcher->mutex);
+	return sub;
+}
+
+/* Applies the settings of the filter to the subscriber of one of its
+ * directories */
+static void dir_watch_subscriber_configure(struct dir_watch_subscriber *sub,
+					   struct dir_watch_matcher *matcher,
+					   enum sort_by sort_by,
+					   long long scan_interval,
+					   int max_depth, bool snapshot,
+					   int stat_threads, bool added)
+{
+	struct dir_watch_watcher *watcher = sub->watcher;
+	pthread_mutex_lock(&watcher->mutex);
+	bool reset = added;
+	if (sort_by != sub->sort_by) {
+		sub->sort_by = sort_by;
+		reset = true;
+	}
+	if (!dir_watch_matcher_equal(sub->matcher, matcher)) {
+		dir_watch_matcher_addref(matcher);
+		dir_watch_matcher_release(sub->matcher);
+		sub->matcher = matcher;
+		reset = true;
+	}
+	if (max_depth != sub->max_depth) {
+		sub->max_depth = max_depth;
+		reset = true;
+	}
+	if (reset) {
+		sub->reset_time = true;
+		sub->config_gen++;
+		bfree(sub->random);
+		sub->random = NULL;
+	}
+	const bool interval_changed = scan_interval != sub->scan_interval;
+	sub->scan_interval = scan_interval;
+	sub->snapshot = snapshot;
+	sub->stat_threads = stat_threads;
+	/* the shared index can answer the new settings without listing
+	 * again */
+	if (reset && scan_interval > 0)
+		watcher->reselect = true;
+	pthread_mutex_unlock(&watcher->mutex);
+
+	/* let the thread pick up the new settings */
+	if (interval_changed || reset)
+		dir_watch_watcher_signal(watcher);
+}
+
+/* Returns the source whose pick comes first in the sort order, random picks
+ * are chosen in proportion to the files of their directory */
+static struct dir_watch_source *
+dir_watch_subscription_merge(struct dir_watch_subscription *subscription)
+{
+	const enum sort_by sort_by = subscription->sort_by;
+	struct dir_watch_source *best = NULL;
+	size_t total = 0;
+	for (size_t i = 0; i < subscription->sources.num; i++) {
+		struct dir_watch_source *source =
+			&subscription->sources.array[i];
+		if (!source->pick.path || !*source->pick.path)
+			continue;
+		if (sort_by == sort_random) {
+			const size_t count =
+				source->pick.count ? source->pick.count : 1;
+			total += count;
+			if (dir_watch_random_below(&subscription->random_state,
+						   total) < count)
+				best = source;
+			continue;
+		}
+		if (!best) {
+			best = source;
+			continue;
+		}
+		const int cmp = dir_watch_entry_compare(
+			sort_by, &source->pick.key, &best->pick.key);
+		if (sort_selects_last(sort_by) ? cmp > 0 : cmp < 0)
+			best = source;
+	}
+	return best;
+}
+
+struct dir_watch_subscription *dir_watch_subscription_create(void)
+{
+	struct dir_watch_subscription *subscription =
+		bzalloc(sizeof(struct dir_watch_subscription));
+	pthread_mutex_init_value(&subscription->mutex);
+	if (pthread_mutex_init(&subscription->mutex, NULL) != 0) {
+		bfree(subscription);
+		return NULL;
+	}
+	subscription->random_state =
+		os_gettime_ns() ^ (uint64_t)(uintptr_t)subscription;
+	return subscription;
+}
+
+static void dir_watch_source_free(struct dir_watch_source *source)
+{
+	dir_watch_subscriber_remove(source->subscriber);
+	dir_watch_pick_free(&source->pick);
+}
+
+void dir_watch_subscription_destroy(struct dir_watch_subscription *subscription)
+{
+	if (!subscription)
+		return;
+	for (size_t i = 0; i < subscription->sources.num; i++)
+		dir_watch_source_free(&subscription->sources.array[i]);
+	da_free(subscription->sources);
+	pthread_mutex_destroy(&subscription->mutex);
+	bfree(subscription);
+}
+
+void dir_watch_subscription_update(struct dir_watch_subscription *subscription,
+				   const char *const *directories,
+				   size_t count,
+				   struct dir_watch_matcher *matcher,
+				   enum sort_by sort_by,
+				   long long scan_interval, int max_depth,
+				   bool snapshot, int stat_threads)
+{
+	if (!subscription)
+		return;
+	DARRAY(struct dir_watch_source) previous;
+	DARRAY(struct dir_watch_source) sources;
+	da_init(previous);
+	da_init(sources);
+	pthread_mutex_lock(&subscription->mutex);
+	da_move(previous, subscription->sources);
+	subscription->sort_by = sort_by;
+	pthread_mutex_unlock(&subscription->mutex);
+
+	for (size_t i = 0; i < count; i++) {
+		char *canonical = canonical_directory(directories[i]);
+		if (!canonical)
+			continue;
+		bool found = false;
+		for (size_t j = 0; j < sources.num && !found; j++)
+			found = strcmp(sources.array[j]
+					       .subscriber->watcher->directory,
+				       canonical) == 0;
+		/* kept with its last result when it was watched already */
+		for (size_t j = 0; j < previous.num && !found; j++) {
+			struct dir_watch_source *source = &previous.array[j];
+			if (strcmp(source->subscriber->watcher->directory,
+				   canonical) != 0)
+				continue;
+			dir_watch_subscriber_configure(source->subscriber,
+						       matcher, sort_by,
+						       scan_interval, max_depth,
+						       snapshot, stat_threads,
+						       false);
+			da_push_back(sources, source);
+			da_erase(previous, j);
+			found = true;
+		}
+		struct dir_watch_subscriber *sub =
+			found ? NULL : dir_watch_subscriber_add(canonical);
+		if (sub) {
+			struct dir_watch_source source = {sub};
+			dir_watch_subscriber_configure(sub, matcher, sort_by,
+						       scan_interval, max_depth,
+						       snapshot, stat_threads,
+						       true);
+			da_push_back(sources, &source);
+		}
+		bfree(canonical);
+	}
+	const bool removed = previous.num > 0;
+	for (size_t i = 0; i < previous.num; i++)
+		dir_watch_source_free(&previous.array[i]);
+	da_free(previous);
+
+	pthread_mutex_lock(&subscription->mutex);
+	da_move(subscription->sources, sources);
+	if (removed) {
+		subscription->merge_needed = true;
+		subscription->changes_reset = true;
+	}
+	pthread_mutex_unlock(&subscription->mutex);
+}
+
+void dir_watch_subscription_scan(struct dir_watch_subscription *subscription)
+{
+	if (!subscription)
+		return;
+	pthread_mutex_lock(&subscription->mutex);
+	for (size_t i = 0; i < subscription->sources.num; i++) {
+		struct dir_watch_subscriber *sub =
+			subscription->sources.array[i].subscriber;
+		pthread_mutex_lock(&sub->watcher->mutex);
+		sub->scan_requested = true;
+		sub->watcher->scan_requested = true;
+		pthread_mutex_unlock(&sub->watcher->mutex);
+		dir_watch_watcher_signal(sub->watcher);
+	}
+	pthread_mutex_unlock(&subscription->mutex);
+}
+
+char *dir_watch_subscription_take(struct dir_watch_subscription *subscription,
+				  uint64_t *detected, char **next)
+{
+	if (!subscription)
+		return NULL;
+	/* the video thread never waits on a scan or a settings change, try
+	 * again next tick */
+	if (pthread_mutex_trylock(&subscription->mutex) != 0)
+		return NULL;
+	const bool merge = subscription->merge_needed;
+	subscription->merge_needed = false;
+	bool changed = false;
+	for (size_t i = 0; i < subscription->sources.num; i++) {
+		struct dir_watch_source *source =
+			&subscription->sources.array[i];
+		struct dir_watch_subscriber *sub = source->subscriber;
+		if (os_atomic_load_long(&sub->result_gen) ==
+			    source->taken_gen ||
+		    pthread_mutex_trylock(&sub->watcher->mutex) != 0)
+			continue;
+		if (sub->result.path) {
+			dir_watch_pick_free(&source->pick);
+			source->pick = sub->result;
+			memset(&sub->result, 0, sizeof(sub->result));
+			source->detected = sub->result_detected;
+			changed = true;
+		}
+		source->taken_gen = os_atomic_load_long(&sub->result_gen);
+		pthread_mutex_unlock(&sub->watcher->mutex);
+	}
+	char *result = NULL;
+	if (changed || merge) {
+		/* only the first file of every directory is compared */
+		const struct dir_watch_source *best =
+			dir_watch_subscription_merge(subscription);
+		result = bstrdup(best ? best->pick.path : "");
+		if (next)
+			*next = best && best->pick.next
+					? bstrdup(best->pick.next)
+					: NULL;
+		*detected = best && changed ? best->detected
+					    : os_gettime_ns();
+	}
+	pthread_mutex_unlock(&subscription->mutex);
+	return result;
+}
+
+char *
+dir_watch_subscription_random(struct dir_watch_subscription *subscription)
+{
+	if (!subscription)
+		return NULL;
+	pthread_mutex_lock(&subscription->mutex);
+	/* a directory with more files is drawn from more often */
+	struct dir_watch_subscriber *chosen = NULL;
+	size_t total = 0;
+	for (size_t i = 0; i < subscription->sources.num; i++) {
+		struct dir_watch_subscriber *sub =
+			subscription->sources.array[i].subscriber;
+		pthread_mutex_lock(&sub->watcher->mutex);
+		const size_t count = sub->random ? sub->random_count : 0;
+		pthread_mutex_unlock(&sub->watcher->mutex);
+		total += count;
+		if (count && dir_watch_random_below(&subscription->random_state,
+						    total) < count)
+			chosen = sub;
+	}
+	char *result = NULL;
+	if (chosen) {
+		pthread_mutex_lock(&chosen->watcher->mutex);
+		result = chosen->random;
+		chosen->random = NULL;
+		chosen->watcher->draw_requested = true;
+		pthread_mutex_unlock(&chosen->watcher->mutex);
+		/* draw the next one */
+		dir_watch_watcher_signal(chosen->watcher);
+	}
+	pthread_mutex_unlock(&subscription->mutex);
+	return result;
+}
+
+void dir_watch_subscription_get_stats(
+	struct dir_watch_subscription *subscription,
+	struct dir_watch_scan_stats *stats)
+{
+	memset(stats, 0, sizeof(*stats));
+	if (!subscription)
+		return;
+	pthread_mutex_lock(&subscription->mutex);
+	for (size_t i = 0; i < subscription->sources.num; i++) {
+		struct dir_watch_subscriber *sub =
+			subscription->sources.array[i].subscriber;
+		pthread_mutex_lock(&sub->watcher->mutex);
+		const struct dir_watch_scan_stats *add = &sub->stats;
+		stats->scans += add->scans;
+		stats->scan_time_total += add->scan_time_total;
+		if (add->scan_time_max > stats->scan_time_max)
+			stats->scan_time_max = add->scan_time_max;
+		for (size_t j = 0; j < DIR_WATCH_SCAN_BUCKETS; j++)
+			stats->histogram[j] += add->histogram[j];
+		stats->entries += add->entries;
+		stats->stat_calls += add->stat_calls;
+		stats->open_calls += add->open_calls;
+		pthread_mutex_unlock(&sub->watcher->mutex);
+	}
+	pthread_mutex_unlock(&subscription->mutex);
+}
+
+/* Locks the indexes of all directories in the order of their watchers, so
+ * subscriptions sharing directories cannot wait on each other */
+static void
+dir_watch_subscription_lock_indexes(struct dir_watch_subscription *subscription,
+				    bool lock)
+{
+	uintptr_t last = 0;
+	for (;;) {
+		struct dir_watch_watcher *next = NULL;
+		for (size_t i = 0; i < subscription->sources.num; i++) {
+			struct dir_watch_watcher *watcher =
+				subscription->sources.array[i]
+					.subscriber->watcher;
+			if ((uintptr_t)watcher > last &&
+			    (!next || (uintptr_t)watcher < (uintptr_t)next))
+				next = watcher;
+		}
+		if (!next)
+			break;
+		if (lock)
+			pthread_mutex_lock(&next->index_mutex);
+		else
+			pthread_mutex_unlock(&next->index_mutex);
+		last = (uintptr_t)next;
+	}
+}
+
+/* Passes the files from position offset on to callback, merged across the
+ * directories in selection order, until it returns false. Call with the
+ * indexes locked. */
+static void dir_watch_subscription_walk(
+	struct dir_watch_subscription *subscription, size_t offset,
+	bool (*callback)(void *param, struct dir_watch_subscriber *sub,
+			 const struct dir_watch_entry *entry),
+	void *param)
+{
+	const size_t count = subscription->sources.num;
+	if (count == 1) {
+		struct dir_watch_subscriber *sub =
+			subscription->sources.array[0].subscriber;
+		const struct dir_watch_entry *entry;
+		while ((entry = dir_watch_subscriber_at(sub, offset++)) &&
+		       callback(param, sub, entry))
+			;
+		return;
+	}
+
+	/* only the next file of every directory is compared */
+	const bool last = sort_selects_last(subscription->sort_by);
+	size_t *next = bzalloc(count * sizeof(size_t));
+	for (size_t n = 0;; n++) {
+		struct dir_watch_subscriber *best = NULL;
+		const struct dir_watch_entry *best_entry = NULL;
+		size_t best_index = 0;
+		for (size_t i = 0; i < count; i++) {
+			struct dir_watch_subscriber *sub =
+				subscription->sources.array[i].subscriber;
+			const struct dir_watch_entry *entry =
+				dir_watch_subscriber_at(sub, next[i]);
+			if (!entry)
+				continue;
+			const int cmp =
+				best_entry ? dir_watch_entry_compare(
+						     subscription->sort_by,
+						     entry, best_entry)
+					   : 0;
+			if (!best_entry || (last ? cmp > 0 : cmp < 0)) {
+				best = sub;
+				best_entry = entry;
+				best_index = i;
+			}
+		}
+		if (!best)
+			break;
+		next[best_index]++;
+		if (n >= offset && !callback(param, best, best_entry))
+			break;
+	}
+	bfree(next);
+}
+
+size_t dir_watch_subscription_count(struct dir_watch_subscription *subscription)
+{
+	if (!subscription)
+		return 0;
+	size_t count = 0;
+	pthread_mutex_lock(&subscription->mutex);
+	dir_watch_subscription_lock_indexes(subscription, true);
+	for (size_t i = 0; i < subscription->sources.num; i++)
+		count += dir_watch_view_count(
+			&subscription->sources.array[i].subscriber->view);
+	dir_watch_subscription_lock_indexes(subscription, false);
+	pthread_mutex_unlock(&subscription->mutex);
+	return count;
+}
+
+struct dir_watch_list {
+	struct dir_watch_file *files;
+	size_t count;
+	size_t limit;
+};
+
+static bool dir_watch_list_add(void *param, struct dir_watch_subscriber *sub,
+			       const struct dir_watch_entry *entry)
+{
+	struct dir_watch_list *list = param;
+	struct dir_watch_file *file = &list->files[list->count++];
+	file->path = dir_watch_subscriber_path(sub, entry);
+	file->size = entry->size;
+	file->created = entry->created;
+	file->modified = entry->modified;
+	return list->count < list->limit;
+}
+
+size_t dir_watch_subscription_list(struct dir_watch_subscription *subscription,
+				   size_t offset, size_t limit,
+				   struct dir_watch_file **files,
+				   size_t *total)
+{
+	*files = NULL;
+	*total = 0;
+	if (!subscription)
+		return 0;
+	pthread_mutex_lock(&subscription->mutex);
+	dir_watch_subscription_lock_indexes(subscription, true);
+	for (size_t i = 0; i < subscription->sources.num; i++)
+		*total += dir_watch_view_count(
+			&subscription->sources.array[i].subscriber->view);
+	struct dir_watch_list list = {NULL, 0, limit};
+	if (limit && offset < *total) {
+		if (list.limit > *total - offset)
+			list.limit = *total - offset;
+		list.files =
+			bzalloc(list.limit * sizeof(struct dir_watch_file));
+		dir_watch_subscription_walk(subscription, offset,
+					    dir_watch_list_add, &list);
+	}
+	dir_watch_subscription_lock_indexes(subscription, false);
+	pthread_mutex_unlock(&subscription->mutex);
+	*files = list.files;
+	return list.count;
+}
+
+void dir_watch_files_free(struct dir_watch_file *files, size_t count)
+{
+	for (size_t i = 0; i < count; i++)
+		bfree(files[i].path);
+	bfree(files);
+}
+
+bool dir_watch_subscription_find(struct dir_watch_subscription *subscription,
+				 const char *path, size_t *position)
+{
+	if (!subscription || !path)
+		return false;
+	pthread_mutex_lock(&subscription->mutex);
+	dir_watch_subscription_lock_indexes(subscription, true);
+	struct dir_watch_subscriber *owner = NULL;
+	struct dir_watch_entry *entry = NULL;
+	for (size_t i = 0; i < subscription->sources.num && !entry; i++) {
+		struct dir_watch_subscriber *sub =
+			subscription->sources.array[i].subscriber;
+		const char *directory = sub->watcher->index.directory;
+		const size_t len = directory ? strlen(directory) : 0;
+		if (!len || strncmp(path, directory, len) != 0 ||
+		    path[len] != '/')
+			continue;
+		entry = dir_watch_index_find(&sub->watcher->index,
+					     path + len + 1);
+		owner = sub;
+	}
+	/* a file of the index the view does not hold */
+	const size_t rank =
+		entry ? dir_watch_view_rank(&owner->view, entry, false) : 0;
+	const bool found = entry &&
+			   dir_watch_view_at(&owner->view, rank) == entry;
+	if (found) {
+		/* the files of every directory that come before it, equal
+		 * ones of the directories listed earlier too as the walk
+		 * takes those first */
+		*position = 0;
+		bool earlier = true;
+		for (size_t i = 0; i < subscription->sources.num; i++) {
+			const struct dir_watch_view *view =
+				&subscription->sources.array[i]
+					 .subscriber->view;
+			const size_t count = dir_watch_view_count(view);
+			const bool last = sort_selects_last(view->sort_by);
+			if (view == &owner->view) {
+				*position += last ? count - rank - 1 : rank;
+				earlier = false;
+				continue;
+			}
+			const size_t before = dir_watch_view_rank(
+				view, entry, earlier != last);
+			*position += last ? count - before : before;
+		}
+	}
+	dir_watch_subscription_lock_indexes(subscription, false);
+	pthread_mutex_unlock(&subscription->mutex);
+	return found;
+}
+
+size_t
+dir_watch_subscription_take_changes(struct dir_watch_subscription *subscription,
+				    struct dir_watch_change **changes,
+				    bool *reset)
+{
+	*changes = NULL;
+	*reset = false;
+	if (!subscription ||
+	    pthread_mutex_trylock(&subscription->mutex) != 0)
+		return 0;
+	*reset = subscription->changes_reset;
+	subscription->changes_reset = false;
+	DARRAY(struct dir_watch_change) taken;
+	da_init(taken);
+	for (size_t i = 0; i < subscription->sources.num; i++) {
+		struct dir_watch_subscriber *sub =
+			subscription->sources.array[i].subscriber;
+		if (pthread_mutex_trylock(&sub->watcher->mutex) != 0)
+			continue;
+		struct dir_watch_view_changes *log = &sub->changes;
+		*reset = *reset || log->reset;
+		for (size_t j = 0; j < log->items.num; j++) {
+			const struct dir_watch_view_change *item =
+				&log->items.array[j];
+			struct dir_watch_change change = {NULL, item->added};
+			struct dstr path;
+			dstr_init_copy(&path, sub->watcher->directory);
+			dstr_cat_ch(&path, '/');
+			dstr_cat(&path, log->names.array + item->name);
+			change.path = path.array;
+			da_push_back(taken, &change);
+		}
+		dir_watch_view_changes_clear(log);
+		pthread_mutex_unlock(&sub->watcher->mutex);
+	}
+	pthread_mutex_unlock(&subscription->mutex);
+	/* the listing is read again after a reset */
+	if (*reset) {
+		dir_watch_changes_free(taken.array, taken.num);
+		return 0;
+	}
+	*changes = taken.array;
+	return taken.num;
+}
+
+void dir_watch_changes_free(struct dir_watch_change *changes, size_t count)
+{
+	for (size_t i = 0; i < count; i++)
+		bfree(changes[i].path);
+	bfree(changes);
+}
@@ -0,0 +1,108 @@
+#pragma once
+
+#include "dir-watch-media.h"
+#include "dir-watch-matcher.h"
+#include <time.h>
+
+/* scans under 1 ms, under 2 ms, doubling up to 1024 ms and the rest */
+#define DIR_WATCH_SCAN_BUCKETS 12
+
+/* Scans done for a subscription since its directory was set */
+struct dir_watch_scan_stats {
+	uint64_t scans;
+	uint64_t scan_time_total;
+	uint64_t scan_time_max;
+	uint64_t histogram[DIR_WATCH_SCAN_BUCKETS];
+	uint64_t entries;
+	uint64_t stat_calls;
+	uint64_t open_calls;
+};
+
+/* A filter instance's view on the directories it watches. Filters on the
+ * same directory share one watcher thread and one index, each with its own
+ * sort mode and matcher. The files selected in every directory are merged
+ * in the sort order. */
+struct dir_watch_subscription;
+
+struct dir_watch_subscription *dir_watch_subscription_create(void);
+void dir_watch_subscription_destroy(
+	struct dir_watch_subscription *subscription);
+
+/* With snapshot the directory listing is kept in the plugin config, the
+ * next session selects from it before the directory is read again.
+ * stat_threads file queries run at once while scanning, the most any
+ * filter on a directory asks for. Directories that were watched already
+ * keep their state. */
+void dir_watch_subscription_update(struct dir_watch_subscription *subscription,
+				   const char *const *directories,
+				   size_t count,
+				   struct dir_watch_matcher *matcher,
+				   enum sort_by sort_by,
+				   long long scan_interval, int max_depth,
+				   bool snapshot, int stat_threads);
+
+/* Wakes the watcher threads so they scan right away */
+void dir_watch_subscription_scan(struct dir_watch_subscription *subscription);
+
+/* Returns a random file from the listings without touching the disk, no
+ * file of a directory comes again before all others of it did. NULL when
+ * there is none, otherwise to be freed with bfree */
+char *
+dir_watch_subscription_random(struct dir_watch_subscription *subscription);
+
+/* Never blocks, returns NULL when no new scan result is available,
+ * otherwise the selected path ("" when nothing matched) to be freed with
+ * bfree. detected is set to the time the change was first seen. Unless it
+ * is NULL next is set to the file of the same directory selected after
+ * it, NULL when there is none or the order is random. */
+char *dir_watch_subscription_take(struct dir_watch_subscription *subscription,
+				  uint64_t *detected, char **next);
+
+/* Times are in nanoseconds */
+void dir_watch_subscription_get_stats(
+	struct dir_watch_subscription *subscription,
+	struct dir_watch_scan_stats *stats);
+
+/* A file of the listings, size is -1 and the times are 0 when the file
+ * was not queried */
+struct dir_watch_file {
+	char *path;
+	int64_t size;
+	time_t created;
+	time_t modified;
+};
+
+/* A file that joined or left the listings */
+struct dir_watch_change {
+	char *path;
+	bool added;
+};
+
+/* The queries below are answered from the listings in the order the files
+ * are selected in, the first is the one the sort mode picks. A scan in
+ * progress only holds them up while it changes the listing, not while it
+ * reads the directory, so they may see it partly done. */
+size_t
+dir_watch_subscription_count(struct dir_watch_subscription *subscription);
+
+/* Returns how many of the files from position offset on were stored in
+ * files, at most limit, total is set to the number of files listed. Free
+ * with dir_watch_files_free. */
+size_t dir_watch_subscription_list(struct dir_watch_subscription *subscription,
+				   size_t offset, size_t limit,
+				   struct dir_watch_file **files,
+				   size_t *total);
+void dir_watch_files_free(struct dir_watch_file *files, size_t count);
+
+/* Sets the position of the file, false when it is not listed */
+bool dir_watch_subscription_find(struct dir_watch_subscription *subscription,
+				 const char *path, size_t *position);
+
+/* Never blocks, returns the number of changes since the last call, oldest
+ * first. When more changed than was kept reset is set instead and the
+ * listing has to be read again. Free with dir_watch_changes_free. */
+size_t
+dir_watch_subscription_take_changes(struct dir_watch_subscription *subscription,
+				    struct dir_watch_change **changes,
+				    bool *reset);
+void dir_watch_changes_free(struct dir_watch_change *changes, size_t count);